@@ -0,0 +1,493 @@
+//Physics kernel benchmark.
+//
+//  bench [--kernels body,direct,tiled,tree,particles,fixed] [--sizes 14,1000,...] [--threads 1,2,4,...]
+//        [--mode size,strong,weak] [--min-time 0.2] [--repeat 5] [--max-interactions 4e9]
+//        [--out results.csv] [--baseline baseline.csv] [--tolerance 0.1]
+//
+//Results are CSV, one row per kernel, mode, size and thread count. With --baseline the rows are
+//matched against a stored result file and every configuration whose ns/body-step got slower by
+//more than the tolerance is reported; the exit code is then 1. On Linux the rows also carry hardware
+//counters from perf_event_open (IPC, cache and branch misses, packed SIMD instructions per step).
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+#include "state.h"
+#include "parallel.h"
+#include "physics.h"
+#include "fixed.h"
+#include "scenario.h"
+#include "counters.h"
+
+unsigned int gThreads = 0;
+
+//Flops per pairwise interaction, the usual convention for direct summation
+const double FLOPS_PER_INTERACTION = 20.0;
+
+//The AoS float layout and pair loop of Body::addG / Body::update in main.cpp, including
+//the address comparison the frame loop uses to skip the self term
+struct BenchBody
+{
+	std::string name;
+	float p[3];
+	float v[3];
+	float a[3];
+	float GM;
+	const std::string& getName() const
+	{
+		return name;
+	}
+};
+
+//How the work of a kernel grows with N
+enum Scaling
+{
+	//Every pair, weak scaling keeps N^2 / threads constant
+	SCALING_PAIRS,
+	//Every body against the 14 sources, weak scaling keeps N / threads constant
+	SCALING_SOURCES,
+	//Barnes-Hut, N log N; weak scaling keeps N / threads constant. Interactions are counted
+	//as the pairs the tree replaces, so its rates compare with direct summation
+	SCALING_TREE,
+};
+
+struct Kernel
+{
+	const char* name;
+	Scaling scaling;
+	//Runs on one thread only
+	bool serial;
+	//Estimated compulsory memory traffic per body and step
+	double bytesPerBody;
+};
+
+static const Kernel KERNELS[] =
+{
+	{ "body", SCALING_PAIRS, true, 2.0 * sizeof(BenchBody) },
+	{ "direct", SCALING_PAIRS, false, 6 * 8 * 2 + 3 * 8 * 2 },
+	//The solvers the autotuner picks for large N, at the default tile and opening angle
+	{ "tiled", SCALING_PAIRS, false, 6 * 8 * 2 + 3 * 8 * 2 },
+	{ "tree", SCALING_TREE, false, 6 * 8 * 2 + 3 * 8 * 2 },
+	{ "particles", SCALING_SOURCES, false, 6 * 8 * 2 },
+	{ "fixed", SCALING_PAIRS, false, 6 * 8 * 2 + 3 * 8 * 2 },
+};
+
+struct Result
+{
+	std::string kernel;
+	std::string mode;
+	size_t n;
+	unsigned int threads;
+	long long steps;
+	double seconds;
+	double interactions;
+	double nsPerBodyStep;
+	double gflops;
+	double bytes;
+	//Hardware counters over all measured steps, zero where unavailable
+	PerfSample counters;
+};
+
+//One configured workload, step() advances it once
+class Workload
+{
+public:
+	Workload(const Kernel& k, size_t n)
+		: kernel(k)
+	{
+		if (!strcmp(k.name, "particles"))
+		{
+			generateScenario(SCENARIO_PLUMMER, 14, 1, sources);
+			generateScenario(SCENARIO_BELT, n, 1, state);
+			for (size_t i = 0; i < state.size(); i++)
+				state.gm[i] = 0.0;
+			interactions = (double)n * sources.size();
+		}
+		else
+		{
+			generateScenario(SCENARIO_PLUMMER, n, 1, state);
+			interactions = (double)n * (n - 1);
+		}
+		if (!strcmp(k.name, "body"))
+		{
+			bodies.resize(n);
+			for (size_t i = 0; i < n; i++)
+			{
+				//Body works in km-scale floats, the magnitudes matter less than the layout
+				bodies[i].name = "body" + std::to_string(i);
+				bodies[i].p[0] = (float)state.px[i];
+				bodies[i].p[1] = (float)state.py[i];
+				bodies[i].p[2] = (float)state.pz[i];
+				bodies[i].v[0] = (float)state.vx[i];
+				bodies[i].v[1] = (float)state.vy[i];
+				bodies[i].v[2] = (float)state.vz[i];
+				bodies[i].GM = (float)state.gm[i];
+			}
+		}
+		if (!strcmp(k.name, "fixed"))
+			fixed.load(state);
+	}
+
+	void step()
+	{
+		const float dt = 3600.0f;
+		if (!strcmp(kernel.name, "body"))
+		{
+			for (auto& body : bodies)
+			{
+				body.a[0] = body.a[1] = body.a[2] = 0.0f;
+				for (auto& other : bodies)
+				{
+					if (&body != &other)
+					{
+						float d[3] = { other.p[0] - body.p[0], other.p[1] - body.p[1], other.p[2] - body.p[2] };
+						float dist = std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+						float F = other.GM / (dist * dist * dist);
+						body.a[0] += d[0] * F;
+						body.a[1] += d[1] * F;
+						body.a[2] += d[2] * F;
+					}
+				}
+			}
+			for (auto& body : bodies)
+			{
+				for (int c = 0; c < 3; c++)
+				{
+					body.v[c] += body.a[c] * dt;
+					body.p[c] += body.v[c] * dt;
+				}
+			}
+		}
+		else if (!strcmp(kernel.name, "direct"))
+		{
+			stepState(state, dt, 1e9);
+		}
+		else if (!strcmp(kernel.name, "tiled") || !strcmp(kernel.name, "tree"))
+		{
+			SolverConfig config = DEFAULT_SOLVER;
+			config.solver = !strcmp(kernel.name, "tiled") ? SOLVER_TILED : SOLVER_TREE;
+			stepState(state, dt, 1e9, config);
+		}
+		else if (!strcmp(kernel.name, "particles"))
+		{
+			stepParticles(state, sources, dt);
+		}
+		else
+		{
+			fixed.step(dt);
+		}
+	}
+
+	double interactions;
+
+private:
+	const Kernel& kernel;
+	State state;
+	State sources;
+	std::vector<BenchBody> bodies;
+	FixedIntegrator fixed;
+};
+
+struct Options
+{
+	std::vector<std::string> kernels;
+	std::vector<size_t> sizes;
+	std::vector<unsigned int> threads;
+	std::vector<std::string> modes;
+	double minTime;
+	int repeat;
+	double maxInteractions;
+	std::string out;
+	std::string baseline;
+	double tolerance;
+};
+
+static std::vector<std::string> split(const char* s)
+{
+	std::vector<std::string> items;
+	std::string item;
+	for (const char* c = s; ; c++)
+	{
+		if (*c == ',' || *c == 0)
+		{
+			if (!item.empty())
+				items.push_back(item);
+			item.clear();
+			if (*c == 0)
+				break;
+		}
+		else
+		{
+			item += *c;
+		}
+	}
+	return items;
+}
+
+//Median seconds per step over opt.repeat runs of at least opt.minTime each, counters summed over the runs
+static double measure(Workload& w, const Options& opt, long long& steps, PerfSample& counters)
+{
+	typedef std::chrono::steady_clock Clock;
+	//Warm up and size the run from the first step
+	Clock::time_point start = Clock::now();
+	w.step();
+	double first = std::chrono::duration<double>(Clock::now() - start).count();
+	steps = std::max(1LL, (long long)(opt.minTime / std::max(first, 1e-9)));
+	std::vector<double> times;
+	PerfSample before, after;
+	perfRead(before);
+	for (int r = 0; r < opt.repeat; r++)
+	{
+		start = Clock::now();
+		for (long long s = 0; s < steps; s++)
+			w.step();
+		times.push_back(std::chrono::duration<double>(Clock::now() - start).count() / steps);
+	}
+	perfRead(after);
+	perfDelta(before, after, counters);
+	std::sort(times.begin(), times.end());
+	return times[times.size() / 2];
+}
+
+//Counter columns are per step and left empty when the counter couldn't be opened
+static void printResult(FILE* f, const Result& r, int repeat)
+{
+	fprintf(f, "%s,%s,%llu,%u,%lld,%.6e,%.6e,%.6g,%.6g,%.6g", r.kernel.c_str(), r.mode.c_str(), (unsigned long long)r.n, r.threads,
+		r.steps, r.seconds, r.interactions, r.nsPerBodyStep, r.gflops, r.bytes);
+	double steps = (double)r.steps * repeat;
+	const uint64_t* v = r.counters.value;
+	if (perfAvailable(PERF_CYCLES) && perfAvailable(PERF_INSTRUCTIONS) && v[PERF_CYCLES] > 0)
+		fprintf(f, ",%.4g", (double)v[PERF_INSTRUCTIONS] / v[PERF_CYCLES]);
+	else
+		fprintf(f, ",");
+	const PerfEvent perStep[3] = { PERF_CACHE_MISSES, PERF_BRANCH_MISSES, PERF_VECTOR };
+	for (auto event : perStep)
+	{
+		if (perfAvailable(event))
+			fprintf(f, ",%.6g", v[event] / steps);
+		else
+			fprintf(f, ",");
+	}
+	fprintf(f, "\n");
+}
+
+//Interactions a step computes, about N log N for the tree, checked against --max-interactions
+static double work(const Kernel& k, size_t n)
+{
+	switch (k.scaling)
+	{
+	case SCALING_PAIRS:
+		return (double)n * (n - 1);
+	case SCALING_TREE:
+		return (double)n * std::log2((double)std::max(n, (size_t)2));
+	default:
+		return (double)n * 14;
+	}
+}
+
+static bool run(const Kernel& k, const char* mode, size_t n, unsigned int threads, const Options& opt, std::vector<Result>& results)
+{
+	double interactions = work(k, n);
+	if (interactions > opt.maxInteractions)
+	{
+		fprintf(stderr, "skip %s %s n=%llu: %.3g interactions per step is over the limit\n", k.name, mode, (unsigned long long)n, interactions);
+		return false;
+	}
+	gThreads = threads;
+	Workload w(k, n);
+	Result r;
+	r.kernel = k.name;
+	r.mode = mode;
+	r.n = n;
+	r.threads = threads;
+	r.seconds = measure(w, opt, r.steps, r.counters);
+	r.interactions = w.interactions / r.seconds;
+	r.nsPerBodyStep = r.seconds * 1e9 / n;
+	r.gflops = r.interactions * FLOPS_PER_INTERACTION * 1e-9;
+	r.bytes = k.bytesPerBody * n;
+	results.push_back(r);
+	printResult(stdout, r, opt.repeat);
+	fflush(stdout);
+	return true;
+}
+
+static const char* HEADER = "kernel,mode,n,threads,steps,seconds_per_step,interactions_per_s,ns_per_body_step,gflops,bytes_per_step,"
+	"ipc,cache_misses_per_step,branch_misses_per_step,vector_instructions_per_step";
+
+static bool readResults(const std::string& path, std::map<std::string, double>& rows)
+{
+	FILE* f = fopen(path.c_str(), "r");
+	if (!f)
+		return false;
+	char line[512];
+	while (fgets(line, sizeof(line), f))
+	{
+		std::vector<std::string> fields = split(line);
+		if (fields.size() < 10 || fields[0] == "kernel")
+			continue;
+		rows[fields[0] + "," + fields[1] + "," + fields[2] + "," + fields[3]] = atof(fields[7].c_str());
+	}
+	fclose(f);
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	Options opt;
+	opt.kernels = { "body", "direct", "tiled", "tree", "particles", "fixed" };
+	opt.sizes = { 14, 100, 1000, 10000, 100000, 1000000, 10000000 };
+	opt.modes = { "size", "strong", "weak" };
+	opt.minTime = 0.2;
+	opt.repeat = 5;
+	opt.maxInteractions = 4e9;
+	opt.tolerance = 0.1;
+	unsigned int hardware = std::max(1u, std::thread::hardware_concurrency());
+	for (unsigned int t = 1; t < hardware; t *= 2)
+		opt.threads.push_back(t);
+	opt.threads.push_back(hardware);
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+		if (!value)
+		{
+			fprintf(stderr, "Missing value for %s\n", arg.c_str());
+			return 2;
+		}
+		i++;
+		if (arg == "--kernels")
+			opt.kernels = split(value);
+		else if (arg == "--sizes")
+		{
+			opt.sizes.clear();
+			for (auto& s : split(value))
+				opt.sizes.push_back((size_t)atof(s.c_str()));
+		}
+		else if (arg == "--threads")
+		{
+			opt.threads.clear();
+			for (auto& s : split(value))
+				opt.threads.push_back((unsigned int)atoi(s.c_str()));
+		}
+		else if (arg == "--mode")
+			opt.modes = split(value);
+		else if (arg == "--min-time")
+			opt.minTime = atof(value);
+		else if (arg == "--repeat")
+			opt.repeat = std::max(1, atoi(value));
+		else if (arg == "--max-interactions")
+			opt.maxInteractions = atof(value);
+		else if (arg == "--out")
+			opt.out = value;
+		else if (arg == "--baseline")
+			opt.baseline = value;
+		else if (arg == "--tolerance")
+			opt.tolerance = atof(value);
+		else
+		{
+			fprintf(stderr, "Unknown option %s\n", arg.c_str());
+			return 2;
+		}
+	}
+
+	//Opened before the workers start so their counts are inherited
+	if (!perfOpen())
+		fprintf(stderr, "Hardware counters unavailable (%s), the counter columns stay empty\n", perfError());
+	std::vector<Result> results;
+	printf("%s\n", HEADER);
+	for (auto& name : opt.kernels)
+	{
+		const Kernel* k = NULL;
+		for (auto& candidate : KERNELS)
+			if (name == candidate.name)
+				k = &candidate;
+		if (!k)
+		{
+			fprintf(stderr, "Unknown kernel %s\n", name.c_str());
+			return 2;
+		}
+		unsigned int widest = k->serial ? 1 : opt.threads.back();
+		for (auto& mode : opt.modes)
+		{
+			if (mode == "size")
+			{
+				for (size_t n : opt.sizes)
+					run(*k, "size", n, widest, opt, results);
+			}
+			else if (mode == "strong" && !k->serial)
+			{
+				//Largest size that fits the interaction limit, fixed across thread counts
+				size_t n = 0;
+				for (size_t s : opt.sizes)
+					if (work(*k, s) <= opt.maxInteractions)
+						n = s;
+				for (unsigned int t : opt.threads)
+					if (n > 0)
+						run(*k, "strong", n, t, opt, results);
+			}
+			else if (mode == "weak" && !k->serial)
+			{
+				//Work per thread stays that of the smallest non-trivial size on one thread
+				size_t base = 0;
+				for (size_t s : opt.sizes)
+					if (base == 0 && s >= 1000)
+						base = s;
+				if (base == 0)
+					base = opt.sizes.back();
+				for (unsigned int t : opt.threads)
+				{
+					size_t n = k->scaling == SCALING_PAIRS ? (size_t)(base * std::sqrt((double)t)) : base * t;
+					run(*k, "weak", n, t, opt, results);
+				}
+			}
+		}
+	}
+
+	if (!opt.out.empty())
+	{
+		FILE* f = fopen(opt.out.c_str(), "w");
+		if (!f)
+		{
+			fprintf(stderr, "Couldn't write %s\n", opt.out.c_str());
+			return 2;
+		}
+		fprintf(f, "%s\n", HEADER);
+		for (auto& r : results)
+			printResult(f, r, opt.repeat);
+		fclose(f);
+	}
+
+	if (opt.baseline.empty())
+		return 0;
+	std::map<std::string, double> baseline;
+	if (!readResults(opt.baseline, baseline))
+	{
+		fprintf(stderr, "Couldn't read baseline %s\n", opt.baseline.c_str());
+		return 2;
+	}
+	int regressions = 0;
+	int compared = 0;
+	for (auto& r : results)
+	{
+		auto it = baseline.find(r.kernel + "," + r.mode + "," + std::to_string(r.n) + "," + std::to_string(r.threads));
+		if (it == baseline.end())
+			continue;
+		compared++;
+		double change = r.nsPerBodyStep / it->second - 1.0;
+		if (change > opt.tolerance)
+		{
+			regressions++;
+			fprintf(stderr, "REGRESSION %s %s n=%llu threads=%u: %.4g -> %.4g ns/body-step (%+.1f%%)\n", r.kernel.c_str(), r.mode.c_str(),
+				(unsigned long long)r.n, r.threads, it->second, r.nsPerBodyStep, change * 100.0);
+		}
+	}
+	fprintf(stderr, "%d of %d configurations regressed by more than %.0f%%\n", regressions, compared, opt.tolerance * 100.0);
+	return regressions > 0 ? 1 : 0;
+}
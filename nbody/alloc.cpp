@@ -0,0 +1,191 @@
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include "alloc.h"
+
+namespace
+{
+	//Everything here is constant-initialized: operator new may run before any constructor
+	struct Counts
+	{
+		std::atomic<uint64_t> allocations;
+		std::atomic<uint64_t> frees;
+		std::atomic<uint64_t> bytes;
+		std::atomic<uint64_t> steadyAllocations;
+		std::atomic<uint64_t> steadyBytes;
+	};
+
+	Counts running[ALLOC_MAX_SUBSYSTEMS];
+	std::atomic<bool> steady(false);
+	std::mutex lock;
+	const char* names[ALLOC_MAX_SUBSYSTEMS] = { "other" };
+	std::atomic<int> subsystems(1);
+	thread_local int current = 0;
+
+	//Main thread only, updated by allocFrame()
+	struct Frame
+	{
+		uint64_t allocations;
+		uint64_t frees;
+		uint64_t bytes;
+		uint64_t peakAllocations;
+		uint64_t peakBytes;
+		uint64_t totalAllocations;
+		uint64_t totalBytes;
+	};
+
+	Frame frames[ALLOC_MAX_SUBSYSTEMS];
+	bool started = false;
+}
+
+int allocSubsystem(const char* name)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	int count = subsystems.load();
+	for (int i = 0; i < count; i++)
+		if (!strcmp(names[i], name))
+			return i;
+	if (count == ALLOC_MAX_SUBSYSTEMS)
+		return 0;
+	names[count] = name;
+	subsystems = count + 1;
+	return count;
+}
+
+int allocEnter(int id)
+{
+	int previous = current;
+	current = id;
+	return previous;
+}
+
+void allocCount(size_t bytes)
+{
+	Counts& c = running[current];
+	c.allocations.fetch_add(1, std::memory_order_relaxed);
+	c.bytes.fetch_add(bytes, std::memory_order_relaxed);
+	if (steady.load(std::memory_order_relaxed))
+	{
+		c.steadyAllocations.fetch_add(1, std::memory_order_relaxed);
+		c.steadyBytes.fetch_add(bytes, std::memory_order_relaxed);
+	}
+}
+
+void allocFree()
+{
+	running[current].frees.fetch_add(1, std::memory_order_relaxed);
+}
+
+void allocFrame()
+{
+	int count = subsystems.load();
+	for (int i = 0; i < count; i++)
+	{
+		Frame& f = frames[i];
+		f.allocations = running[i].allocations.exchange(0, std::memory_order_relaxed);
+		f.frees = running[i].frees.exchange(0, std::memory_order_relaxed);
+		f.bytes = running[i].bytes.exchange(0, std::memory_order_relaxed);
+		//The first call closes startup, it only goes into the totals
+		if (!started)
+		{
+			f.totalAllocations = f.allocations;
+			f.totalBytes = f.bytes;
+			f.allocations = f.frees = f.bytes = 0;
+			continue;
+		}
+		f.peakAllocations = f.allocations > f.peakAllocations ? f.allocations : f.peakAllocations;
+		f.peakBytes = f.bytes > f.peakBytes ? f.bytes : f.peakBytes;
+		f.totalAllocations += f.allocations;
+		f.totalBytes += f.bytes;
+	}
+	started = true;
+}
+
+void allocSteadyState()
+{
+	steady = true;
+}
+
+int allocStats(AllocStats* out, int max)
+{
+	int count = subsystems.load() < max ? subsystems.load() : max;
+	for (int i = 0; i < count; i++)
+	{
+		const Frame& f = frames[i];
+		out[i].name = names[i];
+		out[i].allocations = f.allocations;
+		out[i].frees = f.frees;
+		out[i].bytes = f.bytes;
+		out[i].peakAllocations = f.peakAllocations;
+		out[i].peakBytes = f.peakBytes;
+		out[i].totalAllocations = f.totalAllocations;
+		out[i].totalBytes = f.totalBytes;
+		out[i].steadyAllocations = running[i].steadyAllocations.load();
+		out[i].steadyBytes = running[i].steadyBytes.load();
+	}
+	return count;
+}
+
+#if ALLOC_TRACKING
+void* operator new(size_t size)
+{
+	void* p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	allocCount(size);
+	return p;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	void* p = malloc(size ? size : 1);
+	if (p)
+		allocCount(size);
+	return p;
+}
+
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept
+{
+	return operator new(size, tag);
+}
+
+void operator delete(void* p) noexcept
+{
+	if (!p)
+		return;
+	allocFree();
+	free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+	operator delete(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	operator delete(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+	operator delete(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+	operator delete(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+	operator delete(p);
+}
+#endif
@@ -0,0 +1,78 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include "profiler.h"
+
+//Heap allocation tracking. The global operator new and delete are replaced to count every
+//allocation and its size per subsystem and per frame. Define ALLOC_TRACKING=0 in the
+//preprocessor definitions to keep the standard operators, ALLOC_SCOPE then expands to nothing.
+//Allocations of C libraries (SDL, the GL driver, GLU) use malloc and are not seen.
+#ifndef ALLOC_TRACKING
+#define ALLOC_TRACKING 1
+#endif
+
+const int ALLOC_MAX_SUBSYSTEMS = 16;
+
+struct AllocStats
+{
+	const char* name;
+	//Last closed frame
+	uint64_t allocations;
+	uint64_t frees;
+	uint64_t bytes;
+	//Largest frame so far
+	uint64_t peakAllocations;
+	uint64_t peakBytes;
+	//Since start
+	uint64_t totalAllocations;
+	uint64_t totalBytes;
+	//Since allocSteadyState(), must stay zero
+	uint64_t steadyAllocations;
+	uint64_t steadyBytes;
+};
+
+//Register a subsystem, returns its id; 0 is "other", whatever runs outside any ALLOC_SCOPE
+int allocSubsystem(const char* name);
+//Make id the subsystem of the calling thread, returns the previous one
+int allocEnter(int id);
+//Count an allocation or a free of an allocator other than operator new, e.g. ImGui's
+void allocCount(size_t bytes);
+void allocFree();
+//Close the frame: the running counts become the last frame. Main thread only; the first
+//call closes startup, which counts in the totals but not as a frame.
+void allocFrame();
+//From now on every allocation is a steady state violation
+void allocSteadyState();
+//Statistics of every subsystem, returns the number written to out
+int allocStats(AllocStats* out, int max);
+
+class AllocScope
+{
+public:
+	explicit AllocScope(int id)
+		: previous(allocEnter(id))
+	{
+	}
+	~AllocScope()
+	{
+		allocEnter(previous);
+	}
+private:
+	int previous;
+};
+
+//Allocations of the enclosing block count to the subsystem name
+#if ALLOC_TRACKING
+#define ALLOC_SCOPE(name) \
+	static const int PROFILE_CONCAT(allocId, __LINE__) = allocSubsystem(name); \
+	AllocScope PROFILE_CONCAT(allocScope, __LINE__)(PROFILE_CONCAT(allocId, __LINE__))
+//Begin and end of a section that isn't a block of its own, id names the section
+#define ALLOC_BEGIN(id, name) \
+	static const int id##Alloc = allocSubsystem(name); \
+	int id##AllocPrevious = allocEnter(id##Alloc)
+#define ALLOC_END(id) allocEnter(id##AllocPrevious)
+#else
+#define ALLOC_SCOPE(name)
+#define ALLOC_BEGIN(id, name)
+#define ALLOC_END(id)
+#endif
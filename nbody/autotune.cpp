@@ -0,0 +1,300 @@
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+#include "autotune.h"
+#include "tree.h"
+#include "profiler.h"
+
+namespace
+{
+	const unsigned int TILES[] = { 64, 256, 1024 };
+	const double THETAS[] = { 0.3, 0.45, 0.6, 0.75, 0.9 };
+	//Timing runs per candidate, the fastest counts
+	const int REPEAT = 3;
+	//The tree evaluates a body in far fewer interactions, it gets at least this many
+	const size_t TREE_TIMED = 8192;
+
+	typedef std::chrono::steady_clock Clock;
+
+	double seconds(Clock::time_point start)
+	{
+		return std::chrono::duration<double>(Clock::now() - start).count();
+	}
+
+	//One decision per line: machine, buckets, error target, then the configuration
+	struct CacheLine
+	{
+		char machine[128];
+		int bodiesBucket;
+		int pullingBucket;
+		double errorTarget;
+		TuneResult result;
+	};
+
+	bool parseLine(const char* line, CacheLine& c)
+	{
+		int solver;
+		if (sscanf(line, "%127s %d %d %lf %d %u %u %lf %lf %lf", c.machine, &c.bodiesBucket, &c.pullingBucket, &c.errorTarget,
+			&solver, &c.result.config.tile, &c.result.config.threads, &c.result.config.theta, &c.result.seconds, &c.result.error) != 10)
+			return false;
+		if (solver < 0 || solver >= SOLVER_COUNT)
+			return false;
+		c.result.config.solver = (Solver)solver;
+		return true;
+	}
+
+	bool sameKey(const CacheLine& c, const char* machine, int bodiesBucket, int pullingBucket, double errorTarget)
+	{
+		return !strcmp(c.machine, machine) && c.bodiesBucket == bodiesBucket && c.pullingBucket == pullingBucket &&
+			std::fabs(c.errorTarget - errorTarget) <= 1e-6 * errorTarget;
+	}
+
+	bool readCache(const char* path, const char* machine, int bodiesBucket, int pullingBucket, double errorTarget, TuneResult& result)
+	{
+		FILE* f = fopen(path, "r");
+		if (!f)
+			return false;
+		char line[512];
+		bool found = false;
+		CacheLine c;
+		while (!found && fgets(line, sizeof(line), f))
+		{
+			if (parseLine(line, c) && sameKey(c, machine, bodiesBucket, pullingBucket, errorTarget))
+			{
+				result.config = c.result.config;
+				result.seconds = c.result.seconds;
+				result.error = c.result.error;
+				found = true;
+			}
+		}
+		fclose(f);
+		return found;
+	}
+
+	//Replace the line of the same key, keep the others
+	bool writeCache(const char* path, const char* machine, int bodiesBucket, int pullingBucket, double errorTarget, const TuneResult& result)
+	{
+		std::vector<std::string> lines;
+		FILE* f = fopen(path, "r");
+		if (f)
+		{
+			char line[512];
+			CacheLine c;
+			while (fgets(line, sizeof(line), f))
+				if (parseLine(line, c) && !sameKey(c, machine, bodiesBucket, pullingBucket, errorTarget))
+					lines.push_back(line);
+			fclose(f);
+		}
+		f = fopen(path, "w");
+		if (!f)
+			return false;
+		for (auto& line : lines)
+			fputs(line.c_str(), f);
+		fprintf(f, "%s %d %d %.6g %d %u %u %.6g %.6e %.6e\n", machine, bodiesBucket, pullingBucket, errorTarget,
+			(int)result.config.solver, result.config.tile, result.config.threads, result.config.theta, result.seconds, result.error);
+		return fclose(f) == 0;
+	}
+
+	//count indices spread evenly over [0, n)
+	void spread(size_t n, size_t count, std::vector<uint32_t>& out)
+	{
+		out.resize(count);
+		for (size_t k = 0; k < count; k++)
+			out[k] = (uint32_t)(k * n / count);
+	}
+
+	//Fastest of REPEAT force passes over targets, after one warm-up pass
+	double timeForces(const State& s, double softening, const SolverConfig& config, const std::vector<uint32_t>& targets,
+		std::vector<double>& ax, std::vector<double>& ay, std::vector<double>& az)
+	{
+		ax.resize(targets.size());
+		ay.resize(targets.size());
+		az.resize(targets.size());
+		computeForces(s, softening, config, targets.data(), targets.size(), ax.data(), ay.data(), az.data());
+		double best = HUGE_VAL;
+		for (int r = 0; r < REPEAT; r++)
+		{
+			Clock::time_point start = Clock::now();
+			computeForces(s, softening, config, targets.data(), targets.size(), ax.data(), ay.data(), az.data());
+			best = std::min(best, seconds(start));
+		}
+		return best;
+	}
+}
+
+void machineId(char* out, size_t size)
+{
+	char brand[49] = { 0 };
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	int regs[4];
+	__cpuid(regs, 0x80000000);
+	if ((unsigned int)regs[0] >= 0x80000004)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			__cpuid(regs, 0x80000002 + i);
+			memcpy(brand + 16 * i, regs, 16);
+		}
+	}
+#elif defined(__x86_64__) || defined(__i386__)
+	unsigned int regs[4];
+	if (__get_cpuid_max(0x80000000, NULL) >= 0x80000004)
+	{
+		for (unsigned int i = 0; i < 3; i++)
+		{
+			__get_cpuid(0x80000002 + i, &regs[0], &regs[1], &regs[2], &regs[3]);
+			memcpy(brand + 16 * i, regs, 16);
+		}
+	}
+#endif
+	const char* start = brand;
+	while (*start == ' ')
+		start++;
+	snprintf(out, size, "%s/%u", *start ? start : "unknown", std::thread::hardware_concurrency());
+	for (char* c = out; *c; c++)
+		if (*c == ' ')
+			*c = '_';
+}
+
+int sizeBucket(size_t n)
+{
+	return (int)std::floor(2.0 * std::log2((double)std::max(n, (size_t)1)));
+}
+
+bool needsRetune(const TuneResult& result, size_t n, size_t pulling)
+{
+	return result.bodiesBucket != sizeBucket(n) || result.pullingBucket != sizeBucket(pulling);
+}
+
+TuneResult autotune(const State& s, double softening, const TuneSettings& settings, bool retune)
+{
+	PROFILE_SCOPE("autotune");
+	size_t n = s.size();
+	size_t pulling = 0;
+	for (size_t j = 0; j < n; j++)
+		if (s.gm[j] != 0.0)
+			pulling++;
+	TuneResult best;
+	best.config = DEFAULT_SOLVER;
+	best.seconds = 0.0;
+	best.error = 0.0;
+	best.bodiesBucket = sizeBucket(n);
+	best.pullingBucket = sizeBucket(pulling);
+	best.cached = false;
+	if (n == 0 || pulling == 0)
+		return best;
+	char machine[128];
+	machineId(machine, sizeof(machine));
+	if (!retune && settings.cache && readCache(settings.cache, machine, best.bodiesBucket, best.pullingBucket, settings.errorTarget, best))
+	{
+		best.cached = true;
+		return best;
+	}
+
+	//Reference forces of the error sample
+	std::vector<uint32_t> sample;
+	spread(n, std::min(n, std::max(settings.sample, (size_t)1)), sample);
+	std::vector<double> rx(sample.size()), ry(sample.size()), rz(sample.size());
+	computeForces(s, softening, DEFAULT_SOLVER, sample.data(), sample.size(), rx.data(), ry.data(), rz.data());
+	double norm = 0.0;
+	for (size_t k = 0; k < sample.size(); k++)
+		norm += rx[k] * rx[k] + ry[k] * ry[k] + rz[k] * rz[k];
+	std::vector<double> ax, ay, az;
+	auto forceError = [&](const SolverConfig& config)
+	{
+		ax.resize(sample.size());
+		ay.resize(sample.size());
+		az.resize(sample.size());
+		computeForces(s, softening, config, sample.data(), sample.size(), ax.data(), ay.data(), az.data());
+		double diff = 0.0;
+		for (size_t k = 0; k < sample.size(); k++)
+			diff += (ax[k] - rx[k]) * (ax[k] - rx[k]) + (ay[k] - ry[k]) * (ay[k] - ry[k]) + (az[k] - rz[k]) * (az[k] - rz[k]);
+		return norm > 0.0 ? std::sqrt(diff / norm) : 0.0;
+	};
+
+	//Solver variants that meet the target; the error doesn't depend on the thread count
+	std::vector<SolverConfig> variants;
+	std::vector<double> errors;
+	SolverConfig config = DEFAULT_SOLVER;
+	variants.push_back(config);
+	errors.push_back(0.0);
+	for (unsigned int tile : TILES)
+	{
+		config.solver = SOLVER_TILED;
+		config.tile = tile;
+		double error = forceError(config);
+		if (error <= settings.errorTarget)
+		{
+			variants.push_back(config);
+			errors.push_back(error);
+		}
+	}
+	config = DEFAULT_SOLVER;
+	for (double theta : THETAS)
+	{
+		config.solver = SOLVER_TREE;
+		config.theta = theta;
+		double error = forceError(config);
+		if (error <= settings.errorTarget)
+		{
+			variants.push_back(config);
+			errors.push_back(error);
+		}
+	}
+
+	//Thread counts: powers of two and all hardware threads
+	unsigned int hardware = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<unsigned int> threads;
+	for (unsigned int t = 1; t < hardware; t *= 2)
+		threads.push_back(t);
+	threads.push_back(hardware);
+
+	//Timed bodies: about settings.interactions pair interactions, enough to split over the threads
+	size_t timedCount = (size_t)(settings.interactions / pulling);
+	timedCount = std::min(n, std::max(timedCount, (size_t)64 * hardware));
+	std::vector<uint32_t> timed, timedTree;
+	spread(n, timedCount, timed);
+	spread(n, std::min(n, std::max(timedCount, TREE_TIMED)), timedTree);
+	//The tree is built whole in every timed pass, only the evaluation scales with the bodies
+	double build = 0.0;
+	Octree tree;
+	for (int r = 0; r < REPEAT; r++)
+	{
+		Clock::time_point start = Clock::now();
+		tree.build(s);
+		build = r == 0 ? seconds(start) : std::min(build, seconds(start));
+	}
+
+	best.seconds = HUGE_VAL;
+	for (size_t v = 0; v < variants.size(); v++)
+	{
+		const std::vector<uint32_t>& targets = variants[v].solver == SOLVER_TREE ? timedTree : timed;
+		for (unsigned int t : threads)
+		{
+			config = variants[v];
+			config.threads = t;
+			double pass = timeForces(s, softening, config, targets, ax, ay, az);
+			double fixed = config.solver == SOLVER_TREE ? std::min(build, pass) : 0.0;
+			double estimate = fixed + (pass - fixed) * n / targets.size();
+			if (estimate < best.seconds)
+			{
+				best.config = config;
+				best.seconds = estimate;
+				best.error = errors[v];
+			}
+		}
+	}
+	if (settings.cache)
+		writeCache(settings.cache, machine, best.bodiesBucket, best.pullingBucket, settings.errorTarget, best);
+	return best;
+}
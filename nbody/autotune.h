@@ -0,0 +1,50 @@
+#pragma once
+#include <cstddef>
+#include "state.h"
+#include "physics.h"
+
+//Force solver autotuner. Short calibration runs time every candidate solver, tile size,
+//thread count and opening angle on a sample of the bodies, the force error is measured
+//against direct summation, and the fastest candidate within the error target wins.
+//Decisions are cached on disk per machine and N bucket.
+
+struct TuneSettings
+{
+	//Largest accepted relative RMS force error against direct summation
+	double errorTarget;
+	//Bodies the error is measured on
+	size_t sample;
+	//Pair interactions per timing run, sets how many bodies are timed
+	double interactions;
+	//Cache file, NULL for none
+	const char* cache;
+};
+
+const TuneSettings DEFAULT_TUNING = { 1e-3, 256, 2e7, NULL };
+
+struct TuneResult
+{
+	SolverConfig config;
+	//Estimated force pass of the whole state, s
+	double seconds;
+	//Measured relative RMS force error
+	double error;
+	//Buckets the decision is valid for
+	int bodiesBucket;
+	int pullingBucket;
+	//Taken from the cache, no calibration ran
+	bool cached;
+};
+
+//Pick the solver for s. A cached decision for this machine, error target and the buckets of s
+//is reused unless retune is set; a new decision is written to the cache.
+TuneResult autotune(const State& s, double softening, const TuneSettings& settings, bool retune = false);
+
+//CPU brand and hardware thread count without spaces, the key of machine-specific results
+void machineId(char* out, size_t size);
+
+//Half-octave size class, N changing by more than a factor sqrt(2) moves to another bucket
+int sizeBucket(size_t n);
+
+//True if a state of n bodies, pulling of them massive, is outside the buckets of result
+bool needsRetune(const TuneResult& result, size_t n, size_t pulling);
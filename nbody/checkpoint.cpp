@@ -0,0 +1,191 @@
+#include <cstdio>
+#include <cstring>
+#include "checkpoint.h"
+#include "mapped_file.h"
+#include "parallel.h"
+#include "profiler.h"
+#include "alloc.h"
+
+static_assert(sizeof(CheckpointHeader) == 64, "checkpoint header must stay 64 bytes");
+
+static const char CHECKPOINT_MAGIC[8] = { 'N', 'B', 'O', 'D', 'Y', 'C', 'K', 'P' };
+static const uint32_t STATE_COLUMNS = 8;
+static const uint32_t FIXED_COLUMNS = 6;
+
+//Column size rounded up to the 64-byte boundary
+static uint64_t columnStride(uint64_t count)
+{
+	return (count * 8 + 63) & ~(uint64_t)63;
+}
+
+//Write one column followed by zero padding up to the stride
+static bool writeColumn(FILE* f, const void* data, uint64_t count, uint64_t stride)
+{
+	static const char zeros[64] = { 0 };
+	if (count > 0 && fwrite(data, 8, (size_t)count, f) != count)
+		return false;
+	uint64_t pad = stride - count * 8;
+	return pad == 0 || fwrite(zeros, 1, (size_t)pad, f) == pad;
+}
+
+bool writeCheckpoint(const std::string& path, const State& s, const FixedIntegrator* fixed)
+{
+	PROFILE_SCOPE("writeCheckpoint");
+	CheckpointHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic));
+	h.version = CHECKPOINT_VERSION;
+	h.count = s.size();
+	h.day = s.day;
+	h.seed = s.seed;
+	h.step = s.step;
+	h.softening = s.softening;
+	h.columns = STATE_COLUMNS;
+	h.stride = columnStride(h.count);
+	if (s.generated)
+		h.flags |= CHECKPOINT_GENERATED;
+	if (fixed && fixed->size() == s.size())
+	{
+		h.flags |= CHECKPOINT_FIXED;
+		h.columns += FIXED_COLUMNS;
+	}
+
+	std::string tmp = path + ".tmp";
+	FILE* f = fopen(tmp.c_str(), "wb");
+	if (!f)
+		return false;
+	bool success = fwrite(&h, sizeof(h), 1, f) == 1;
+	const std::vector<double>* columns[STATE_COLUMNS] = { &s.px, &s.py, &s.pz, &s.vx, &s.vy, &s.vz, &s.gm, &s.mass };
+	for (uint32_t i = 0; success && i < STATE_COLUMNS; i++)
+		success = writeColumn(f, columns[i]->data(), h.count, h.stride);
+	if (h.flags & CHECKPOINT_FIXED)
+	{
+		const std::vector<int64_t>* grid[FIXED_COLUMNS] = { &fixed->qx, &fixed->qy, &fixed->qz, &fixed->wx, &fixed->wy, &fixed->wz };
+		for (uint32_t i = 0; success && i < FIXED_COLUMNS; i++)
+			success = writeColumn(f, grid[i]->data(), h.count, h.stride);
+	}
+	if (fclose(f) != 0)
+		success = false;
+	if (!success)
+	{
+		remove(tmp.c_str());
+		return false;
+	}
+	//rename() doesn't replace an existing file on Windows
+	remove(path.c_str());
+	return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+bool readCheckpoint(const std::string& path, State& s, FixedIntegrator& fixed, bool& hasFixed)
+{
+	PROFILE_SCOPE("readCheckpoint");
+	MappedFile file;
+	if (!file.open(path) || file.size() < sizeof(CheckpointHeader))
+		return false;
+	CheckpointHeader h;
+	memcpy(&h, file.data(), sizeof(h));
+	if (memcmp(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic)) != 0 || h.version != CHECKPOINT_VERSION)
+		return false;
+	hasFixed = (h.flags & CHECKPOINT_FIXED) != 0;
+	uint32_t expected = STATE_COLUMNS + (hasFixed ? FIXED_COLUMNS : 0);
+	//Every body takes 8 bytes per column; a larger count would wrap the sizes below
+	if (h.count > (file.size() - sizeof(h)) / 8)
+		return false;
+	if (h.columns != expected || h.stride != columnStride(h.count)
+		|| file.size() < sizeof(h) + h.columns * h.stride)
+		return false;
+
+	size_t n = (size_t)h.count;
+	const unsigned char* base = file.data() + sizeof(h);
+	s.resize(n);
+	void* columns[STATE_COLUMNS + FIXED_COLUMNS] = { s.px.data(), s.py.data(), s.pz.data(), s.vx.data(), s.vy.data(), s.vz.data(), s.gm.data(), s.mass.data() };
+	if (hasFixed)
+	{
+		std::vector<int64_t>* grid[FIXED_COLUMNS] = { &fixed.qx, &fixed.qy, &fixed.qz, &fixed.wx, &fixed.wy, &fixed.wz };
+		for (uint32_t i = 0; i < FIXED_COLUMNS; i++)
+		{
+			grid[i]->resize(n);
+			columns[STATE_COLUMNS + i] = grid[i]->data();
+		}
+	}
+	//Columns are independent, copying them in parallel also spreads the page faults
+	uint64_t stride = h.stride;
+	parallelFor(h.columns, [&](size_t begin, size_t end)
+	{
+		PROFILE_SCOPE("readCheckpoint column");
+		for (size_t i = begin; i < end; i++)
+			memcpy(columns[i], base + i * stride, n * 8);
+	});
+	if (hasFixed)
+	{
+		fixed.gm.resize(n);
+		for (size_t i = 0; i < n; i++)
+			fixed.gm[i] = (float)s.gm[i];
+	}
+	s.day = h.day;
+	s.step = h.step;
+	s.seed = h.seed;
+	s.softening = h.softening;
+	s.generated = (h.flags & CHECKPOINT_GENERATED) != 0;
+	return true;
+}
+
+CheckpointWriter::CheckpointWriter()
+	: pending(false)
+	, ok(true)
+	, stop(false)
+	, hasFixed(false)
+{
+	worker = std::thread(&CheckpointWriter::run, this);
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stop = true;
+	}
+	wake.notify_one();
+	worker.join();
+}
+
+bool CheckpointWriter::save(const std::string& file, const State& s, const FixedIntegrator* fixed)
+{
+	if (pending)
+		return false;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		path = file;
+		snapshot = s;
+		hasFixed = fixed != NULL;
+		if (fixed)
+		{
+			fixedSnapshot.qx = fixed->qx; fixedSnapshot.qy = fixed->qy; fixedSnapshot.qz = fixed->qz;
+			fixedSnapshot.wx = fixed->wx; fixedSnapshot.wy = fixed->wy; fixedSnapshot.wz = fixed->wz;
+		}
+		pending = true;
+	}
+	wake.notify_one();
+	return true;
+}
+
+void CheckpointWriter::run()
+{
+	profileThreadName("checkpoint writer");
+	ALLOC_SCOPE("checkpoint");
+	std::unique_lock<std::mutex> guard(lock);
+	while (true)
+	{
+		wake.wait(guard, [this] { return stop || pending; });
+		if (pending)
+		{
+			//The snapshot isn't touched by save() while pending is set
+			guard.unlock();
+			ok = writeCheckpoint(path, snapshot, hasFixed ? &fixedSnapshot : NULL);
+			guard.lock();
+			pending = false;
+		}
+		if (stop)
+			return;
+	}
+}
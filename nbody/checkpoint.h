@@ -0,0 +1,73 @@
+#pragma once
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "state.h"
+#include "fixed.h"
+
+//Checkpoint file layout (little-endian):
+//64-byte header, then one column per state component, each column starts
+//on a 64-byte boundary: px py pz vx vy vz gm mass (double), followed by
+//qx qy qz wx wy wz (int64) of the fixed-point integrator if it was active.
+const uint32_t CHECKPOINT_VERSION = 1;
+//Header flag: fixed-point integrator columns are present
+const uint32_t CHECKPOINT_FIXED = 1;
+//Header flag: the state is a generated scenario, not the Solar System
+const uint32_t CHECKPOINT_GENERATED = 2;
+
+struct CheckpointHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint64_t count;
+	double day;
+	uint64_t seed;
+	float step;
+	uint32_t columns;
+	uint64_t stride;
+	//Softening of a generated scenario, m, 0 for the Solar System
+	double softening;
+};
+
+//Write a checkpoint synchronously, through a temporary file so a crash never leaves a torn file
+bool writeCheckpoint(const std::string& path, const State& s, const FixedIntegrator* fixed);
+
+//Load a checkpoint through a memory map. fixed receives the integrator history if present,
+//hasFixed tells whether it was
+bool readCheckpoint(const std::string& path, State& s, FixedIntegrator& fixed, bool& hasFixed);
+
+//Writes checkpoints on a background thread
+class CheckpointWriter
+{
+public:
+	CheckpointWriter();
+	~CheckpointWriter();
+	//Copy the state and queue it, returns false if the previous checkpoint is still being written
+	bool save(const std::string& path, const State& s, const FixedIntegrator* fixed);
+	//Is a checkpoint being written
+	bool busy() const
+	{
+		return pending;
+	}
+	//Did the last finished write succeed
+	bool lastOk() const
+	{
+		return ok;
+	}
+
+private:
+	void run();
+	std::thread worker;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::atomic<bool> pending;
+	std::atomic<bool> ok;
+	bool stop;
+	std::string path;
+	State snapshot;
+	FixedIntegrator fixedSnapshot;
+	bool hasFixed;
+};
@@ -0,0 +1,496 @@
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include "codec.h"
+
+//Encoder and decoder must reconstruct bit-identical predictions
+#if defined(_MSC_VER)
+#pragma fp_contract(off)
+#elif defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+//Zero-run coding: a control byte with the high bit set is a run of (ctl & 0x7f) + 1 zeros,
+//otherwise it is followed by ctl + 1 literal bytes
+static void encodeRuns(const unsigned char* in, size_t size, std::vector<unsigned char>& out)
+{
+	size_t i = 0;
+	while (i < size)
+	{
+		if (in[i] == 0)
+		{
+			size_t run = 1;
+			while (i + run < size && in[i + run] == 0 && run < 128)
+				run++;
+			out.push_back((unsigned char)(0x80 | (run - 1)));
+			i += run;
+		}
+		else
+		{
+			size_t lit = 1;
+			//A single zero inside literals is cheaper to keep than to break the literal
+			while (i + lit < size && lit < 128 && !(in[i + lit] == 0 && (i + lit + 1 >= size || in[i + lit + 1] == 0)))
+				lit++;
+			out.push_back((unsigned char)(lit - 1));
+			out.insert(out.end(), in + i, in + i + lit);
+			i += lit;
+		}
+	}
+}
+
+static bool decodeRuns(const unsigned char* in, size_t size, unsigned char* out, size_t outSize)
+{
+	size_t o = 0;
+	size_t i = 0;
+	while (i < size)
+	{
+		unsigned char ctl = in[i++];
+		size_t len = (ctl & 0x7f) + 1;
+		if (o + len > outSize)
+			return false;
+		if (ctl & 0x80)
+		{
+			memset(out + o, 0, len);
+		}
+		else
+		{
+			if (i + len > size)
+				return false;
+			memcpy(out + o, in + i, len);
+			i += len;
+		}
+		o += len;
+	}
+	return o == outSize;
+}
+
+static void encodeXor(const double* data, size_t frames, size_t n, std::vector<unsigned char>& out)
+{
+	size_t count = frames * n;
+	std::vector<uint64_t> bits(count);
+	memcpy(bits.data(), data, count * 8);
+	//Back to front so every frame is XORed with the original previous one
+	for (size_t k = count; k-- > n;)
+		bits[k] ^= bits[k - n];
+	std::vector<unsigned char> planes(count * 8);
+	for (size_t b = 0; b < 8; b++)
+	{
+		unsigned char* plane = planes.data() + b * count;
+		for (size_t k = 0; k < count; k++)
+			plane[k] = (unsigned char)(bits[k] >> (8 * b));
+	}
+	encodeRuns(planes.data(), planes.size(), out);
+}
+
+static bool decodeXor(const unsigned char* in, size_t size, size_t frames, size_t n, double* data)
+{
+	size_t count = frames * n;
+	std::vector<unsigned char> planes(count * 8);
+	if (!decodeRuns(in, size, planes.data(), planes.size()))
+		return false;
+	std::vector<uint64_t> bits(count, 0);
+	for (size_t b = 0; b < 8; b++)
+	{
+		const unsigned char* plane = planes.data() + b * count;
+		for (size_t k = 0; k < count; k++)
+			bits[k] |= (uint64_t)plane[k] << (8 * b);
+	}
+	for (size_t k = n; k < count; k++)
+		bits[k] ^= bits[k - n];
+	memcpy(data, bits.data(), count * 8);
+	return true;
+}
+
+//Static rANS over bytes, 12-bit probabilities, byte-wise renormalization
+static const uint32_t RANS_BITS = 12;
+static const uint32_t RANS_SCALE = 1u << RANS_BITS;
+static const uint32_t RANS_LOW = 1u << 23;
+
+//Scale symbol counts to frequencies summing to RANS_SCALE, every present symbol keeps at least 1
+static void normalizeFrequencies(const uint64_t* counts, uint64_t total, uint32_t* freq)
+{
+	uint32_t sum = 0;
+	int largest = 0;
+	for (int i = 0; i < 256; i++)
+	{
+		freq[i] = counts[i] ? (uint32_t)((counts[i] * RANS_SCALE) / total) : 0;
+		if (counts[i] && freq[i] == 0)
+			freq[i] = 1;
+		sum += freq[i];
+		if (freq[i] > freq[largest])
+			largest = i;
+	}
+	//Rounding error goes to the most frequent symbol, taking from the others if it can't absorb it
+	if (sum < RANS_SCALE)
+	{
+		freq[largest] += RANS_SCALE - sum;
+	}
+	else
+	{
+		for (int i = 0; sum > RANS_SCALE; i = (i + 1) & 255)
+		{
+			if (freq[i] > 1)
+			{
+				freq[i]--;
+				sum--;
+			}
+		}
+	}
+}
+
+static void ransEncode(const unsigned char* in, size_t size, const uint32_t* freq, std::vector<unsigned char>& out)
+{
+	uint32_t start[256];
+	uint32_t c = 0;
+	for (int i = 0; i < 256; i++)
+	{
+		start[i] = c;
+		c += freq[i];
+	}
+	//Symbols are coded back to front and the output grows downwards
+	std::vector<unsigned char> buf(size + size / 2 + 16);
+	size_t pos = buf.size();
+	uint32_t x = RANS_LOW;
+	for (size_t k = size; k-- > 0;)
+	{
+		uint32_t f = freq[in[k]];
+		uint32_t xMax = ((RANS_LOW >> RANS_BITS) << 8) * f;
+		while (x >= xMax)
+		{
+			if (pos == 0)
+			{
+				buf.insert(buf.begin(), buf.size(), 0);
+				pos = buf.size() / 2;
+			}
+			buf[--pos] = (unsigned char)(x & 0xff);
+			x >>= 8;
+		}
+		x = ((x / f) << RANS_BITS) + (x % f) + start[in[k]];
+	}
+	if (pos < 4)
+	{
+		buf.insert(buf.begin(), 4, 0);
+		pos += 4;
+	}
+	for (int b = 0; b < 4; b++)
+	{
+		buf[--pos] = (unsigned char)(x & 0xff);
+		x >>= 8;
+	}
+	out.insert(out.end(), buf.begin() + pos, buf.end());
+}
+
+static bool ransDecode(const unsigned char* in, size_t size, const uint32_t* freq, unsigned char* out, size_t outSize)
+{
+	uint32_t start[256];
+	unsigned char slots[RANS_SCALE];
+	uint32_t c = 0;
+	for (int i = 0; i < 256; i++)
+	{
+		start[i] = c;
+		if (c + freq[i] > RANS_SCALE)
+			return false;
+		memset(slots + c, i, freq[i]);
+		c += freq[i];
+	}
+	if (c != RANS_SCALE || size < 4)
+		return false;
+	const unsigned char* p = in;
+	const unsigned char* end = in + size;
+	uint32_t x = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+	p += 4;
+	for (size_t k = 0; k < outSize; k++)
+	{
+		unsigned char sym = slots[x & (RANS_SCALE - 1)];
+		out[k] = sym;
+		x = freq[sym] * (x >> RANS_BITS) + (x & (RANS_SCALE - 1)) - start[sym];
+		while (x < RANS_LOW && p < end)
+			x = (x << 8) | *p++;
+	}
+	return true;
+}
+
+//Quantized block layout: predictor (uint8), entropy mode (uint8), error bound (double),
+//varint byte count (uint64), then either the varints as is or the rANS symbol table
+//(count uint16, then symbol uint8 + frequency uint16 each), rANS byte count (uint64) and the rANS bytes
+enum
+{
+	PREDICT_LINEAR = 0,
+	PREDICT_RATE = 1,
+	ENTROPY_STORED = 0,
+	ENTROPY_RANS = 1,
+};
+static const size_t QUANT_HEADER = 2 + sizeof(double) + sizeof(uint64_t);
+
+//Predicted value of body i in frame f from already reconstructed frames
+static inline double predict(const double* r, size_t f, size_t i, size_t n, const CodecParams& params)
+{
+	if (f == 0)
+		return 0.0;
+	if (params.rate)
+	{
+		double dt = (params.days[f] - params.days[f - 1]) * 86400.0;
+		return r[(f - 1) * n + i] + 0.5 * (params.rate[(f - 1) * n + i] + params.rate[f * n + i]) * dt;
+	}
+	if (f == 1)
+		return r[i];
+	return 2.0 * r[(f - 1) * n + i] - r[(f - 2) * n + i];
+}
+
+static void encodeQuant(const double* data, size_t frames, size_t n, std::vector<unsigned char>& out,
+	const CodecParams& params, double* decoded)
+{
+	double bound = params.errorBound > 1e-12 ? params.errorBound : 1e-12;
+	double quantum = 2.0 * bound;
+	size_t count = frames * n;
+	std::vector<double> local;
+	double* r = decoded;
+	if (!r)
+	{
+		local.resize(count);
+		r = local.data();
+	}
+	std::vector<unsigned char> varints;
+	varints.reserve(count * 2);
+	uint64_t counts[256] = { 0 };
+	for (size_t f = 0; f < frames; f++)
+	{
+		for (size_t i = 0; i < n; i++)
+		{
+			size_t k = f * n + i;
+			double pred = predict(r, f, i, n, params);
+			double steps = std::nearbyint((data[k] - pred) / quantum);
+			//Values beyond the 62-bit range lose the bound instead of overflowing
+			if (!(steps < 4.6e18 && steps > -4.6e18))
+				steps = steps > 0 ? 4.6e18 : -4.6e18;
+			int64_t q = (int64_t)steps;
+			r[k] = pred + (double)q * quantum;
+			uint64_t z = ((uint64_t)q << 1) ^ (uint64_t)(q >> 63);
+			while (z >= 0x80)
+			{
+				varints.push_back((unsigned char)(z | 0x80));
+				counts[(unsigned char)(z | 0x80)]++;
+				z >>= 7;
+			}
+			varints.push_back((unsigned char)z);
+			counts[z]++;
+		}
+	}
+
+	size_t at = out.size();
+	out.resize(at + QUANT_HEADER);
+	out[at] = params.rate ? PREDICT_RATE : PREDICT_LINEAR;
+	memcpy(&out[at + 2], &bound, sizeof(bound));
+	uint64_t rawSize = varints.size();
+	memcpy(&out[at + 2 + sizeof(double)], &rawSize, sizeof(rawSize));
+
+	uint32_t freq[256];
+	normalizeFrequencies(counts, rawSize ? rawSize : 1, freq);
+	std::vector<unsigned char> table;
+	uint16_t symbols = 0;
+	table.resize(sizeof(symbols));
+	for (int i = 0; i < 256; i++)
+	{
+		if (freq[i])
+		{
+			uint16_t f = (uint16_t)freq[i];
+			table.push_back((unsigned char)i);
+			table.insert(table.end(), (unsigned char*)&f, (unsigned char*)&f + sizeof(f));
+			symbols++;
+		}
+	}
+	memcpy(table.data(), &symbols, sizeof(symbols));
+	std::vector<unsigned char> coded;
+	if (rawSize > 0 && symbols > 1)
+		ransEncode(varints.data(), varints.size(), freq, coded);
+	//Small or incompressible blocks are cheaper stored
+	if (coded.empty() || table.size() + sizeof(uint64_t) + coded.size() >= varints.size())
+	{
+		out[at + 1] = ENTROPY_STORED;
+		out.insert(out.end(), varints.begin(), varints.end());
+		return;
+	}
+	out[at + 1] = ENTROPY_RANS;
+	out.insert(out.end(), table.begin(), table.end());
+	uint64_t codedSize = coded.size();
+	out.insert(out.end(), (unsigned char*)&codedSize, (unsigned char*)&codedSize + sizeof(codedSize));
+	out.insert(out.end(), coded.begin(), coded.end());
+}
+
+static bool decodeQuant(const unsigned char* in, size_t size, size_t frames, size_t n, double* r, const CodecParams& params)
+{
+	if (size < QUANT_HEADER)
+		return false;
+	unsigned char predictor = in[0];
+	unsigned char entropy = in[1];
+	double bound;
+	uint64_t rawSize;
+	memcpy(&bound, in + 2, sizeof(bound));
+	memcpy(&rawSize, in + 2 + sizeof(double), sizeof(rawSize));
+	if ((predictor == PREDICT_RATE) != (params.rate != nullptr) || rawSize > frames * n * 10)
+		return false;
+	const unsigned char* p = in + QUANT_HEADER;
+	const unsigned char* end = in + size;
+
+	std::vector<unsigned char> decodedBytes;
+	const unsigned char* varints = p;
+	if (entropy == ENTROPY_RANS)
+	{
+		uint16_t symbols;
+		if (p + sizeof(symbols) > end)
+			return false;
+		memcpy(&symbols, p, sizeof(symbols));
+		p += sizeof(symbols);
+		if (p + symbols * 3 + sizeof(uint64_t) > end)
+			return false;
+		uint32_t freq[256] = { 0 };
+		for (uint16_t s = 0; s < symbols; s++, p += 3)
+		{
+			uint16_t f;
+			memcpy(&f, p + 1, sizeof(f));
+			freq[p[0]] = f;
+		}
+		uint64_t codedSize;
+		memcpy(&codedSize, p, sizeof(codedSize));
+		p += sizeof(codedSize);
+		if (p + codedSize != end)
+			return false;
+		decodedBytes.resize((size_t)rawSize);
+		if (!ransDecode(p, (size_t)codedSize, freq, decodedBytes.data(), decodedBytes.size()))
+			return false;
+		varints = decodedBytes.data();
+	}
+	else if (entropy != ENTROPY_STORED || p + rawSize != end)
+	{
+		return false;
+	}
+
+	//Residuals first, then the reconstruction frame by frame with the predictor
+	//chosen outside the inner loops; the arithmetic matches predict() exactly
+	size_t count = frames * n;
+	std::vector<int64_t> q(count);
+	const unsigned char* v = varints;
+	const unsigned char* vEnd = varints + rawSize;
+	for (size_t k = 0; k < count; k++)
+	{
+		uint64_t z = 0;
+		int shift = 0;
+		while (true)
+		{
+			if (v == vEnd || shift > 63)
+				return false;
+			unsigned char b = *v++;
+			z |= (uint64_t)(b & 0x7f) << shift;
+			if (!(b & 0x80))
+				break;
+			shift += 7;
+		}
+		q[k] = (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+	}
+	if (v != vEnd)
+		return false;
+	double quantum = 2.0 * bound;
+	for (size_t f = 0; f < frames; f++)
+	{
+		double* cur = r + f * n;
+		const int64_t* res = q.data() + f * n;
+		if (f == 0)
+		{
+			for (size_t i = 0; i < n; i++)
+				cur[i] = 0.0 + (double)res[i] * quantum;
+		}
+		else if (params.rate)
+		{
+			const double* prev = cur - n;
+			const double* ratePrev = params.rate + (f - 1) * n;
+			const double* rateCur = params.rate + f * n;
+			double dt = (params.days[f] - params.days[f - 1]) * 86400.0;
+			for (size_t i = 0; i < n; i++)
+				cur[i] = (prev[i] + 0.5 * (ratePrev[i] + rateCur[i]) * dt) + (double)res[i] * quantum;
+		}
+		else if (f == 1)
+		{
+			const double* prev = cur - n;
+			for (size_t i = 0; i < n; i++)
+				cur[i] = prev[i] + (double)res[i] * quantum;
+		}
+		else
+		{
+			const double* prev = cur - n;
+			const double* prev2 = cur - 2 * n;
+			for (size_t i = 0; i < n; i++)
+				cur[i] = (2.0 * prev[i] - prev2[i]) + (double)res[i] * quantum;
+		}
+	}
+	return true;
+}
+
+void encodeColumn(Codec codec, const double* data, size_t frames, size_t n, std::vector<unsigned char>& out,
+	const CodecParams& params, double* decoded)
+{
+	switch (codec)
+	{
+	case CODEC_XOR:
+		encodeXor(data, frames, n, out);
+		break;
+	case CODEC_QUANT:
+		encodeQuant(data, frames, n, out, params, decoded);
+		break;
+	default:
+		out.insert(out.end(), (const unsigned char*)data, (const unsigned char*)(data + frames * n));
+		break;
+	}
+}
+
+bool decodeColumn(Codec codec, const unsigned char* in, size_t size, size_t frames, size_t n, double* data,
+	const CodecParams& params)
+{
+	switch (codec)
+	{
+	case CODEC_RAW:
+		if (size != frames * n * 8)
+			return false;
+		memcpy(data, in, size);
+		return true;
+	case CODEC_XOR:
+		return decodeXor(in, size, frames, n, data);
+	case CODEC_QUANT:
+		return decodeQuant(in, size, frames, n, data, params);
+	default:
+		return false;
+	}
+}
+
+bool columnNeedsRate(Codec codec, const unsigned char* in, size_t size)
+{
+	return codec == CODEC_QUANT && size > 0 && in[0] == PREDICT_RATE;
+}
+
+uint64_t columnCapacity(Codec codec, const unsigned char* in, size_t size)
+{
+	switch (codec)
+	{
+	case CODEC_RAW:
+		return size / 8;
+	case CODEC_XOR:
+		//A run byte stands for at most 128 zero bytes of the planes
+		return (uint64_t)size * 128 / 8;
+	case CODEC_QUANT:
+	{
+		if (size < QUANT_HEADER)
+			return 0;
+		//Every value is at least one varint byte
+		uint64_t rawSize;
+		memcpy(&rawSize, in + 2 + sizeof(double), sizeof(rawSize));
+		if (in[1] != ENTROPY_RANS)
+			return size - QUANT_HEADER;
+		//A symbol carries at least log2(RANS_SCALE / (RANS_SCALE - 1)) bits of the rANS bytes
+		double bits = 8.0 * (size - QUANT_HEADER) / std::log2((double)RANS_SCALE / (RANS_SCALE - 1));
+		return std::min(rawSize, (uint64_t)bits + 1);
+	}
+	default:
+		return 0;
+	}
+}
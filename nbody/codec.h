@@ -0,0 +1,45 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+//Column codecs for trajectory chunks. A column block holds frames x n
+//doubles, frame after frame. Every block decodes on its own.
+enum Codec
+{
+	//Plain little-endian doubles
+	CODEC_RAW = 0,
+	//Lossless: XOR with the previous frame, byte planes, zero-run coding
+	CODEC_XOR = 1,
+	//Lossy: prediction from the previous frames, residual quantized to the
+	//error bound, zigzag varints, static rANS entropy coding
+	CODEC_QUANT = 2,
+};
+
+//Extra inputs of CODEC_QUANT
+struct CodecParams
+{
+	//Maximum absolute error of a decoded value
+	double errorBound = 0.0;
+	//Reconstructed derivative column (velocities for a position column), the
+	//value is then predicted as previous + rate * dt instead of linear extrapolation
+	const double* rate = nullptr;
+	//Day of every frame, required with rate
+	const double* days = nullptr;
+};
+
+//Append the encoded block to out. With CODEC_QUANT decoded, if not null,
+//receives the values the decoder will reconstruct.
+void encodeColumn(Codec codec, const double* data, size_t frames, size_t n, std::vector<unsigned char>& out,
+	const CodecParams& params = CodecParams(), double* decoded = nullptr);
+
+//Decode a block of frames x n doubles into data, returns false on corrupt input
+bool decodeColumn(Codec codec, const unsigned char* in, size_t size, size_t frames, size_t n, double* data,
+	const CodecParams& params = CodecParams());
+
+//Most doubles a block of size bytes can decode to, so a corrupt frame count is rejected
+//before the output is allocated
+uint64_t columnCapacity(Codec codec, const unsigned char* in, size_t size);
+
+//Does a CODEC_QUANT block need the rate column to decode
+bool columnNeedsRate(Codec codec, const unsigned char* in, size_t size);
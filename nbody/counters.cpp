@@ -0,0 +1,248 @@
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <mutex>
+#include "counters.h"
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+namespace
+{
+	struct Counters
+	{
+		//Row 0 is the thread that called perfOpen(), the others are pool workers
+		int fd[PERF_MAX_THREADS][PERF_EVENTS];
+		int threads;
+		char error[128];
+		std::mutex lock;
+		const char* names[PERF_MAX_SCOPES];
+		int scopes;
+		uint64_t calls[PERF_MAX_SCOPES];
+		double totals[PERF_MAX_SCOPES][PERF_EVENTS];
+
+		Counters()
+			: threads(0)
+			, scopes(0)
+		{
+			for (auto& row : fd)
+				for (auto& f : row)
+					f = -1;
+			snprintf(error, sizeof(error), "not opened");
+			memset(calls, 0, sizeof(calls));
+			memset(totals, 0, sizeof(totals));
+		}
+	};
+
+	Counters& counters()
+	{
+		static Counters* c = new Counters();
+		return *c;
+	}
+
+#ifdef __linux__
+	int openEvent(uint32_t type, uint64_t config)
+	{
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		//Allowed with perf_event_paranoid up to 2
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+
+	bool intelCpu()
+	{
+		FILE* f = fopen("/proc/cpuinfo", "r");
+		if (!f)
+			return false;
+		char line[256];
+		bool intel = false;
+		while (fgets(line, sizeof(line), f))
+		{
+			if (!strncmp(line, "vendor_id", 9))
+			{
+				intel = strstr(line, "GenuineIntel") != NULL;
+				break;
+			}
+		}
+		fclose(f);
+		return intel;
+	}
+
+	//Open the events of the calling thread into fd, only those that opened in row 0 for workers
+	void openThread(int* fd, const int* first, bool vector)
+	{
+		const uint64_t hardware[PERF_VECTOR] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+		for (int i = 0; i < PERF_VECTOR; i++)
+			if (!first || first[i] >= 0)
+				fd[i] = openEvent(PERF_TYPE_HARDWARE, hardware[i]);
+		//FP_ARITH_INST_RETIRED, umask 128/256-bit packed double and single; the encoding
+		//is Intel specific (Skylake and later), elsewhere the counter stays unavailable
+		if (vector && (!first || first[PERF_VECTOR] >= 0))
+			fd[PERF_VECTOR] = openEvent(PERF_TYPE_RAW, 0x3cc7);
+		for (int i = 0; i < PERF_EVENTS; i++)
+		{
+			if (fd[i] >= 0)
+			{
+				ioctl(fd[i], PERF_EVENT_IOC_RESET, 0);
+				ioctl(fd[i], PERF_EVENT_IOC_ENABLE, 0);
+			}
+		}
+	}
+#endif
+}
+
+bool perfOpen()
+{
+	Counters& c = counters();
+	perfClose();
+#ifdef __linux__
+	std::lock_guard<std::mutex> guard(c.lock);
+	errno = 0;
+	openThread(c.fd[0], NULL, intelCpu());
+	int openError = errno;
+	bool any = false;
+	for (int i = 0; i < PERF_EVENTS; i++)
+		any = any || c.fd[0][i] >= 0;
+	if (!any)
+	{
+		snprintf(c.error, sizeof(c.error), "perf_event_open: %s", strerror(openError));
+		return false;
+	}
+	c.threads = 1;
+	c.error[0] = 0;
+	return true;
+#else
+	snprintf(c.error, sizeof(c.error), "hardware counters need Linux perf_event_open");
+	return false;
+#endif
+}
+
+void perfThreadStart()
+{
+	Counters& c = counters();
+	std::lock_guard<std::mutex> guard(c.lock);
+	if (c.threads == 0 || c.threads == PERF_MAX_THREADS)
+		return;
+#ifdef __linux__
+	openThread(c.fd[c.threads], c.fd[0], true);
+	c.threads++;
+#endif
+}
+
+void perfClose()
+{
+	Counters& c = counters();
+	std::lock_guard<std::mutex> guard(c.lock);
+	for (auto& row : c.fd)
+	{
+		for (auto& f : row)
+		{
+#ifdef __linux__
+			if (f >= 0)
+				::close(f);
+#endif
+			f = -1;
+		}
+	}
+	c.threads = 0;
+}
+
+bool perfAvailable(PerfEvent event)
+{
+	return counters().fd[0][event] >= 0;
+}
+
+const char* perfError()
+{
+	return counters().error;
+}
+
+const char* perfEventName(PerfEvent event)
+{
+	static const char* names[PERF_EVENTS] = { "cycles", "instructions", "cache_misses", "branch_misses", "vector_instructions" };
+	return names[event];
+}
+
+void perfRead(PerfSample& s)
+{
+	Counters& c = counters();
+	for (int i = 0; i < PERF_EVENTS; i++)
+		s.value[i] = 0;
+#ifdef __linux__
+	std::lock_guard<std::mutex> guard(c.lock);
+	for (int t = 0; t < c.threads; t++)
+	{
+		for (int i = 0; i < PERF_EVENTS; i++)
+		{
+			if (c.fd[t][i] < 0)
+				continue;
+			//value, time enabled, time running
+			uint64_t data[3];
+			if (read(c.fd[t][i], data, sizeof(data)) != sizeof(data))
+				continue;
+			s.value[i] += data[2] > 0 && data[2] < data[1] ? (uint64_t)((double)data[0] * data[1] / data[2]) : data[0];
+		}
+	}
+#endif
+}
+
+void perfDelta(const PerfSample& begin, const PerfSample& end, PerfSample& delta)
+{
+	for (int i = 0; i < PERF_EVENTS; i++)
+		delta.value[i] = end.value[i] >= begin.value[i] ? end.value[i] - begin.value[i] : 0;
+}
+
+int perfScope(const char* name)
+{
+	Counters& c = counters();
+	std::lock_guard<std::mutex> guard(c.lock);
+	for (int i = 0; i < c.scopes; i++)
+		if (!strcmp(c.names[i], name))
+			return i;
+	if (c.scopes == PERF_MAX_SCOPES)
+		return PERF_MAX_SCOPES - 1;
+	c.names[c.scopes] = name;
+	return c.scopes++;
+}
+
+void perfAdd(int scope, const PerfSample& delta)
+{
+	Counters& c = counters();
+	std::lock_guard<std::mutex> guard(c.lock);
+	c.calls[scope]++;
+	for (int i = 0; i < PERF_EVENTS; i++)
+		c.totals[scope][i] += (double)delta.value[i];
+}
+
+int perfStats(PerfStats* out, int max)
+{
+	Counters& c = counters();
+	std::lock_guard<std::mutex> guard(c.lock);
+	int count = c.scopes < max ? c.scopes : max;
+	for (int i = 0; i < count; i++)
+	{
+		out[i].name = c.names[i];
+		out[i].calls = c.calls[i];
+		for (int e = 0; e < PERF_EVENTS; e++)
+			out[i].value[e] = c.totals[i][e];
+	}
+	return count;
+}
+
+void perfReset()
+{
+	Counters& c = counters();
+	std::lock_guard<std::mutex> guard(c.lock);
+	memset(c.calls, 0, sizeof(c.calls));
+	memset(c.totals, 0, sizeof(c.totals));
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <cstdint>
+#include "profiler.h"
+
+//Hardware performance counters through Linux perf_event_open. Everything is optional:
+//on other systems, without permission (perf_event_paranoid, containers) or on CPUs
+//lacking an event the counter reads as unavailable and the scopes only time.
+enum PerfEvent
+{
+	PERF_CYCLES = 0,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES,
+	PERF_BRANCH_MISSES,
+	//Retired floating point arithmetic instructions, packed SIMD only (Intel FP_ARITH_INST_RETIRED)
+	PERF_VECTOR,
+	PERF_EVENTS
+};
+
+struct PerfSample
+{
+	uint64_t value[PERF_EVENTS];
+};
+
+//Per-scope totals since the last reset
+struct PerfStats
+{
+	const char* name;
+	uint64_t calls;
+	double value[PERF_EVENTS];
+};
+
+const int PERF_MAX_SCOPES = 32;
+//Threads counted: the one that opened the counters and the workers of the parallelFor pool.
+//The threads a parallelFor starts of its own while the pool is busy are not counted.
+const int PERF_MAX_THREADS = 64;
+
+//Open the counters for the calling thread. Call it before the first parallelFor, the
+//pool workers then open theirs as they start. Returns false if no counter could be opened.
+bool perfOpen();
+//Count the calling thread too, called by every pool worker when it starts
+void perfThreadStart();
+void perfClose();
+bool perfAvailable(PerfEvent event);
+//Why nothing could be opened, empty if something was
+const char* perfError();
+const char* perfEventName(PerfEvent event);
+//Current counts summed over the counted threads, zero for unavailable counters,
+//scaled if the kernel multiplexed them
+void perfRead(PerfSample& s);
+//Counts from begin to end
+void perfDelta(const PerfSample& begin, const PerfSample& end, PerfSample& delta);
+
+int perfScope(const char* name);
+void perfAdd(int scope, const PerfSample& delta);
+int perfStats(PerfStats* out, int max);
+void perfReset();
+
+//Counts a scope on the thread that called perfOpen(), the workers included; reading costs
+//a few syscalls per thread, meant for coarse phases, not inner loops
+class PerfTimer
+{
+public:
+	explicit PerfTimer(int id)
+		: scope(id)
+	{
+		perfRead(start);
+	}
+	~PerfTimer()
+	{
+		PerfSample end, delta;
+		perfRead(end);
+		perfDelta(start, end, delta);
+		perfAdd(scope, delta);
+	}
+private:
+	int scope;
+	PerfSample start;
+};
+
+//Timer and counters of a scope
+#if PROFILE
+#define PERF_SCOPE(name) \
+	PROFILE_SCOPE(name); \
+	static const int PROFILE_CONCAT(perfId, __LINE__) = perfScope(name); \
+	PerfTimer PROFILE_CONCAT(perfTimer, __LINE__)(PROFILE_CONCAT(perfId, __LINE__))
+#else
+#define PERF_SCOPE(name)
+#endif
@@ -0,0 +1,150 @@
+#include <cmath>
+#include <cstring>
+#include <mutex>
+#include <algorithm>
+#include "diagnostics.h"
+#include "parallel.h"
+#include "counters.h"
+#include "tree.h"
+
+void resetConservation(Conservation& c)
+{
+	memset(&c, 0, sizeof(c));
+}
+
+void addMoments(const State& s, size_t begin, size_t end, Conservation& c)
+{
+	for (size_t i = begin; i < end; i++)
+	{
+		double m = s.mass[i];
+		double x = s.px[i], y = s.py[i], z = s.pz[i];
+		double mvx = m * s.vx[i], mvy = m * s.vy[i], mvz = m * s.vz[i];
+		c.kinetic += 0.5 * (mvx * s.vx[i] + mvy * s.vy[i] + mvz * s.vz[i]);
+		c.momentum[0] += mvx;
+		c.momentum[1] += mvy;
+		c.momentum[2] += mvz;
+		double lx = y * mvz - z * mvy;
+		double ly = z * mvx - x * mvz;
+		double lz = x * mvy - y * mvx;
+		c.angular[0] += lx;
+		c.angular[1] += ly;
+		c.angular[2] += lz;
+		c.center[0] += m * x;
+		c.center[1] += m * y;
+		c.center[2] += m * z;
+		c.mass += m;
+		c.momentumScale += std::sqrt(mvx * mvx + mvy * mvy + mvz * mvz);
+		c.angularScale += std::sqrt(lx * lx + ly * ly + lz * lz);
+	}
+}
+
+void addConservation(Conservation& to, const Conservation& from)
+{
+	to.kinetic += from.kinetic;
+	to.potential += from.potential;
+	for (int k = 0; k < 3; k++)
+	{
+		to.momentum[k] += from.momentum[k];
+		to.angular[k] += from.angular[k];
+		to.center[k] += from.center[k];
+	}
+	to.mass += from.mass;
+	to.momentumScale += from.momentumScale;
+	to.angularScale += from.angularScale;
+}
+
+double treePotential(const State& s, double softening, double theta)
+{
+	PROFILE_SCOPE("treePotential");
+	Octree tree;
+	{
+		PERF_SCOPE("tree build");
+		tree.build(s);
+	}
+	if (tree.size() < 2)
+		return 0.0;
+
+	//A body inside an accepted cell would see itself: keep theta below 1/sqrt(3).
+	//Only massive bodies have potential energy, test particles are not in the tree.
+	theta = std::min(theta, 0.55);
+	double eps2 = softening * softening;
+	double sum = 0.0;
+	std::mutex guard;
+	parallelFor(tree.size(), [&](size_t begin, size_t end)
+	{
+		double partial = 0.0;
+		for (size_t k = begin; k < end; k++)
+			partial += s.mass[tree.body(k)] * tree.potential(k, eps2, theta * theta);
+		std::lock_guard<std::mutex> lock(guard);
+		sum += partial;
+	});
+	return 0.5 * sum;
+}
+
+void measureConservation(const State& s, double softening, Conservation& c, double theta)
+{
+	PROFILE_SCOPE("measureConservation");
+	resetConservation(c);
+	c.day = s.day;
+	std::mutex guard;
+	size_t massive = 0;
+	for (size_t j = 0; j < s.size(); j++)
+		if (s.gm[j] != 0.0)
+			massive++;
+	bool direct = massive <= DIRECT_POTENTIAL_LIMIT;
+	double eps2 = softening * softening;
+	parallelFor(s.size(), [&](size_t begin, size_t end)
+	{
+		Conservation partial;
+		resetConservation(partial);
+		addMoments(s, begin, end, partial);
+		if (direct)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				if (s.mass[i] == 0.0)
+					continue;
+				double phi = 0.0;
+				for (size_t j = 0; j < s.size(); j++)
+				{
+					if (j == i || s.gm[j] == 0.0)
+						continue;
+					double dx = s.px[j] - s.px[i];
+					double dy = s.py[j] - s.py[i];
+					double dz = s.pz[j] - s.pz[i];
+					phi -= s.gm[j] / std::sqrt(dx * dx + dy * dy + dz * dz + eps2);
+				}
+				partial.potential += 0.5 * s.mass[i] * phi;
+			}
+		}
+		std::lock_guard<std::mutex> lock(guard);
+		addConservation(c, partial);
+	});
+	if (!direct)
+		c.potential = treePotential(s, softening, theta);
+}
+
+ConservationError conservationError(const Conservation& c, const Conservation& reference)
+{
+	ConservationError e;
+	double e0 = reference.kinetic + reference.potential;
+	double e1 = c.kinetic + c.potential;
+	e.energy = e0 != 0.0 ? std::fabs(e1 - e0) / std::fabs(e0) : 0.0;
+	double dp = 0.0, dl = 0.0, drift = 0.0;
+	double dt = (c.day - reference.day) * 86400.0;
+	for (int k = 0; k < 3; k++)
+	{
+		dp += (c.momentum[k] - reference.momentum[k]) * (c.momentum[k] - reference.momentum[k]);
+		dl += (c.angular[k] - reference.angular[k]) * (c.angular[k] - reference.angular[k]);
+		if (reference.mass > 0.0 && c.mass > 0.0)
+		{
+			double expected = (reference.center[k] + reference.momentum[k] * dt) / reference.mass;
+			double d = c.center[k] / c.mass - expected;
+			drift += d * d;
+		}
+	}
+	e.momentum = reference.momentumScale > 0.0 ? std::sqrt(dp) / reference.momentumScale : 0.0;
+	e.angular = reference.angularScale > 0.0 ? std::sqrt(dl) / reference.angularScale : 0.0;
+	e.drift = std::sqrt(drift);
+	return e;
+}
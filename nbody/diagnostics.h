@@ -0,0 +1,49 @@
+#pragma once
+#include <cstddef>
+#include "state.h"
+
+//Conserved quantities of a state, SI units. 128 bytes, stored as is in trajectory files.
+struct Conservation
+{
+	double day;
+	double kinetic;
+	double potential;
+	double momentum[3];
+	double angular[3];
+	//Mass-weighted position sum, centre of mass = center / mass
+	double center[3];
+	double mass;
+	//Sums of |m v| and |r x m v|, the scales momentum errors are measured against
+	double momentumScale;
+	double angularScale;
+	double reserved;
+};
+
+//Errors of a state relative to a reference state
+struct ConservationError
+{
+	//|E - E0| / |E0|
+	double energy;
+	//|P - P0| / sum |m v|
+	double momentum;
+	//|L - L0| / sum |r x m v|
+	double angular;
+	//Distance of the centre of mass from where the initial momentum carries it, m
+	double drift;
+};
+
+//Above this many massive bodies the potential is approximated with a tree
+const size_t DIRECT_POTENTIAL_LIMIT = 4096;
+
+//Clear the sums
+void resetConservation(Conservation& c);
+//Add kinetic energy, momenta and mass moments of bodies [begin, end)
+void addMoments(const State& s, size_t begin, size_t end, Conservation& c);
+//Add the partial sums of another block
+void addConservation(Conservation& to, const Conservation& from);
+//Measure everything outside a force pass, e.g. for playback. The potential is summed
+//directly up to DIRECT_POTENTIAL_LIMIT massive bodies, above with treePotential.
+void measureConservation(const State& s, double softening, Conservation& c, double theta = 0.5);
+//Potential energy from a Barnes-Hut octree with opening angle theta, O(N log N)
+double treePotential(const State& s, double softening, double theta);
+ConservationError conservationError(const Conservation& c, const Conservation& reference);
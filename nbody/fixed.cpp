@@ -0,0 +1,120 @@
+#include <cmath>
+#include "fixed.h"
+#include "parallel.h"
+#include "counters.h"
+
+//Fused multiply-add would change float rounding between compilers and targets
+#if defined(_MSC_VER)
+#pragma fp_contract(off)
+#elif defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+static const double P_SCALE = (double)(1LL << FIXED_P_BITS);
+static const double V_SCALE = (double)(1LL << FIXED_V_BITS);
+
+void FixedIntegrator::load(const State& s)
+{
+	size_t n = s.size();
+	qx.resize(n); qy.resize(n); qz.resize(n);
+	wx.resize(n); wy.resize(n); wz.resize(n);
+	gm.resize(n);
+	ax.assign(n, 0.f); ay.assign(n, 0.f); az.assign(n, 0.f);
+	for (size_t i = 0; i < n; i++)
+	{
+		qx[i] = std::llround(s.px[i] * P_SCALE);
+		qy[i] = std::llround(s.py[i] * P_SCALE);
+		qz[i] = std::llround(s.pz[i] * P_SCALE);
+		wx[i] = std::llround(s.vx[i] * V_SCALE);
+		wy[i] = std::llround(s.vy[i] * V_SCALE);
+		wz[i] = std::llround(s.vz[i] * V_SCALE);
+		gm[i] = (float)s.gm[i];
+	}
+}
+
+void FixedIntegrator::store(State& s) const
+{
+	size_t n = size();
+	if (s.size() != n)
+		s.resize(n);
+	for (size_t i = 0; i < n; i++)
+	{
+		s.px[i] = qx[i] / P_SCALE;
+		s.py[i] = qy[i] / P_SCALE;
+		s.pz[i] = qz[i] / P_SCALE;
+		s.vx[i] = wx[i] / V_SCALE;
+		s.vy[i] = wy[i] / V_SCALE;
+		s.vz[i] = wz[i] / V_SCALE;
+	}
+}
+
+void FixedIntegrator::force(size_t begin, size_t end)
+{
+	PROFILE_SCOPE("FixedIntegrator::force");
+	const float inv = 1.f / (float)P_SCALE;
+	size_t n = size();
+	for (size_t i = begin; i < end; i++)
+	{
+		float sx = 0.f, sy = 0.f, sz = 0.f;
+		for (size_t j = 0; j < n; j++)
+		{
+			if (j == i)
+				continue;
+			//Integer offsets are exact, the conversion rounds once
+			float dx = (float)(qx[j] - qx[i]) * inv;
+			float dy = (float)(qy[j] - qy[i]) * inv;
+			float dz = (float)(qz[j] - qz[i]) * inv;
+			float r2 = dx * dx + dy * dy + dz * dz;
+			float r = std::sqrt(r2);
+			float F = gm[j] / (r2 * r);
+			sx += dx * F;
+			sy += dy * F;
+			sz += dz * F;
+		}
+		ax[i] = sx;
+		ay[i] = sy;
+		az[i] = sz;
+	}
+}
+
+void FixedIntegrator::step(float dt)
+{
+	size_t n = size();
+	int64_t sec = (int64_t)std::llround(dt);
+	if (n == 0 || sec <= 0)
+		return;
+	if (ax.size() != n)
+	{
+		ax.resize(n); ay.resize(n); az.resize(n);
+	}
+	{
+		PERF_SCOPE("force");
+		parallelFor(n, [this](size_t begin, size_t end) { force(begin, end); });
+	}
+	PERF_SCOPE("integrate");
+	//Kick
+	double kick = (double)sec * V_SCALE;
+	for (size_t i = 0; i < n; i++)
+	{
+		wx[i] += std::llround(ax[i] * kick);
+		wy[i] += std::llround(ay[i] * kick);
+		wz[i] += std::llround(az[i] * kick);
+	}
+	//Drift, integer only: 2^-20 m/s * s -> 2^-10 m with rounding
+	const int shift = FIXED_V_BITS - FIXED_P_BITS;
+	const int64_t half = 1LL << (shift - 1);
+	int64_t* __restrict px = qx.data();
+	int64_t* __restrict py = qy.data();
+	int64_t* __restrict pz = qz.data();
+	const int64_t* __restrict vx = wx.data();
+	const int64_t* __restrict vy = wy.data();
+	const int64_t* __restrict vz = wz.data();
+	for (size_t i = 0; i < n; i++)
+	{
+		px[i] += (vx[i] * sec + half) >> shift;
+		py[i] += (vy[i] * sec + half) >> shift;
+		pz[i] += (vz[i] * sec + half) >> shift;
+	}
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "state.h"
+
+//Fixed-point integration
+//Positions are 64-bit integers on a uniform grid of 2^-10 m (range about +-60000 AU),
+//velocities are 64-bit integers in units of 2^-20 m/s. The drift is pure integer
+//arithmetic, forces are evaluated in float on exact integer offsets between bodies.
+//Every body sums its forces in the same order regardless of the thread count, so
+//the result is bit-identical across compilers, platforms and thread counts as long
+//as floating point contraction is disabled (see fixed.cpp).
+
+//Position grid, fraction bits per metre
+const int FIXED_P_BITS = 10;
+//Velocity grid, fraction bits per m/s
+const int FIXED_V_BITS = 20;
+
+class FixedIntegrator
+{
+public:
+	//Convert a floating point state onto the grid
+	void load(const State& s);
+	//Convert the grid back into a floating point state (gm, mass, day are kept)
+	void store(State& s) const;
+	//One kick-drift step of dt seconds, dt is rounded to whole seconds
+	void step(float dt);
+	//Number of bodies
+	size_t size() const
+	{
+		return qx.size();
+	}
+	//Grid columns, exposed for checkpoints
+	std::vector<int64_t> qx, qy, qz;
+	std::vector<int64_t> wx, wy, wz;
+	std::vector<float> gm;
+
+private:
+	//Acceleration scratch, m/s^2
+	std::vector<float> ax, ay, az;
+	//Compute accelerations for bodies [begin, end)
+	void force(size_t begin, size_t end);
+};
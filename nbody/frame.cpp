@@ -0,0 +1,42 @@
+#include "frame.h"
+#include "profiler.h"
+
+FrameUniforms::FrameUniforms()
+	: buffer(0)
+{
+	frame.view = frame.projection = frame.inverseViewProjection = glm::mat4(1.f);
+	frame.eye = glm::vec4(0.f, 0.f, 0.f, 1.f);
+	frame.light = glm::vec4(0.f, 0.f, 0.f, 1.f);
+	frame.lighting = glm::vec4(0.9f, 0.0005f, 0.04f, 0.f);
+	frame.viewport = glm::vec4(1.f);
+}
+
+bool FrameUniforms::init()
+{
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameData), &frame, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_BINDING, buffer);
+	return glGetError() == GL_NO_ERROR;
+}
+
+void FrameUniforms::release()
+{
+	if (buffer)
+		glDeleteBuffers(1, &buffer);
+	buffer = 0;
+}
+
+void FrameUniforms::update(const glm::mat4& view, const glm::mat4& projection, float width, float height)
+{
+	PROFILE_SCOPE("FrameUniforms::update");
+	frame.view = view;
+	frame.projection = projection;
+	frame.inverseViewProjection = glm::inverse(projection * view);
+	frame.eye = glm::inverse(view)[3];
+	frame.viewport = glm::vec4(width, height, 0.5f * height * projection[1][1], 0.f);
+	glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameData), &frame);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <glew.h>
+#include <glm\glm.hpp>
+
+//Camera and light of a frame in one uniform buffer. It is written once per frame and stays
+//bound at FRAME_BINDING; programs declare FRAME_BLOCK, compileProgram() links it to the
+//binding, so draws set no matrices of their own.
+
+const GLuint FRAME_BINDING = 0;
+
+//The light of the bodies: the Sun at the origin, diffuse 0.9, quadratic attenuation 0.0005,
+//ambient 0.04, the fixed-function lighting the scene was first made with
+#define FRAME_BLOCK \
+	"layout(std140) uniform Frame\n" \
+	"{\n" \
+	"	mat4 View;\n" \
+	"	mat4 Projection;\n" \
+	"	mat4 InverseViewProjection;\n" \
+	"	vec4 Eye;\n" \
+	"	vec4 Light;\n" \
+	"	vec4 Lighting;\n" \
+	"	vec4 Viewport;\n" \
+	"};\n" \
+	"float lightAt(vec3 world, vec3 normal)\n" \
+	"{\n" \
+	"	vec3 toLight = Light.xyz - world;\n" \
+	"	float d2 = max(dot(toLight, toLight), 1e-12);\n" \
+	"	return Lighting.x * max(dot(normal, toLight * inversesqrt(d2)), 0.0) / (1.0 + Lighting.y * d2);\n" \
+	"}\n"
+
+//The block as laid out by std140
+struct FrameData
+{
+	glm::mat4 view;
+	glm::mat4 projection;
+	glm::mat4 inverseViewProjection;
+	//Camera position in render units
+	glm::vec4 eye;
+	//Light position in render units
+	glm::vec4 light;
+	//Diffuse, quadratic attenuation, ambient
+	glm::vec4 lighting;
+	//Width and height in pixels, pixels per render unit at distance 1
+	glm::vec4 viewport;
+};
+
+class FrameUniforms
+{
+public:
+	FrameUniforms();
+	//Needs a current GL 3.3 context
+	bool init();
+	void release();
+	//Camera of the frame and the viewport in pixels, written to the buffer
+	void update(const glm::mat4& view, const glm::mat4& projection, float width, float height);
+	const FrameData& data() const
+	{
+		return frame;
+	}
+
+private:
+	GLuint buffer;
+	FrameData frame;
+};
@@ -0,0 +1,287 @@
+#include <cmath>
+#include <algorithm>
+#include "history.h"
+
+namespace
+{
+	const double QUANTA = 65535.0;
+	//Largest steps between neighbouring points
+	const int64_t LONGEST_GAP = 65535;
+	//First box around a trail, relative to the distance from the origin, and the margin
+	//added on a side it grows over
+	const double INITIAL_BOX = 1e-2;
+	const double GROWTH = 0.25;
+
+	void encode(const double origin[3], const double extent[3], const double p[3], uint16_t q[3])
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			double v = std::floor((p[k] - origin[k]) / extent[k] * QUANTA + 0.5);
+			q[k] = (uint16_t)std::min(std::max(v, 0.0), QUANTA);
+		}
+	}
+
+	void decode(const double origin[3], const double extent[3], const uint16_t q[3], double p[3])
+	{
+		for (int k = 0; k < 3; k++)
+			p[k] = origin[k] + q[k] * (extent[k] / QUANTA);
+	}
+
+	double distanceToSegment(const double p[3], const double a[3], const double b[3])
+	{
+		double ab[3], ap[3];
+		double length2 = 0.0, along = 0.0;
+		for (int k = 0; k < 3; k++)
+		{
+			ab[k] = b[k] - a[k];
+			ap[k] = p[k] - a[k];
+			length2 += ab[k] * ab[k];
+			along += ab[k] * ap[k];
+		}
+		double t = length2 > 0.0 ? std::min(std::max(along / length2, 0.0), 1.0) : 0.0;
+		double d2 = 0.0;
+		for (int k = 0; k < 3; k++)
+		{
+			double d = ap[k] - t * ab[k];
+			d2 += d * d;
+		}
+		return std::sqrt(d2);
+	}
+}
+
+TrailStore::TrailStore(size_t budgetBytes, size_t maxTrails)
+	: maxTrails(std::max(maxTrails, (size_t)1))
+{
+	size_t share = budgetBytes / this->maxTrails;
+	size_t overhead = sizeof(Trail) + 3 * TRAIL_WINDOW * sizeof(uint16_t);
+	pointsPerTrail = std::max(share > overhead ? (share - overhead) / (4 * sizeof(uint16_t)) : 0, (size_t)4);
+	trails.reserve(this->maxTrails);
+}
+
+int TrailStore::add(uint32_t length)
+{
+	if (trails.size() >= maxTrails)
+		return -1;
+	trails.emplace_back();
+	Trail& t = trails.back();
+	//Without any simplification length steps need length + 1 points
+	t.capacity = std::min(pointsPerTrail, (size_t)length + 2);
+	t.points.assign(4 * t.capacity, 0);
+	t.window.reserve(3 * TRAIL_WINDOW);
+	t.count = 0;
+	t.newest = ~(uint64_t)0;
+	t.length = length;
+	t.oldestTick = t.newestTick = 0;
+	t.samples = 0;
+	t.stride = 1;
+	for (int k = 0; k < 3; k++)
+		t.origin[k] = t.extent[k] = 0.0;
+	return (int)trails.size() - 1;
+}
+
+void TrailStore::restart(int trail, uint32_t length)
+{
+	if (trail < 0 || trail >= (int)trails.size())
+		return;
+	Trail& t = trails[trail];
+	size_t capacity = std::min(pointsPerTrail, (size_t)length + 2);
+	if (capacity != t.capacity)
+	{
+		t.capacity = capacity;
+		t.points.assign(4 * capacity, 0);
+	}
+	t.length = length;
+	t.count = 0;
+	t.window.clear();
+}
+
+void TrailStore::clear()
+{
+	trails.clear();
+}
+
+size_t TrailStore::capacity(int trail) const
+{
+	return trails[trail].capacity;
+}
+
+size_t TrailStore::count(int trail) const
+{
+	return trails[trail].count;
+}
+
+uint64_t TrailStore::newest(int trail) const
+{
+	return trails[trail].newest;
+}
+
+int64_t TrailStore::span(int trail) const
+{
+	const Trail& t = trails[trail];
+	return t.count > 0 ? t.newestTick - t.oldestTick : 0;
+}
+
+void TrailStore::position(int trail, uint64_t id, double out[3]) const
+{
+	const Trail& t = trails[trail];
+	decode(t.origin, t.extent, &t.points[4 * (id % t.capacity)], out);
+}
+
+size_t TrailStore::bytes() const
+{
+	size_t total = trails.capacity() * sizeof(Trail);
+	for (auto& t : trails)
+		total += (t.points.capacity() + t.window.capacity()) * sizeof(uint16_t);
+	return total;
+}
+
+void TrailStore::include(Trail& t, const double p[3])
+{
+	bool inside = true;
+	for (int k = 0; k < 3; k++)
+		inside = inside && p[k] >= t.origin[k] && p[k] <= t.origin[k] + t.extent[k];
+	if (inside)
+		return;
+	double origin[3] = { t.origin[0], t.origin[1], t.origin[2] };
+	double extent[3] = { t.extent[0], t.extent[1], t.extent[2] };
+	for (int k = 0; k < 3; k++)
+	{
+		double low = std::min(t.origin[k], p[k]);
+		double high = std::max(t.origin[k] + t.extent[k], p[k]);
+		double span = high - low;
+		if (p[k] < t.origin[k])
+			low -= GROWTH * span;
+		if (p[k] > t.origin[k] + t.extent[k])
+			high += GROWTH * span;
+		t.origin[k] = low;
+		t.extent[k] = high - low;
+	}
+	//Every point moves to the new box, the error stays within one step of it
+	double v[3];
+	for (size_t i = 0; i < t.count; i++)
+	{
+		uint16_t* q = &t.points[4 * ((t.newest - i) % t.capacity)];
+		decode(origin, extent, q, v);
+		encode(t.origin, t.extent, v, q);
+	}
+	for (size_t i = 0; i < t.window.size(); i += 3)
+	{
+		decode(origin, extent, &t.window[i], v);
+		encode(t.origin, t.extent, v, &t.window[i]);
+	}
+}
+
+void TrailStore::dropOldest(Trail& t)
+{
+	if (t.count > 1)
+	{
+		uint64_t next = t.newest + 2 - t.count;
+		t.oldestTick += t.points[4 * (next % t.capacity) + 3];
+	}
+	t.count--;
+}
+
+void TrailStore::push(Trail& t, const uint16_t q[3], int64_t tick)
+{
+	if (t.count == t.capacity)
+		dropOldest(t);
+	int64_t gap = t.count > 0 ? std::min(tick - t.newestTick, LONGEST_GAP) : 0;
+	t.newest++;
+	uint16_t* point = &t.points[4 * (t.newest % t.capacity)];
+	point[0] = q[0];
+	point[1] = q[1];
+	point[2] = q[2];
+	point[3] = (uint16_t)gap;
+	if (t.count == 0)
+		t.oldestTick = tick;
+	t.count++;
+	t.newestTick = tick;
+}
+
+void TrailStore::sample(int trail, int64_t tick, const double position[3])
+{
+	if (trail < 0 || trail >= (int)trails.size())
+		return;
+	Trail& t = trails[trail];
+	if (t.count > 0 && tick < t.newestTick)
+	{
+		t.count = 0;
+		t.window.clear();
+	}
+	uint16_t q[3];
+	if (t.count == 0)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			t.extent[k] = std::max(std::fabs(position[k]) * INITIAL_BOX, 1.0);
+			t.origin[k] = position[k] - 0.5 * t.extent[k];
+		}
+		encode(t.origin, t.extent, position, q);
+		push(t, q, tick);
+		t.window.assign(q, q + 3);
+		t.samples = 0;
+		t.stride = 1;
+		return;
+	}
+	include(t, position);
+	encode(t.origin, t.extent, position, q);
+	uint16_t* point = &t.points[4 * (t.newest % t.capacity)];
+	if (tick == t.newestTick)
+	{
+		//Still the same step: the newest point follows the body
+		std::copy(q, q + 3, point);
+		if (t.samples % t.stride == 0)
+			std::copy(q, q + 3, t.window.end() - 3);
+		return;
+	}
+
+	//The newest point may move to the sample if the samples since the point before it
+	//stay close to the new segment
+	int64_t anchorTick = t.newestTick - point[3];
+	bool keep = t.count < 2 || tick - anchorTick > LONGEST_GAP;
+	if (!keep)
+	{
+		double anchor[3], s[3], w[3];
+		decode(t.origin, t.extent, &t.points[4 * ((t.newest - 1) % t.capacity)], anchor);
+		decode(t.origin, t.extent, q, s);
+		double tolerance = TRAIL_TOLERANCE * std::max(t.extent[0], std::max(t.extent[1], t.extent[2]));
+		for (size_t i = 0; i < t.window.size() && !keep; i += 3)
+		{
+			decode(t.origin, t.extent, &t.window[i], w);
+			keep = distanceToSegment(w, anchor, s) > tolerance;
+		}
+	}
+	if (keep)
+	{
+		//The newest point stays, the sample starts the next one
+		push(t, q, tick);
+		t.window.assign(q, q + 3);
+		t.samples = 0;
+		t.stride = 1;
+	}
+	else
+	{
+		std::copy(q, q + 3, point);
+		point[3] = (uint16_t)(tick - anchorTick);
+		t.newestTick = tick;
+		t.samples++;
+		if (t.samples % t.stride == 0)
+		{
+			if (t.window.size() >= 3 * TRAIL_WINDOW)
+			{
+				//A long smooth stretch is followed by every other sample, evenly spaced
+				size_t kept = 0;
+				for (size_t i = 0; i < t.window.size(); i += 6, kept += 3)
+					std::copy(t.window.begin() + i, t.window.begin() + i + 3, t.window.begin() + kept);
+				t.window.resize(kept);
+				t.stride *= 2;
+			}
+			if (t.samples % t.stride == 0)
+				t.window.insert(t.window.end(), q, q + 3);
+		}
+	}
+
+	//Older points go once the one after them is out of the covered steps
+	while (t.count > 2 && t.oldestTick + t.points[4 * ((t.newest + 2 - t.count) % t.capacity) + 3] <= tick - (int64_t)t.length)
+		dropOldest(t);
+}
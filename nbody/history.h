@@ -0,0 +1,80 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+//Trail history of many bodies under a fixed memory budget. Positions are sampled at
+//simulation step time and simplified as they arrive: a sample replaces the newest point
+//as long as every sample since the last kept point stays within TRAIL_TOLERANCE of the
+//straight segment (the Douglas-Peucker criterion, applied online). Points are stored as
+//16-bit offsets in a bounding box per trail, grown and re-encoded when a body leaves it,
+//with the steps since the previous point: 8 bytes per point.
+//
+//Points have increasing ids for the life of the store; a trail holds the newest count(),
+//the newest one still moving with the body until the next point is kept.
+
+//Largest distance of a dropped sample from the kept line, relative to the trail box size
+const double TRAIL_TOLERANCE = 2e-4;
+//Samples since the last kept point checked against a new segment; over a longer stretch
+//they are thinned to evenly spaced ones
+const size_t TRAIL_WINDOW = 32;
+
+class TrailStore
+{
+public:
+	//budgetBytes is shared evenly by up to maxTrails trails
+	TrailStore(size_t budgetBytes, size_t maxTrails);
+	//New trail covering length steps; -1 if the store is full
+	int add(uint32_t length);
+	//Position in metres at simulation step tick. The same tick again replaces the latest
+	//sample, an earlier one restarts the trail
+	void sample(int trail, int64_t tick, const double position[3]);
+	//Drop the points of a trail, it covers length steps from the next sample on. Point ids
+	//go on from the last one
+	void restart(int trail, uint32_t length);
+	void clear();
+	size_t size() const
+	{
+		return trails.size();
+	}
+	//Points a trail can hold
+	size_t capacity(int trail) const;
+	size_t count(int trail) const;
+	//Id of the newest point, valid when count() > 0
+	uint64_t newest(int trail) const;
+	//Steps between the oldest point and the latest sample
+	int64_t span(int trail) const;
+	//Position in metres of one of the count() newest points
+	void position(int trail, uint64_t id, double out[3]) const;
+	//Memory held by the trails
+	size_t bytes() const;
+
+private:
+	struct Trail
+	{
+		//capacity points of x, y, z, steps since the previous point
+		std::vector<uint16_t> points;
+		//Encoded samples since the last kept point, every stride-th of them
+		std::vector<uint16_t> window;
+		uint32_t samples;
+		uint32_t stride;
+		double origin[3];
+		double extent[3];
+		size_t capacity;
+		size_t count;
+		uint64_t newest;
+		uint32_t length;
+		//Steps of the oldest point and of the latest sample, which is the newest point
+		int64_t oldestTick;
+		int64_t newestTick;
+	};
+
+	//Grow the box of t to hold p, re-encoding the points and the window
+	void include(Trail& t, const double p[3]);
+	void push(Trail& t, const uint16_t q[3], int64_t tick);
+	void dropOldest(Trail& t);
+
+	size_t pointsPerTrail;
+	size_t maxTrails;
+	std::vector<Trail> trails;
+};
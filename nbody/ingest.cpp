@@ -0,0 +1,378 @@
+#include <cmath>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+#include "ingest.h"
+#include "mapped_file.h"
+#include "parallel.h"
+#include "profiler.h"
+
+static const double PI = 3.14159265358979323846;
+static const double DEG = PI / 180.0;
+
+//Columns parsed per row: state vectors x y z vx vy vz gm mass, or elements a e i node peri M
+const int ROW_COLUMNS = 8;
+
+struct Rows
+{
+	std::vector<double> c[ROW_COLUMNS];
+	size_t size() const
+	{
+		return c[0].size();
+	}
+};
+
+enum Format
+{
+	FORMAT_HORIZONS,
+	FORMAT_CSV,
+	FORMAT_MPC,
+};
+
+static const double POW10[] =
+{
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+//Parse a decimal number at p, skipping leading blanks. Accepts E, e and D exponents.
+//Up to 19 significant digits are kept, which is more than any catalog carries.
+static bool parseNumber(const char*& p, const char* end, double& value)
+{
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int exponent = 0;
+	bool any = false;
+	while (p < end && *p >= '0' && *p <= '9')
+	{
+		if (digits < 19)
+		{
+			mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+			if (mantissa)
+				digits++;
+		}
+		else
+		{
+			exponent++;
+		}
+		any = true;
+		p++;
+	}
+	if (p < end && *p == '.')
+	{
+		p++;
+		while (p < end && *p >= '0' && *p <= '9')
+		{
+			if (digits < 19)
+			{
+				mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+				if (mantissa)
+					digits++;
+				exponent--;
+			}
+			any = true;
+			p++;
+		}
+	}
+	if (!any)
+		return false;
+	if (p < end && (*p == 'e' || *p == 'E' || *p == 'd' || *p == 'D'))
+	{
+		const char* q = p + 1;
+		bool expNegative = false;
+		if (q < end && (*q == '-' || *q == '+'))
+			expNegative = *q++ == '-';
+		int e = 0;
+		bool expAny = false;
+		while (q < end && *q >= '0' && *q <= '9')
+		{
+			if (e < 10000)
+				e = e * 10 + (*q - '0');
+			expAny = true;
+			q++;
+		}
+		if (expAny)
+		{
+			exponent += expNegative ? -e : e;
+			p = q;
+		}
+	}
+	double v = (double)mantissa;
+	if (exponent < 0)
+	{
+		while (exponent < -22)
+		{
+			v /= 1e22;
+			exponent += 22;
+		}
+		v /= POW10[-exponent];
+	}
+	else
+	{
+		while (exponent > 22)
+		{
+			v *= 1e22;
+			exponent -= 22;
+		}
+		v *= POW10[exponent];
+	}
+	value = negative ? -v : v;
+	return true;
+}
+
+//Parse a fixed-width field that must hold nothing but the number and blanks
+static bool parseField(const char* line, size_t start, size_t length, double& value)
+{
+	const char* p = line + start;
+	const char* end = p + length;
+	if (!parseNumber(p, end, value))
+		return false;
+	while (p < end && *p == ' ')
+		p++;
+	return p == end;
+}
+
+static const char* nextLine(const char* p, const char* end)
+{
+	const char* nl = (const char*)memchr(p, '\n', end - p);
+	return nl ? nl + 1 : end;
+}
+
+//Horizons rows: JD, calendar date, X, Y, Z, VX, VY, VZ, ...
+static void parseHorizons(const char* p, const char* end, Rows& rows)
+{
+	while (p < end)
+	{
+		const char* eol = nextLine(p, end);
+		const char* q = p;
+		int comma = 0;
+		while (q < eol && comma < 2)
+			if (*q++ == ',')
+				comma++;
+		double v[6];
+		bool ok = comma == 2;
+		for (int i = 0; ok && i < 6; i++)
+		{
+			ok = parseNumber(q, eol, v[i]);
+			while (ok && q < eol && (*q == ' ' || *q == '\t'))
+				q++;
+			if (ok && i < 5)
+				ok = q < eol && *q++ == ',';
+		}
+		if (ok)
+		{
+			for (int i = 0; i < 6; i++)
+				rows.c[i].push_back(v[i] * 1000.0);
+			rows.c[6].push_back(0.0);
+			rows.c[7].push_back(0.0);
+		}
+		p = eol;
+	}
+}
+
+//CSV rows, map[field] is the target column or -1
+static void parseCsv(const char* p, const char* end, const std::vector<int>& map, Rows& rows)
+{
+	static const double unit[ROW_COLUMNS] = { 1e3, 1e3, 1e3, 1e3, 1e3, 1e3, 1e9, 1.0 };
+	while (p < end)
+	{
+		const char* eol = nextLine(p, end);
+		double v[ROW_COLUMNS] = { 0 };
+		int found = 0;
+		const char* q = p;
+		for (size_t field = 0; field < map.size() && q < eol; field++)
+		{
+			const char* next = (const char*)memchr(q, ',', eol - q);
+			if (!next)
+				next = eol;
+			if (map[field] >= 0)
+			{
+				const char* f = q;
+				if (parseNumber(f, next, v[map[field]]))
+					found |= 1 << map[field];
+			}
+			q = next < eol ? next + 1 : eol;
+		}
+		//x..vz are required
+		if ((found & 63) == 63)
+		{
+			for (int i = 0; i < ROW_COLUMNS; i++)
+				rows.c[i].push_back(v[i] * unit[i]);
+		}
+		p = eol;
+	}
+}
+
+//MPCORB.DAT: M 27-35, Peri 38-46, Node 49-57, Incl 60-68, e 71-79, a 93-103 (1-based columns)
+static void parseMpc(const char* p, const char* end, Rows& rows)
+{
+	while (p < end)
+	{
+		const char* eol = nextLine(p, end);
+		double M, peri, node, incl, e, a;
+		if (eol - p >= 103
+			&& parseField(p, 92, 11, a) && parseField(p, 70, 9, e) && e < 1.0 && a > 0.0
+			&& parseField(p, 59, 9, incl) && parseField(p, 48, 9, node)
+			&& parseField(p, 37, 9, peri) && parseField(p, 26, 9, M))
+		{
+			rows.c[0].push_back(a * AU_M);
+			rows.c[1].push_back(e);
+			rows.c[2].push_back(incl * DEG);
+			rows.c[3].push_back(node * DEG);
+			rows.c[4].push_back(peri * DEG);
+			rows.c[5].push_back(M * DEG);
+		}
+		p = eol;
+	}
+}
+
+void elementsToState(size_t n, const double* a, const double* e, const double* incl,
+	const double* node, const double* peri, const double* meanAnomaly, double mu,
+	double* px, double* py, double* pz, double* vx, double* vy, double* vz)
+{
+	for (size_t k = 0; k < n; k++)
+	{
+		double M = std::remainder(meanAnomaly[k], 2.0 * PI);
+		double ek = e[k];
+		//Fixed Newton iteration count keeps the loop branch-free, enough for e < 0.99
+		double E = M + ek * std::sin(M) * (1.0 + ek * std::cos(M));
+		for (int it = 0; it < 8; it++)
+			E -= (E - ek * std::sin(E) - M) / (1.0 - ek * std::cos(E));
+		double cosE = std::cos(E), sinE = std::sin(E);
+		double root = std::sqrt(1.0 - ek * ek);
+		double x = a[k] * (cosE - ek);
+		double y = a[k] * root * sinE;
+		double rate = std::sqrt(mu / a[k]) / (1.0 - ek * cosE);
+		double u = -sinE * rate;
+		double w = root * cosE * rate;
+		double cw = std::cos(peri[k]), sw = std::sin(peri[k]);
+		double cn = std::cos(node[k]), sn = std::sin(node[k]);
+		double ci = std::cos(incl[k]), si = std::sin(incl[k]);
+		double Px = cw * cn - sw * ci * sn, Py = cw * sn + sw * ci * cn, Pz = sw * si;
+		double Qx = -sw * cn - cw * ci * sn, Qy = -sw * sn + cw * ci * cn, Qz = cw * si;
+		px[k] = x * Px + y * Qx;
+		py[k] = x * Py + y * Qy;
+		pz[k] = x * Pz + y * Qz;
+		vx[k] = u * Px + w * Qx;
+		vy[k] = u * Py + w * Qy;
+		vz[k] = u * Pz + w * Qz;
+	}
+}
+
+bool loadCatalog(const std::string& path, State& s, const double* sun)
+{
+	PROFILE_SCOPE("loadCatalog");
+	MappedFile file;
+	if (!file.open(path))
+		return false;
+	const char* begin = (const char*)file.data();
+	const char* end = begin + file.size();
+
+	Format format = FORMAT_MPC;
+	std::vector<int> map;
+	static const char SOE[] = "$$SOE";
+	static const char EOE[] = "$$EOE";
+	const char* soe = std::search(begin, end, SOE, SOE + 5);
+	if (soe != end)
+	{
+		format = FORMAT_HORIZONS;
+		end = std::search(soe, end, EOE, EOE + 5);
+		begin = nextLine(soe, end);
+	}
+	else
+	{
+		//A header line with a comma-separated x column makes it a CSV
+		const char* eol = nextLine(begin, end);
+		std::string header(begin, eol);
+		if (header.find(',') != std::string::npos)
+		{
+			static const char* names[ROW_COLUMNS] = { "x", "y", "z", "vx", "vy", "vz", "gm", "mass" };
+			size_t at = 0;
+			while (at <= header.size())
+			{
+				size_t comma = header.find(',', at);
+				if (comma == std::string::npos)
+					comma = header.size();
+				std::string name;
+				for (size_t i = at; i < comma; i++)
+					if (header[i] != ' ' && header[i] != '\t' && header[i] != '\r' && header[i] != '\n' && header[i] != '"')
+						name += (char)tolower((unsigned char)header[i]);
+				int target = -1;
+				for (int i = 0; i < ROW_COLUMNS; i++)
+					if (name == names[i])
+						target = i;
+				map.push_back(target);
+				at = comma + 1;
+			}
+			if (std::count(map.begin(), map.end(), -1) + 6 > (long)map.size())
+				return false;
+			format = FORMAT_CSV;
+			begin = eol;
+		}
+	}
+
+	//Split at line starts, about a megabyte per piece
+	size_t bytes = end - begin;
+	unsigned int parts = threadCount(bytes / (1 << 20) + 1);
+	std::vector<const char*> cut(parts + 1, end);
+	cut[0] = begin;
+	for (unsigned int i = 1; i < parts; i++)
+		cut[i] = std::max(cut[i - 1], nextLine(std::min(begin + bytes * i / parts, end), end));
+	std::vector<Rows> rows(parts);
+	parallelFor(parts, [&](size_t first, size_t last)
+	{
+		PROFILE_SCOPE("parse catalog");
+		for (size_t i = first; i < last; i++)
+		{
+			//About 200 bytes per MPC line, 150 per Horizons row
+			size_t estimate = (cut[i + 1] - cut[i]) / 150 + 1;
+			for (auto& column : rows[i].c)
+				column.reserve(estimate);
+			if (format == FORMAT_HORIZONS)
+				parseHorizons(cut[i], cut[i + 1], rows[i]);
+			else if (format == FORMAT_CSV)
+				parseCsv(cut[i], cut[i + 1], map, rows[i]);
+			else
+				parseMpc(cut[i], cut[i + 1], rows[i]);
+		}
+	});
+
+	std::vector<size_t> offset(parts + 1, 0);
+	for (unsigned int i = 0; i < parts; i++)
+		offset[i + 1] = offset[i] + rows[i].size();
+	if (offset[parts] == 0)
+		return false;
+	s.resize(offset[parts]);
+	double* columns[ROW_COLUMNS] = { s.px.data(), s.py.data(), s.pz.data(), s.vx.data(), s.vy.data(), s.vz.data(), s.gm.data(), s.mass.data() };
+	parallelFor(parts, [&](size_t first, size_t last)
+	{
+		PROFILE_SCOPE("convert catalog");
+		for (size_t i = first; i < last; i++)
+		{
+			const Rows& r = rows[i];
+			size_t n = r.size();
+			size_t at = offset[i];
+			if (format == FORMAT_MPC)
+			{
+				elementsToState(n, r.c[0].data(), r.c[1].data(), r.c[2].data(), r.c[3].data(), r.c[4].data(), r.c[5].data(), GM_SUN,
+					columns[0] + at, columns[1] + at, columns[2] + at, columns[3] + at, columns[4] + at, columns[5] + at);
+				for (int c = 0; c < 6; c++)
+					for (size_t k = 0; k < n; k++)
+						columns[c][at + k] += sun ? sun[c] : 0.0;
+				std::fill(columns[6] + at, columns[6] + at + n, 0.0);
+				std::fill(columns[7] + at, columns[7] + at + n, 0.0);
+			}
+			else
+			{
+				for (int c = 0; c < ROW_COLUMNS; c++)
+					memcpy(columns[c] + at, r.c[c].data(), n * sizeof(double));
+			}
+		}
+	});
+	return true;
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include <string>
+#include <cstddef>
+#include "state.h"
+
+//Heliocentric gravitational parameter of the Sun, m^3/s^2
+const double GM_SUN = 1.32712440018e20;
+//Astronomical unit, m
+const double AU_M = 1.495978707e11;
+
+//Load an initial conditions catalog into s, replacing its contents. Supported formats:
+// - JPL Horizons vector tables (rows between $$SOE and $$EOE: JD, date, X, Y, Z, VX, VY, VZ in km, km/s)
+// - CSV with a header naming x, y, z, vx, vy, vz in km, km/s and optionally gm in km^3/s^2 and mass in kg
+// - MPC orbit files (MPCORB.DAT layout), heliocentric ecliptic J2000 elements; sun, if not null,
+//   holds the Sun's position and velocity (m, m/s) added to every converted state
+//The file is memory-mapped and parsed in parallel chunks split at line boundaries.
+bool loadCatalog(const std::string& path, State& s, const double* sun = nullptr);
+
+//Convert heliocentric Keplerian elements (a in m, angles in radians, e < 1) of n bodies to
+//Cartesian states; structure-of-arrays in and out so the batches vectorize
+void elementsToState(size_t n, const double* a, const double* e, const double* incl,
+	const double* node, const double* peri, const double* meanAnomaly, double mu,
+	double* px, double* py, double* pz, double* vx, double* vy, double* vz);
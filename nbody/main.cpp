@@ -1,13 +1,15 @@
 #include <iostream>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <cmath>
 #include <array>
+#include <algorithm>
 #include <glew.h>
-#include <GL/GL.h>
-#include <GL/GLU.h>
 #include <glm\glm.hpp>
 #include <glm\trigonometric.hpp>
 #include <glm\vec3.hpp>
+#include <glm\gtc\matrix_transform.hpp>
 #include <SDL_opengl.h>
 #include <SDL.h>
 #include <SDL_main.h>
@@ -15,17 +17,61 @@
 #include "imgui.h"
 #include "imgui_internal.h"
 #include "imgui_impl_sdl_gl3.h"
+#include "state.h"
+#include "fixed.h"
+#include "checkpoint.h"
+#include "trajectory.h"
+#include "playback.h"
+#include "ingest.h"
+#include "physics.h"
+#include "scenario.h"
+#include "diagnostics.h"
+#include "profiler.h"
+#include "counters.h"
+#include "alloc.h"
+#include "autotune.h"
+#include "solar.h"
+#include "spheres.h"
+#include "particles.h"
+#include "trails.h"
+#include "orbits.h"
+#include "predictor.h"
+#include "frame.h"
+#include "sky.h"
+#include "render.h"
+#include "textures.h"
 
-//Gravity constant
-const double G = 6.673e-11;
 //Time step (should be 1 day)
 float step = 86400.0f;
 //Astronomical unit in meters
 const double AU = 1.49597893e11;
 //Scale
 const float scale = 0.0000000005f;
-//Array of OpenGL textures
-GLuint g_Texture[12];
+//Surfaces of the bodies, one layer per texture file, resampled to one size
+const int BODY_TEXTURE_WIDTH = 1024;
+const int BODY_TEXTURE_HEIGHT = 512;
+const int BODY_LAYERS = 11;
+TextureArray gBodyTextures;
+//The star sphere, too large to share the size of the bodies
+GLuint gStarTexture = 0;
+//Number of worker threads, 0 - all cores
+unsigned int gThreads = 0;
+//Checkpoint file
+const char* CHECKPOINT_FILE = "checkpoint.nbc";
+//Trajectory file
+const char* TRAJECTORY_FILE = "trajectory.nbt";
+//Trace export file
+const char* TRACE_FILE = "trace.json";
+//Solver decisions of the autotuner
+const char* TUNE_FILE = "autotune.cfg";
+//Allocation test (--alloc-test): frames of warm-up, then frames that must not allocate
+const int ALLOC_WARMUP_FRAMES = 120;
+const int ALLOC_TEST_FRAMES = 600;
+//Memory for the orbit trails of all bodies
+const size_t TRAIL_BUDGET = 256 << 20;
+//Memory for the computed past trails, and as much for the predicted ones
+const size_t PREDICT_BUDGET = 32 << 20;
+bool gAllocTest = false;
 
 //N-body class
 class Body {
@@ -50,8 +96,12 @@ class Body {
 	const GLfloat tilt;
 	//Orbital period
 	const unsigned int days;
-	//Array of orbit points
-	glm::vec3* orbit;
+	//Orbit trail in the trail store and in the trail renderer, -1 - not created yet
+	int history;
+	int trail;
+	//Computed past and predicted trails in the trail renderer, -1 - not created yet
+	int past;
+	int future;
 
 public:
 	//Constructor
@@ -74,18 +124,23 @@ public:
 		, rad(rad)
 		, tilt(tilt)
 		, days(days)
+		, history(-1)
+		, trail(-1)
+		, past(-1)
+		, future(-1)
+	{
+	};
+	//Constructor from the bundled table
+	Body(const BodyData& b)
+		: Body(b.id, b.name, b.ruName,
+			glm::vec3(b.p[0], b.p[1], b.p[2]),
+			glm::vec3(b.v[0], b.v[1], b.v[2]),
+			b.mass, b.GM, b.rad, b.tilt, b.days)
 	{
-		if (days > 0) {
-			orbit = new glm::vec3[days];
-			for (int i = 0; i < days; i++) {
-				orbit[i] = glm::vec3(NULL);
-			}
-		}
 	};
 
 	~Body()
 	{
-		//delete[] orbit; ???
 	};
 
 	//Update velocity and position based on force and time step
@@ -96,19 +151,97 @@ public:
 	void resetG();
 	//Print
 	void print();
-	//Draw
-	void draw(float rotate);
+	//Queue the sphere of the body
+	void draw(SphereRenderer& spheres, float rotate);
 	//Lock camera on a planet
 	void setCam();
-	//Draw orbits based on current settings
-	void drawOrbit(int day, bool show, bool orbit);
+	//Add the position after a simulation step to the orbit trail
+	void sampleOrbit(TrailStore& store, int64_t tick);
+	//Start the orbit trail over after a jump of the state
+	void restartOrbit(TrailStore& store);
+	//Bring the computed trails up to the ones published by the predictor, which is locked
+	void updatePrediction(const TrailPredictor& predictor, TrailRenderer& trails);
+	//Update the orbit trail and queue it or the analytic orbit based on current settings,
+	//with the computed trails of predictor if it isn't null until the simulation covers them
+	void drawOrbit(const TrailStore& store, TrailRenderer& trails, OrbitRenderer& orbits, const TrailPredictor* predictor,
+		int64_t tick, bool analytic, bool show, bool orbit);
 	//Get body name
-	std::string getName()
+	const std::string& getName() const
 	{
 		return name;
 	}
+	//Get position
+	glm::vec3 getP()
+	{
+		return p;
+	}
+	//Get velocity
+	glm::vec3 getV()
+	{
+		return v;
+	}
+	//Get gravitational parameter
+	double getGM()
+	{
+		return GM;
+	}
+	//Get mass
+	double getMass()
+	{
+		return mass;
+	}
+	//Get orbital period in days
+	unsigned int getDays() const
+	{
+		return days;
+	}
+	//Set position and velocity in meters and m/s
+	void setState(glm::vec3 np, glm::vec3 nv)
+	{
+		p = np;
+		v = nv;
+	}
 };
 
+//Copy bodies into a structure-of-arrays state
+void toState(Body* bodies, size_t n, State& s)
+{
+	s.resize(n);
+	for (size_t i = 0; i < n; i++)
+	{
+		glm::vec3 p = bodies[i].getP();
+		glm::vec3 v = bodies[i].getV();
+		s.px[i] = p.x; s.py[i] = p.y; s.pz[i] = p.z;
+		s.vx[i] = v.x; s.vy[i] = v.y; s.vz[i] = v.z;
+		s.gm[i] = bodies[i].getGM();
+		s.mass[i] = bodies[i].getMass();
+	}
+}
+
+//Copy positions and velocities from a structure-of-arrays state back into bodies
+void fromState(const State& s, Body* bodies, size_t n)
+{
+	for (size_t i = 0; i < n && i < s.size(); i++)
+	{
+		bodies[i].setState(glm::vec3((float)s.px[i], (float)s.py[i], (float)s.pz[i]),
+			glm::vec3((float)s.vx[i], (float)s.vy[i], (float)s.vz[i]));
+	}
+}
+
+//After a jump of the state: restart the orbit trails and compute one period of every body
+//before and after it in the background
+void predictTrails(TrailPredictor& predictor, TrailStore& store, Body* bodies, size_t n, State& s, int64_t tick)
+{
+	toState(bodies, n, s);
+	std::vector<uint32_t> lengths(n);
+	for (size_t i = 0; i < n; i++)
+	{
+		bodies[i].restartOrbit(store);
+		lengths[i] = bodies[i].getDays();
+	}
+	predictor.predict(s, tick, lengths.data());
+}
+
 class Camera
 {
 public:
@@ -118,8 +251,8 @@ public:
 	void OnMouseMotion(const SDL_MouseMotionEvent & e);
 	//Reset camera
 	void OnKeyboard();
-	//Apply the camera matrix and move the view according to camera's angle and position
-	void look();
+	//The view matrix from the camera's angle and position
+	glm::mat4 view();
 	//Destructor
 	~Camera();
 	//Get angle Y
@@ -151,15 +284,16 @@ bool init();
 //Initialize OpenGL
 bool initGL();
 
-//Load texture from file
-void initTexture(std::string name, int cnt);
+//Load res/texture_<name>.jpg as RGB, NULL with a message box if it can't be
+SDL_Surface* loadImage(std::string name);
+//Load a body texture into its layer
+void initTexture(std::string name, int layer);
+//Load the texture of the sky
+void initStarTexture();
 
-//Free texture array
+//Free the textures
 void deleteTexture();
 
-//Apply lighting
-void lighting();
-
 //Handle input from keyboard and mouse
 bool handleInput();
 
@@ -174,8 +308,22 @@ SDL_Window* gWindow = NULL;
 
 SDL_GLContext gContext;
 
-GLuint gProgramID = 0;
-GLint gVertexPos2DLocation = -1;
+//Camera and light of the frame, shared by all programs
+FrameUniforms gFrame;
+//The star sphere
+SkyRenderer gSky;
+//Draws of the frame from all renderers, sorted by state
+RenderQueue gQueue;
+//Body spheres, drawn instanced
+SphereRenderer gSpheres;
+//Scenario and catalog bodies, streamed every frame
+ParticleRenderer gParticles;
+//Orbit trails of the bodies
+TrailRenderer gTrails;
+//Orbits of the bodies from their elements
+OrbitRenderer gOrbits;
+//Projection set up in initGL
+glm::mat4 gProjection;
 Camera camera;
 //Camera offset
 GLdouble cPosX = 0.0f;
@@ -185,6 +333,7 @@ GLdouble zoom = -200.0f;
 
 bool init()
 {
+	PROFILE_SCOPE("init");
 	//Initialization flag
 	bool success = true;
 
@@ -203,6 +352,15 @@ bool init()
 			SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Warning!", "Linear texture filtering not enabled!", gWindow);
 		}
 
+		//A core 3.3 context: everything is drawn by shaders from buffers
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+		SDL_GL_SetAttribute(SDL_GL_RED_SIZE, 8);
+		SDL_GL_SetAttribute(SDL_GL_GREEN_SIZE, 8);
+		SDL_GL_SetAttribute(SDL_GL_BLUE_SIZE, 8);
+		SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
+		SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
 		//Create window
 		gWindow = SDL_CreateWindow("N-Body", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 800, 600, SDL_WINDOW_OPENGL | SDL_WINDOW_MAXIMIZED);
 		SDL_SetWindowGrab(gWindow, SDL_TRUE);
@@ -235,6 +393,8 @@ bool init()
 						SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error initializing GLEW!", SDL_GetError(), gWindow);
 						//printf("Error initializing GLEW! %s\n", glewGetErrorString(glewError));
 					}
+					//GLEW queries extensions the old way, an error in a core context
+					glGetError();
 
 					//Use Vsync
 					if (SDL_GL_SetSwapInterval(1) < 0)
@@ -258,120 +418,41 @@ bool init()
 	return success;
 }
 
+void* imguiAlloc(size_t size)
+{
+	allocCount(size);
+	return malloc(size);
+}
+
+void imguiFree(void* p)
+{
+	if (p)
+		allocFree();
+	free(p);
+}
+
 bool initGL()
 {
-	SDL_GL_SetAttribute(SDL_GL_RED_SIZE, 5);
-	SDL_GL_SetAttribute(SDL_GL_GREEN_SIZE, 5);
-	SDL_GL_SetAttribute(SDL_GL_BLUE_SIZE, 5);
-	SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 16);
-	SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+	PROFILE_SCOPE("initGL");
 	//Success flag
 	bool success = true;
-
-	//Generate program
-	gProgramID = glCreateProgram();
-
-	//Create vertex shader
-	GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
-
-	//Get vertex source
-	const GLchar* vertexShaderSource[] =
-	{
-		"#version 140\nin vec3 LVertexPos2D; void main() { gl_Position = vec4( LVertexPos2D.x, LVertexPos2D.y, 0, 1 ); }"
-	};
-
-	//Set vertex source
-	glShaderSource(vertexShader, 1, vertexShaderSource, NULL);
-
-	//Compile vertex source
-	glCompileShader(vertexShader);
-
-	//Check vertex shader for errors
-	GLint vShaderCompiled = GL_FALSE;
-	glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &vShaderCompiled);
-	if (vShaderCompiled != GL_TRUE)
-	{
-
-		//printf("Unable to compile vertex shader %d!\n", vertexShader);
+	//Initialize clear color
+	glClearColor(0.f, 0.f, 0.f, 0.f);
+	int width, height;
+	SDL_GetWindowSize(gWindow, &width, &height);
+	glViewport(0, 0, width, height);
+	gProjection = glm::perspective(glm::radians(45.0f), (float)width / (float)height, 10.f, 10000.0f);
+	glEnable(GL_DEPTH_TEST);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	if (!gFrame.init() || !gSky.init() || !gSpheres.init() || !gParticles.init() || !gTrails.init() || !gOrbits.init() ||
+		!gBodyTextures.init(BODY_TEXTURE_WIDTH, BODY_TEXTURE_HEIGHT, BODY_LAYERS))
 		success = false;
-	}
-	else
-	{
-		//Attach vertex shader to program
-		glAttachShader(gProgramID, vertexShader);
-
-		//Create fragment shader
-		GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-
-		//Get fragment source
-		const GLchar* fragmentShaderSource[] =
-		{
-			"#version 140\nout vec4 LFragment; void main() { LFragment = vec4( 1.0, 1.0, 1.0, 1.0 ); }"
-		};
-
-		//Set fragment source
-		glShaderSource(fragmentShader, 1, fragmentShaderSource, NULL);
-
-		//Compile fragment source
-		glCompileShader(fragmentShader);
-
-		//Check fragment shader for errors
-		GLint fShaderCompiled = GL_FALSE;
-		glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &fShaderCompiled);
-		if (fShaderCompiled != GL_TRUE)
-		{
-			//printf("Unable to compile fragment shader %d!\n", fragmentShader);
-			success = false;
-		}
-		else
-		{
-			//Attach fragment shader to program
-			glAttachShader(gProgramID, fragmentShader);
-
-			//Link program
-			glLinkProgram(gProgramID);
-
-			//Check for errors
-			GLint programSuccess = GL_TRUE;
-			glGetProgramiv(gProgramID, GL_LINK_STATUS, &programSuccess);
-			if (programSuccess != GL_TRUE)
-			{
-				//printf("Error linking program %d!\n", gProgramID);
-				success = false;
-			}
-			else
-			{
-				//Get vertex attribute location
-				gVertexPos2DLocation = glGetAttribLocation(gProgramID, "LVertexPos2D");
-				if (gVertexPos2DLocation == -1)
-				{
-					//printf("LVertexPos2D is not a valid glsl program variable!\n");
-					success = false;
-				}
-				else
-				{
-					//Initialize clear color
-					glClearColor(0.f, 0.f, 0.f, 0.f);
-					int width, height;
-					SDL_GetWindowSize(gWindow, &width, &height);
-					glViewport(0, 0, width, height);
-
-					glMatrixMode(GL_PROJECTION);
-					glLoadIdentity();
-					gluPerspective(45.0, (float)width / (float)height, 10.f, 10000.0f);
-					glHint(GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST);
-					glEnable(GL_DEPTH_TEST);
-					glMatrixMode(GL_MODELVIEW);
-					glEnable(GL_POLYGON_SMOOTH);
-					glEnable(GL_BLEND);
-					glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-					glHint(GL_POLYGON_SMOOTH_HINT, GL_DONT_CARE);
-					ImGui_ImplSdlGL3_Init(gWindow);
-				}
-			}
-		}
-	}
-
+	//ImGui allocates through malloc, counted like operator new
+	ImGuiIO& io = ImGui::GetIO();
+	io.MemAllocFn = imguiAlloc;
+	io.MemFreeFn = imguiFree;
+	ImGui_ImplSdlGL3_Init(gWindow);
 	return success;
 }
 
@@ -437,137 +518,157 @@ void Camera::OnKeyboard()
 	camFollow = false;
 }
 
-void Camera::look()
+glm::mat4 Camera::view()
 {
-	gluLookAt(_distance, 0, zoom,
-		0, 0, 0,
-		0, 0, 1);
-	glRotated(_angleY, 0, 1, 0);
-	glRotated(_angleZ, 0, 0, 1);
-	glTranslated(cPosX, cPosY, cPosZ);
+	glm::mat4 m = glm::lookAt(glm::vec3((float)_distance, 0.f, (float)zoom), glm::vec3(0.f), glm::vec3(0.f, 0.f, 1.f));
+	m = glm::rotate(m, glm::radians((float)_angleY), glm::vec3(0.f, 1.f, 0.f));
+	m = glm::rotate(m, glm::radians((float)_angleZ), glm::vec3(0.f, 0.f, 1.f));
+	return glm::translate(m, glm::vec3((float)cPosX, (float)cPosY, (float)cPosZ));
 }
 
 Camera::~Camera()
 {
 }
 
-void initTexture(std::string name, int cnt)
+SDL_Surface* loadImage(std::string name)
 {
 	name.append(".jpg");
 	name.insert(0, "res/texture_");
 	SDL_Surface* tempSurface = IMG_Load(name.c_str());
+	if (!tempSurface)
+	{
+		SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Warning!", IMG_GetError(), gWindow);
+		return NULL;
+	}
+	//Whatever the file holds, 3 bytes per pixel
+	if (tempSurface->format->format == SDL_PIXELFORMAT_RGB24)
+		return tempSurface;
+	SDL_Surface* rgb = SDL_ConvertSurfaceFormat(tempSurface, SDL_PIXELFORMAT_RGB24, 0);
+	SDL_FreeSurface(tempSurface);
+	if (!rgb)
+		SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Warning!", SDL_GetError(), gWindow);
+	return rgb;
+}
+
+void initTexture(std::string name, int layer)
+{
+	PROFILE_SCOPE("initTexture");
+	SDL_Surface* tempSurface = loadImage(name);
 	if (tempSurface)
 	{
-		glGenTextures(1, &g_Texture[cnt]);
-		glBindTexture(GL_TEXTURE_2D, g_Texture[cnt]);
+		gBodyTextures.setLayer(layer, (const unsigned char*)tempSurface->pixels, tempSurface->w, tempSurface->h, tempSurface->pitch);
+		SDL_FreeSurface(tempSurface);
+	}
+}
+
+void initStarTexture()
+{
+	PROFILE_SCOPE("initStarTexture");
+	SDL_Surface* tempSurface = loadImage("stars");
+	if (tempSurface)
+	{
+		glGenTextures(1, &gStarTexture);
+		glBindTexture(GL_TEXTURE_2D, gStarTexture);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, tempSurface->pitch / 3);
 		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, tempSurface->w, tempSurface->h, 0, GL_RGB, GL_UNSIGNED_BYTE, tempSurface->pixels);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+		glBindTexture(GL_TEXTURE_2D, 0);
 		SDL_FreeSurface(tempSurface);
 	}
-	else
-	{
-		SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Warning!", IMG_GetError(), gWindow);
-	}
 }
 
 void deleteTexture()
 {
-	glDeleteTextures(12, g_Texture);
+	gBodyTextures.release();
+	if (gStarTexture)
+		glDeleteTextures(1, &gStarTexture);
+	gStarTexture = 0;
+}
+
+void Body::draw(SphereRenderer& spheres, float rotate)
+{
+	SphereInstance instance;
+	instance.position[0] = p.x * scale;
+	instance.position[1] = p.y * scale;
+	instance.position[2] = p.z * scale;
+	instance.radius = (float)rad * 0.0004f;
+	instance.tilt = tilt;
+	instance.rotation = rotate;
+	//Asteroids share the last body texture
+	instance.layer = (float)std::min((int)id, BODY_LAYERS - 1);
+	instance.emission = id == 0 ? 1.f : 0.f;
+	spheres.add(instance, (uint32_t)id);
+}
+
+void Body::sampleOrbit(TrailStore& store, int64_t tick)
+{
+	//The trail covers one period
+	if (days > 0 && history < 0)
+		history = store.add(days);
+	const double position[3] = { p.x, p.y, p.z };
+	store.sample(history, tick, position);
+}
+
+void Body::restartOrbit(TrailStore& store)
+{
+	if (history >= 0)
+		store.restart(history, days);
 }
 
-void lighting()
+void Body::updatePrediction(const TrailPredictor& predictor, TrailRenderer& trails)
 {
-	GLfloat lightPosition[4] = { 0, 0, 0, 1 };
-	GLfloat lightDiff[4] = { 0.9f, 0.9f, 0.9f, 1.f };
-	glShadeModel(GL_SMOOTH);
-	glLightfv(GL_LIGHT0, GL_POSITION, lightPosition);
-	glMaterialfv(GL_FRONT, GL_DIFFUSE, lightDiff);
-	glLightf(GL_LIGHT0, GL_QUADRATIC_ATTENUATION, 0.0005f);
-	glEnable(GL_LIGHTING);
-	glEnable(GL_LIGHT0);
+	const TrailStore& before = predictor.past();
+	const TrailStore& after = predictor.future();
+	if ((size_t)id >= before.size())
+		return;
+	if (past < 0)
+		past = trails.add(before.capacity(id));
+	if (future < 0)
+		future = trails.add(after.capacity(id));
+	trails.update(past, before, id, scale);
+	trails.update(future, after, id, scale);
 }
 
-void Body::draw(float rotate)
+void Body::drawOrbit(const TrailStore& store, TrailRenderer& trails, OrbitRenderer& orbits, const TrailPredictor* predictor,
+	int64_t tick, bool analytic, bool show, bool asteroid)
 {
-	GLfloat sunLight[4] = { 1,1,1,1 };
-	GLfloat otherLight[4] = { 0,0,0,0 };
-	glCullFace(GL_BACK);
-	if (id < 10)
+	//The trail keeps up in either mode, so switching back shows no gap
+	if (history >= 0)
 	{
-		glBindTexture(GL_TEXTURE_2D, g_Texture[id]);
+		if (trail < 0)
+			trail = trails.add(store.capacity(history));
+		trails.update(trail, store, history, scale);
 	}
-	else
+	if (!asteroid)
 	{
-		glBindTexture(GL_TEXTURE_2D, g_Texture[10]);
+		if (id > 9)
+			return;
 	}
-	glEnable(GL_CULL_FACE);
-	glEnable(GL_TEXTURE_2D);
-	glLoadIdentity();
-	camera.look();
-	GLUquadricObj *pObj = gluNewQuadric();
-	gluQuadricDrawStyle(pObj, GLU_FILL);
-	gluQuadricTexture(pObj, GLU_TRUE);
-	gluQuadricNormals(pObj, GLU_SMOOTH);
-	if (id == 0)
+	if (!show)
 	{
-		glMaterialfv(GL_FRONT, GL_EMISSION, sunLight);
+		if (id < 9)
+			return;
 	}
-	else
+	if (analytic && orbits.bound(id))
 	{
-		glMaterialfv(GL_FRONT, GL_EMISSION, otherLight);
+		orbits.queue(id);
+		return;
 	}
-	glPushMatrix();
-	glTranslatef(p.x * scale, p.y * scale, p.z * scale);
-	glScalef(0.0004f, 0.0004f, 0.0004f);
-	glRotatef(tilt, 0.f, 1.f, 0.f);
-	glRotatef(rotate, 0.f, 0.f, 1.f);
-	gluSphere(pObj, rad, 64, 64);
-	glPopMatrix();
-	glDisable(GL_TEXTURE_2D);
-	glCullFace(GL_BACK);
-	glDisable(GL_CULL_FACE);
-	gluDeleteQuadric(pObj);
-}
-
-void Body::drawOrbit(int day, bool show, bool asteroid)
-{
-	if (days > 0)
+	if (history >= 0)
+		trails.queue(trail);
+	//A period after the prediction the simulation has drawn the whole orbit itself
+	if (predictor && tick - predictor->origin() < (int64_t)days)
 	{
-		if (day > days)
-		{
-			orbit[day % days] = p*scale;
-		}
-		else
-		{
-			orbit[day-1] = p*scale;
-		}
-		if (!asteroid)
-		{
-			if (id > 9)
-				return;
-		}
-		if (!show)
-		{
-			if (id < 9)
-				return;
-		}
-		glDisable(GL_LIGHT0);
-		glDisable(GL_LIGHTING);
-		if (day > days)
-			glBegin(GL_LINE_LOOP);
-		else
-			glBegin(GL_POINTS);
-		for (int i = 0; i < days; i++)
-		{
-			glVertex3fv(&orbit[i].x);
-		}
-		glEnd();
-		glEnable(GL_LIGHTING);
-		glEnable(GL_LIGHT0);
+		if (past >= 0)
+			trails.queue(past);
+		if (future >= 0)
+			trails.queue(future);
 	}
 }
 
@@ -578,29 +679,8 @@ void Body::setCam()
 	cPosZ = -(p.z*scale);
 }
 
-void drawStars()
-{
-	glDisable(GL_LIGHT0);
-	glDisable(GL_LIGHTING);
-	glCullFace(GL_FRONT);
-	glEnable(GL_CULL_FACE);
-	glBindTexture(GL_TEXTURE_2D, g_Texture[11]);
-	glEnable(GL_TEXTURE_2D);
-	glLoadIdentity();
-	camera.look();
-	GLUquadricObj *pObj = gluNewQuadric();
-	gluQuadricTexture(pObj, true);
-	glPushMatrix();
-	glTranslatef(0.f, 0.f, 0.f);
-	gluSphere(pObj, 6000, 12, 12);
-	glPopMatrix();
-	glDisable(GL_TEXTURE_2D);
-	glDisable(GL_CULL_FACE);
-	glCullFace(GL_FRONT);
-	gluDeleteQuadric(pObj);
-}
-
 int currBody = 3;
+bool showProfiler = false;
 bool handleInput()
 {
 	bool quit = false;
@@ -656,6 +736,9 @@ bool handleInput()
 				if (camera.camFollow) camera.camFollow = false;
 				else camera.camFollow = true;
 				break;
+			case SDLK_F3:
+				showProfiler = !showProfiler;
+				break;
 			}
 			break;
 		case SDL_MOUSEMOTION:
@@ -676,21 +759,207 @@ bool handleInput()
 	return quit;
 }
 
+//Hardware counters of the PERF_SCOPE sections, per call since the last reset
+void drawCounters()
+{
+	static PerfStats stats[PERF_MAX_SCOPES];
+	ImGui::Separator();
+	if (perfError()[0])
+	{
+		ImGui::Text("Счётчики недоступны: %s", perfError());
+		return;
+	}
+	ImGui::Columns(5);
+	ImGui::Text("Участок");
+	ImGui::NextColumn();
+	ImGui::Text("IPC");
+	ImGui::NextColumn();
+	ImGui::Text("Промахи кэша");
+	ImGui::NextColumn();
+	ImGui::Text("Промахи ветвл.");
+	ImGui::NextColumn();
+	ImGui::Text("SIMD инстр.");
+	ImGui::NextColumn();
+	int count = perfStats(stats, PERF_MAX_SCOPES);
+	for (int i = 0; i < count; i++)
+	{
+		double calls = stats[i].calls > 0 ? (double)stats[i].calls : 1.0;
+		ImGui::Text("%s", stats[i].name);
+		ImGui::NextColumn();
+		if (perfAvailable(PERF_CYCLES) && perfAvailable(PERF_INSTRUCTIONS) && stats[i].value[PERF_CYCLES] > 0.0)
+			ImGui::Text("%.2f", stats[i].value[PERF_INSTRUCTIONS] / stats[i].value[PERF_CYCLES]);
+		else
+			ImGui::Text("-");
+		ImGui::NextColumn();
+		const PerfEvent perCall[3] = { PERF_CACHE_MISSES, PERF_BRANCH_MISSES, PERF_VECTOR };
+		for (auto event : perCall)
+		{
+			if (perfAvailable(event))
+				ImGui::Text("%.3e", stats[i].value[event] / calls);
+			else
+				ImGui::Text("-");
+			ImGui::NextColumn();
+		}
+	}
+	ImGui::Columns(1);
+	if (ImGui::Button("Сбросить счётчики"))
+		perfReset();
+}
+
+//Heap allocations per frame of every subsystem
+void drawAllocations()
+{
+	static AllocStats stats[ALLOC_MAX_SUBSYSTEMS];
+	ImGui::Separator();
+#if ALLOC_TRACKING
+	ImGui::Columns(5);
+	ImGui::Text("Подсистема");
+	ImGui::NextColumn();
+	ImGui::Text("Аллок./кадр");
+	ImGui::NextColumn();
+	ImGui::Text("КБ/кадр");
+	ImGui::NextColumn();
+	ImGui::Text("Пик");
+	ImGui::NextColumn();
+	ImGui::Text("Всего");
+	ImGui::NextColumn();
+	int count = allocStats(stats, ALLOC_MAX_SUBSYSTEMS);
+	for (int i = 0; i < count; i++)
+	{
+		ImGui::Text("%s", stats[i].name);
+		ImGui::NextColumn();
+		ImGui::Text("%llu", (unsigned long long)stats[i].allocations);
+		ImGui::NextColumn();
+		ImGui::Text("%.1f", stats[i].bytes / 1024.0);
+		ImGui::NextColumn();
+		ImGui::Text("%llu", (unsigned long long)stats[i].peakAllocations);
+		ImGui::NextColumn();
+		ImGui::Text("%llu", (unsigned long long)stats[i].totalAllocations);
+		ImGui::NextColumn();
+	}
+	ImGui::Columns(1);
+#else
+	ImGui::Text("Учёт аллокаций отключён при сборке (ALLOC_TRACKING=0)");
+#endif
+}
+
+//Profiler overlay: time per frame of every scope, frame times and simulation throughput
+void drawProfiler()
+{
+	static ScopeStats stats[PROFILE_MAX_SCOPES];
+	static float times[PROFILE_HISTORY];
+	static float bins[40];
+	static int traceFrames = 120;
+	ImGui::SetNextWindowSize(ImVec2(440, 420), ImGuiSetCond_FirstUseEver);
+	ImGui::Begin("Профилировщик (F3)", &showProfiler);
+	double stepsPerSecond, interactionsPerSecond;
+	profileRates(stepsPerSecond, interactionsPerSecond);
+	ImGui::Text("Шагов/с: %.1f  Взаимодействий/с: %.3e", stepsPerSecond, interactionsPerSecond);
+	int frames = profileFrameTimes(times, PROFILE_HISTORY);
+	if (frames > 0)
+	{
+		float longest = *std::max_element(times, times + frames);
+		ImGui::PlotLines("Кадр, мс", times, frames, 0, NULL, 0.f, longest, ImVec2(0, 60));
+		//Distribution of the frame times, none while every sampled frame took no time
+		if (longest > 0.f)
+		{
+			for (auto& b : bins)
+				b = 0.f;
+			for (int i = 0; i < frames; i++)
+				bins[std::min(39, (int)(times[i] / longest * 40.f))] += 1.f;
+			char range[32];
+			snprintf(range, sizeof(range), "0 - %.1f мс", longest);
+			ImGui::PlotHistogram("Распределение", bins, 40, 0, range, 0.f, FLT_MAX, ImVec2(0, 60));
+		}
+	}
+	//Sphere levels of the last frame, from the finest mesh to the impostor
+	const SphereStats& spheres = gSpheres.stats();
+	ImGui::Text("Сферы по LOD: %d %d %d %d %d | %d, отсечено %d", (int)spheres.lod[0], (int)spheres.lod[1], (int)spheres.lod[2],
+		(int)spheres.lod[3], (int)spheres.lod[4], (int)spheres.lod[SPHERE_IMPOSTOR], (int)spheres.culled);
+	ImGui::Text("Треугольников: %d, вызовов отрисовки: %d", (int)spheres.triangles, (int)spheres.draws);
+	const ParticleStats& particles = gParticles.stats();
+	if (particles.particles > 0)
+		ImGui::Text("Частиц: %d, %.1f MB/кадр, %s буфер", (int)particles.particles, particles.bytes / 1048576.0,
+			particles.persistent ? "постоянный" : "переотображаемый");
+	const TrailStats& trails = gTrails.stats();
+	ImGui::Text("Следов: %d, вершин %d, загружено %d за кадр", (int)trails.trails, (int)trails.vertices, (int)trails.uploaded);
+	const OrbitStats& orbits = gOrbits.stats();
+	if (orbits.orbits > 0)
+		ImGui::Text("Орбит по элементам: %d, вершин %d", (int)orbits.orbits, (int)orbits.vertices);
+	//All draws of the frame and the state changes between them
+	const RenderStats& queue = gQueue.stats();
+	ImGui::Text("Вызовов отрисовки: %d, смен: программ %d, VAO %d, текстур %d, состояний %d", (int)queue.draws,
+		(int)queue.programs, (int)queue.vaos, (int)queue.textures, (int)queue.states);
+	ImGui::Separator();
+	ImGui::Columns(4);
+	ImGui::Text("Участок");
+	ImGui::NextColumn();
+	ImGui::Text("Среднее, мс");
+	ImGui::NextColumn();
+	ImGui::Text("p50");
+	ImGui::NextColumn();
+	ImGui::Text("p99");
+	ImGui::NextColumn();
+	int count = profileStats(stats, PROFILE_MAX_SCOPES);
+	for (int i = 0; i < count; i++)
+	{
+		ImGui::Text("%s", stats[i].name);
+		ImGui::NextColumn();
+		ImGui::Text("%.3f", stats[i].mean);
+		ImGui::NextColumn();
+		ImGui::Text("%.3f", stats[i].p50);
+		ImGui::NextColumn();
+		ImGui::Text("%.3f", stats[i].p99);
+		ImGui::NextColumn();
+	}
+	ImGui::Columns(1);
+	drawCounters();
+	drawAllocations();
+	ImGui::Separator();
+	ImGui::SliderInt("Кадров", &traceFrames, 1, PROFILE_HISTORY);
+	ImGui::SameLine();
+	if (ImGui::Button("Экспорт трассировки"))
+	{
+		//Chrome trace-event JSON: chrome://tracing or ui.perfetto.dev
+		if (!profileExportTrace(TRACE_FILE, traceFrames))
+			SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Warning!", "Trace couldn't be written!", gWindow);
+	}
+#if !PROFILE
+	ImGui::Text("Таймеры отключены при сборке (PROFILE=0)");
+#endif
+	ImGui::End();
+}
+
 void close()
 {
-	//glDeleteProgram(gProgramID);
+	perfClose();
+	gFrame.release();
+	gSky.release();
+	gSpheres.release();
+	gParticles.release();
+	gTrails.release();
+	gOrbits.release();
+	deleteTexture();
 	//Destroy window	
 	ImGui_ImplSdlGL3_Shutdown();
 	SDL_DestroyWindow(gWindow);
 	SDL_GL_DeleteContext(gContext);
 	gContext = NULL;
 	gWindow = NULL;
-	deleteTexture();
 	//Quit SDL subsystems
 	IMG_Quit();
 	SDL_Quit();
 }
 
+//Force solver for a scenario: cached for this machine and N bucket, calibrated otherwise
+TuneResult tuneScenario(const State& s, double softening, float forceError, bool retune)
+{
+	TuneSettings settings = DEFAULT_TUNING;
+	settings.errorTarget = forceError;
+	settings.cache = TUNE_FILE;
+	return autotune(s, softening, settings, retune);
+}
+
 void mainLoop()
 {
 	int w, h;
@@ -701,92 +970,168 @@ void mainLoop()
 	bool loopPause = true;
 	bool showOrbits = true;
 	bool showAsteroidOrbits = false;
+	bool analyticOrbits = false;
+	bool predictedOrbits = true;
+	bool fixedPoint = false;
+	State state;
+	FixedIntegrator fixed;
+	CheckpointWriter checkpoints;
+	bool autoCheckpoint = false;
+	int checkpointDays = 365;
+	float lastCheckpoint = day;
+	TrajectorySink trajectory;
+	bool recordTrajectory = false;
+	int trajectoryCodec = CODEC_XOR;
+	float positionError = 1.f;
+	float velocityError = 0.01f;
+	int trajectoryInterval = 1;
+	int stepsSinceOutput = 0;
+	//Scenario state before the step whose force pass measured the conserved quantities
+	State recordedScenario;
+	TrajectoryReader player;
+	bool playback = false;
+	State catalog;
+	char catalogPath[256] = "res/MPCORB.DAT";
+	State scenario;
+	ParticleStyle particleStyle = DEFAULT_PARTICLES;
+	ScenarioSettings scenarioSettings = { 0.0, 86400.0f };
+	int scenarioType = SCENARIO_PLUMMER;
+	int scenarioBodies = 10000;
+	int scenarioSeed = 1;
+	size_t scenarioPulling = 0;
+	TuneResult tuning;
+	bool tuned = false;
+	float forceError = 1e-3f;
+	Conservation conservation;
+	Conservation conservationStart;
+	Conservation recorded;
+	resetConservation(conservation);
+	resetConservation(conservationStart);
+	bool resetReference = true;
 	std::array <Body, 14> bodies =
 	{ {
-		Body(0, "Sun", "Солнце", 
-			glm::vec3(4.321102017786880E5,  7.332029220261886E5, -2.173368199099370E4),
-			glm::vec3(-7.189825590990792E-3, 1.078719625403305E-2, 1.611861005709897E-4),
-			1.98892e30, 1.327124400189e20, 695700 * 0.07, 0.0, 0),
-		Body(1, "Mercury", "Меркурий", 
-			glm::vec3(4.827977920456001E7, -3.593848175336351E7, -7.407821383784354E6),
-			glm::vec3(2.001998825524805E1,  4.093878958529241E1,  1.507185201945884E0),
-			0.33011e24, 2.20329e13, 2439.7, 0.1f, 88),
-		Body(2, "Venus", "Венера", 
-			glm::vec3(3.081230776389965E7, -1.037662195648798E8, -3.208271884613059E6),
-			glm::vec3(3.338454368178189E1,  9.667951253108880E0, -1.794288490452711E0),
-			4.8685e24, 3.248599e14, 6051.8, 177.36f, 224),
-		Body(3, "Earth", "Земля", 
-			glm::vec3(-5.969534792469550E7, -1.384328330091216E8, -1.539442552493513E4),
-			glm::vec3(2.686684747512509E1, -1.191462405401140E1, -1.789306645543220E-4),
-			5.97219e24, 3.9860044189e14, 6378.1, 23.45f, 365),
-		Body(4, "Mars", "Марс", 
-			glm::vec3(-2.457432353017395E7,  2.363419494094334E8,  5.529273093965277E6),
-			glm::vec3(-2.318343075686108E1, -4.864803362557868E-1, 5.585276593733890E-1),
-			6.4185e23, 4.2828372e13, 3396.2, 25.19f, 687),
-		Body(5, "Jupiter", "Юпитер", 
-			glm::vec3(-7.569735834852062E8, -3.021406720368661E8,  1.818386330099623E7),
-			glm::vec3(4.691818986427708E0, -1.151682040045604E1, -5.715174720721627E-2),
-			1898.19e24,           1.266865349e17,       71499, 3.13f, 4332),
-		Body(6, "Saturn", "Сатурн",  
-			glm::vec3(-1.644374719486625E8, -1.494399735641233E9,  3.252789329873234E7),
-			glm::vec3(9.071782458885481E0, -1.088556624490897E0, -3.415607795777443E-1),
-			568.34e24,            3.79311879e16,        60268, 26.73f, 10759),
-		Body(7, "Uranus", "Уран",   
-			glm::vec3(2.708324010627307E9,  1.246406855535664E9, -3.045762012091076E7),
-			glm::vec3(-2.896814088567216E0,  5.868838238458174E0,  5.925130485071195E-2),
-			86.8103e24,           5.7939399e15,         24973, 97.77f, 30685),
-		Body(8, "Neptune", "Нептун",  
-			glm::vec3(4.260892227618985E9, -1.383625744199709E9, -6.970338029718751E7),
-			glm::vec3(1.643322631738114E0,  5.202138396781843E0, -1.453302666708880E-1),
-			102.41e24,            6.8365299e15,         24342, 28.32f, 60189),
-		Body(9, "Pluto", "Плутон",  
-			glm::vec3(1.512995164271581E9, -4.750856430852462E9, 7.072265548052478E7),
-			glm::vec3(5.291385672638518E0, 5.025608122645461E-1, -1.605961044129924E0),
-			0.01303e24,            8.719e11,         2187, 122.53f, 90560),
-		Body(10, "Ceres", "Церера", 
-			glm::vec3(1.171404652999866E8, 3.898786439553194E8, -9.285654429283202E6),
-			glm::vec3(-1.749907309328118E1, 3.939248912132300E0, 3.348447503365496E0),
-			939300e15,            0.626284e11,         469.7 * 15, 4, 1679),
-		Body(11, "Pallas", "Паллада",  
-			glm::vec3(4.291592316654775E8, 4.130737867650583E7, -6.396862972703221E7),
-			glm::vec3(-6.437734248047895E0, 1.322396929216813E1, -8.591155928319642E0),
-			205000e15,            0.143e11,         272.5 * 15, 84, 1683),
-		Body(12, "Juno", "Юнона",  
-			glm::vec3(3.857026210081980E7, -4.565575631972048E+08, 1.022702769186957E8),
-			glm::vec3(1.466155363544588E1, 3.856604107629098E0, -1.468972870833428E0),
-			20000e15,            20000e15*G,         123.298 * 15, 50, 1591),
-		Body(13, "Vesta", "Веста",  
-			glm::vec3(-3.096651822378528E8, 1.773993080224814E8, 3.240229550527219E7),
-			glm::vec3(-7.810311925207990E0, -1.736557473811398E1, 1.470044682760689E0),
-			259000e15,            0.178e11,         262.7 * 15, 29, 1325)
+		Body(SOLAR_SYSTEM[0]),
+		Body(SOLAR_SYSTEM[1]),
+		Body(SOLAR_SYSTEM[2]),
+		Body(SOLAR_SYSTEM[3]),
+		Body(SOLAR_SYSTEM[4]),
+		Body(SOLAR_SYSTEM[5]),
+		Body(SOLAR_SYSTEM[6]),
+		Body(SOLAR_SYSTEM[7]),
+		Body(SOLAR_SYSTEM[8]),
+		Body(SOLAR_SYSTEM[9]),
+		Body(SOLAR_SYSTEM[10]),
+		Body(SOLAR_SYSTEM[11]),
+		Body(SOLAR_SYSTEM[12]),
+		Body(SOLAR_SYSTEM[13])
 	} };
-	/*name ruName px,  py   pz
-	vx   vy   vz
-	mass GM   radius day*/
+	TrailStore trailStore(TRAIL_BUDGET, bodies.size());
+	//Bodies as a state for the orbital elements
+	State orbitState;
+	//Trails before and after the state, computed again whenever the state jumps
+	TrailPredictor predictor(PREDICT_BUDGET, bodies.size());
+	State predictState;
+	bool repredict = true;
 	camera = Camera();
-	for (int i = 0; i < 11; ++i)
+	for (int i = 0; i < BODY_LAYERS && i < (int)bodies.size(); ++i)
 	{
 		initTexture(bodies[i].getName(), i);
 	}
-	initTexture("stars", 11);
+	gBodyTextures.finish();
+	initStarTexture();
+	//Startup ends here
+	profileFrame();
+	allocFrame();
 	//Main loop
+	//The test runs the simulation with the overlay open
+	int frame = 0;
+	if (gAllocTest)
+	{
+		loopPause = false;
+		showProfiler = true;
+	}
 	while (!handleInput())
 	{
-		//Clear buffer, draw the planets, apply lighting, draw skysphere
+		ALLOC_BEGIN(render, "render");
+		//Clear buffer, draw the planets, the sky and the particles
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		lighting();
+		gQueue.begin();
 		if(!loopPause)
 			rotate += 5.f;
-		for (auto& body : bodies)
+		//Playback feeds the bodies from the trajectory file instead of the simulation
+		//Frames recorded without diagnostics are measured once per frame, with the tree for large N
+		if (playback && scenario.size() > 0 && player.read(day, scenario, &recorded))
+		{
+			if (recorded.mass != 0.0)
+				conservation = recorded;
+			else if (conservation.day != scenario.day)
+				measureConservation(scenario, scenarioSettings.softening, conservation);
+		}
+		else if (playback && player.read(day, state, &recorded))
 		{
-			body.draw(rotate);
-			body.drawOrbit(day, showOrbits, showAsteroidOrbits);
+			fromState(state, bodies.data(), bodies.size());
+			if (recorded.mass != 0.0)
+				conservation = recorded;
+			else if (conservation.day != state.day)
+				measureConservation(state, 0.0, conservation);
 		}
+		//One camera for every draw of the frame
 		if (camera.camFollow)
 			bodies[currBody].setCam();
-
-		drawStars();
+		gFrame.update(camera.view(), gProjection, (float)w, (float)h);
+		//The state jumped, at startup too: the trails start over from it
+		if (repredict && scenario.size() == 0)
+		{
+			predictTrails(predictor, trailStore, bodies.data(), bodies.size(), predictState, (int64_t)day);
+			repredict = false;
+		}
+		//A generated scenario replaces the Solar System
+		if (scenario.size() == 0)
+		{
+			PERF_SCOPE("render prep");
+			//Trails published since the last frame; while a chunk is being published the
+			//frame draws the ones it has
+			if (predictor.tryLock())
+			{
+				for (auto& body : bodies)
+					body.updatePrediction(predictor, gTrails);
+				predictor.unlock();
+			}
+			gSpheres.begin();
+			gTrails.begin();
+			gOrbits.begin();
+			//Orbits around the Sun from the state after the last step
+			if (analyticOrbits)
+			{
+				toState(bodies.data(), bodies.size(), orbitState);
+				gOrbits.update(orbitState, 0, scale);
+			}
+			for (auto& body : bodies)
+			{
+				body.draw(gSpheres, rotate);
+				body.drawOrbit(trailStore, gTrails, gOrbits, predictedOrbits ? &predictor : NULL, (int64_t)day,
+					analyticOrbits, showOrbits, showAsteroidOrbits);
+			}
+			gSpheres.draw(gFrame.data(), gBodyTextures.texture(), gQueue);
+			gTrails.draw(gQueue);
+			gOrbits.draw(gQueue);
+		}
+		gSky.draw(gStarTexture, gQueue);
+		{
+			PERF_SCOPE("render prep");
+			gParticles.begin();
+			if (scenario.size() > 0)
+				gParticles.draw(scenario, scale, particleStyle, gQueue);
+			if (catalog.size() > 0)
+				gParticles.draw(catalog, scale, particleStyle, gQueue);
+		}
+		//Everything queued is drawn here, in pass order: the sky behind the bodies, the
+		//sprites that don't write depth after it
+		gQueue.submit();
+		ALLOC_END(render);
 		//UI
+		PROFILE_BEGIN(ui, "ImGui");
+		ALLOC_BEGIN(ui, "ui");
 		ImGui_ImplSdlGL3_NewFrame(gWindow);
 		ImGui::PushStyleVar(ImGuiStyleVar_FrameRounding, 0.0f);
 		//First frame
@@ -816,10 +1161,10 @@ void mainLoop()
 		ImGui::End();
 		//!First frame
 		//Second frame
-		ImGui::SetNextWindowSize(ImVec2(300, 250));
+		ImGui::SetNextWindowSize(ImVec2(300, 280));
 		ImGui::SetNextWindowPos(ImVec2(0, 0));
 		ImGui::Begin("help", &showWindow, ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoResize | ImGuiWindowFlags_NoTitleBar);
-		ImGui::TextWrapped(" 1-9 - выбор тела и просмотр его характеристик. Так же возможно использование панели выбора\n C - закрепить камеру на выбранном теле\n ALT - показать курсор\n Space - сбросить камеру\n ESC - выход\n Пуск/Пауза - запуск и приостановка симуляции");
+		ImGui::TextWrapped(" 1-9 - выбор тела и просмотр его характеристик. Так же возможно использование панели выбора\n C - закрепить камеру на выбранном теле\n ALT - показать курсор\n Space - сбросить камеру\n F3 - профилировщик\n ESC - выход\n Пуск/Пауза - запуск и приостановка симуляции");
 		ImGui::Separator();
 		ImGui::SliderFloat("Секунд в шаг", &step, 1.f, 86400.0f);
 		ImGui::Text("84000 сек = 1 день");
@@ -838,6 +1183,239 @@ void mainLoop()
 		ImGui::Checkbox("Планеты", &showOrbits);
 		ImGui::SameLine();
 		ImGui::Checkbox("Астероиды", &showAsteroidOrbits);
+		ImGui::SameLine();
+		ImGui::Checkbox("Эллипсы", &analyticOrbits);
+		ImGui::Checkbox("Прошлое и прогноз", &predictedOrbits);
+		if (predictor.progress() < 1.f)
+		{
+			ImGui::SameLine();
+			ImGui::Text("%.0f%%", predictor.progress() * 100.f);
+		}
+		ImGui::Text("Память следов: %.1f KB", trailStore.bytes() / 1024.0);
+		if (ImGui::Checkbox("Фиксированная точка", &fixedPoint) && fixedPoint)
+		{
+			toState(bodies.data(), bodies.size(), state);
+			fixed.load(state);
+			resetReference = true;
+		}
+		if (ImGui::CollapsingHeader("Контрольная точка"))
+		{
+			if (ImGui::Button("Сохранить"))
+				lastCheckpoint = -1.f;
+			ImGui::SameLine();
+			if (ImGui::Button("Загрузить"))
+			{
+				bool hasFixed = false;
+				State loaded;
+				FixedIntegrator loadedFixed;
+				bool loadedOk = readCheckpoint(CHECKPOINT_FILE, loaded, loadedFixed, hasFixed);
+				bool generated = loaded.generated;
+				//A recording or playback keeps its bodies
+				bool keepBodies = recordTrajectory || playback;
+				size_t current = scenario.size() > 0 ? scenario.size() : bodies.size();
+				if (!loadedOk)
+				{
+					SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Warning!", "Checkpoint couldn't be loaded!", gWindow);
+				}
+				else if ((!generated && loaded.size() != bodies.size())
+					|| (keepBodies && (loaded.size() != current || generated != (scenario.size() > 0))))
+				{
+					SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Warning!", "Checkpoint doesn't match the scenario!", gWindow);
+				}
+				else if (generated)
+				{
+					//A generated scenario replaces the running one, the solver is tuned again on the next step
+					scenario = std::move(loaded);
+					scenarioSettings.softening = scenario.softening;
+					scenarioSettings.step = scenario.step;
+					scenarioPulling = std::count_if(scenario.gm.begin(), scenario.gm.end(), [](double gm) { return gm != 0.0; });
+					tuned = false;
+					day = (float)scenario.day;
+					step = scenario.step;
+					resetReference = true;
+					lastCheckpoint = day;
+				}
+				else
+				{
+					scenario = State();
+					state = loaded;
+					fixed = loadedFixed;
+					fromState(state, bodies.data(), bodies.size());
+					day = (float)state.day;
+					step = state.step;
+					fixedPoint = hasFixed;
+					resetReference = true;
+					lastCheckpoint = day;
+					repredict = true;
+				}
+			}
+			ImGui::Checkbox("Автосохранение", &autoCheckpoint);
+			ImGui::SliderInt("Дней", &checkpointDays, 1, 3650);
+			if (checkpoints.busy())
+				ImGui::Text("Запись...");
+			else if (!checkpoints.lastOk())
+				ImGui::Text("Ошибка записи");
+		}
+		if (ImGui::CollapsingHeader("Траектории"))
+		{
+			if (ImGui::Checkbox("Запись", &recordTrajectory))
+			{
+				if (recordTrajectory && playback)
+				{
+					recordTrajectory = false;
+				}
+				else if (recordTrajectory)
+				{
+					trajectory.setErrorBounds(positionError * 1000.0, velocityError);
+					recordTrajectory = trajectory.open(TRAJECTORY_FILE, scenario.size() > 0 ? scenario.size() : bodies.size(), (Codec)trajectoryCodec);
+					if (!recordTrajectory)
+						SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Warning!", "Trajectory file couldn't be created!", gWindow);
+					stepsSinceOutput = 0;
+				}
+				else
+				{
+					trajectory.close();
+				}
+			}
+			if (!recordTrajectory)
+			{
+				ImGui::Combo("Сжатие", &trajectoryCodec, "Нет\0Без потерь\0С потерями\0\0");
+				if (trajectoryCodec == CODEC_QUANT)
+				{
+					ImGui::SliderFloat("Точность, км", &positionError, 0.001f, 1000.f, "%.3f", 3.f);
+					ImGui::SliderFloat("Точность, м/с", &velocityError, 0.0001f, 10.f, "%.4f", 3.f);
+				}
+			}
+			ImGui::SliderInt("Шагов на кадр", &trajectoryInterval, 1, 100);
+			ImGui::Text("Записано: %llu кадров, %.1f MB", (unsigned long long)trajectory.written(), trajectory.bytes() / 1048576.0);
+			ImGui::Text("Очередь: %d / %d", (int)trajectory.queued(), (int)trajectory.capacity());
+			if (trajectory.dropped() > 0)
+				ImGui::TextColored(ImVec4(1.f, 0.3f, 0.3f, 1.f), "Пропущено: %llu, диск не успевает", (unsigned long long)trajectory.dropped());
+			if (trajectory.failed())
+				ImGui::TextColored(ImVec4(1.f, 0.3f, 0.3f, 1.f), "Ошибка записи");
+		}
+		if (ImGui::CollapsingHeader("Каталог"))
+		{
+			ImGui::InputText("Файл", catalogPath, sizeof(catalogPath));
+			if (ImGui::Button("Загрузить каталог"))
+			{
+				//Orbital elements are heliocentric, the scene is barycentric
+				glm::vec3 sunP = bodies[0].getP();
+				glm::vec3 sunV = bodies[0].getV();
+				double sun[6] = { sunP.x, sunP.y, sunP.z, sunV.x, sunV.y, sunV.z };
+				if (!loadCatalog(catalogPath, catalog, sun))
+					SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Warning!", "Catalog couldn't be loaded!", gWindow);
+			}
+			ImGui::SameLine();
+			if (ImGui::Button("Очистить"))
+				catalog = State();
+			ImGui::Text("Тел в каталоге: %d", (int)catalog.size());
+		}
+		if (ImGui::CollapsingHeader("Сценарий"))
+		{
+			const char* names[SCENARIO_COUNT];
+			for (int i = 0; i < SCENARIO_COUNT; i++)
+				names[i] = scenarioName((ScenarioType)i);
+			ImGui::Combo("Тип", &scenarioType, names, SCENARIO_COUNT);
+			ImGui::InputInt("Тел", &scenarioBodies, 1000, 100000);
+			scenarioBodies = std::max(scenarioBodies, 2);
+			ImGui::InputInt("Зерно", &scenarioSeed);
+			if (!recordTrajectory && !playback)
+			{
+				if (ImGui::Button("Создать"))
+				{
+					scenarioSettings = generateScenario((ScenarioType)scenarioType, scenarioBodies, (uint64_t)scenarioSeed, scenario);
+					scenarioPulling = std::count_if(scenario.gm.begin(), scenario.gm.end(), [](double gm) { return gm != 0.0; });
+					tuning = tuneScenario(scenario, scenarioSettings.softening, forceError, false);
+					tuned = true;
+					step = scenarioSettings.step;
+					day = 1.f;
+					loopPause = true;
+					resetReference = true;
+				}
+				ImGui::SameLine();
+				if (ImGui::Button("Солнечная система"))
+				{
+					scenario = State();
+					resetReference = true;
+				}
+			}
+			if (scenario.size() > 0)
+				ImGui::Text("Тел: %d, сглаживание %.2f а.е.", (int)scenario.size(), scenarioSettings.softening / AU_M);
+			if (ImGui::SliderFloat("Допуск силы", &forceError, 1e-6f, 1e-1f, "%.0e", 4.f))
+				tuned = false;
+			if (scenario.size() > 0 && tuned)
+			{
+				ImGui::Text("Решатель: %s, потоков %u", solverName(tuning.config.solver), tuning.config.threads);
+				if (tuning.config.solver == SOLVER_TILED)
+					ImGui::Text("Блок: %u тел", tuning.config.tile);
+				else if (tuning.config.solver == SOLVER_TREE)
+					ImGui::Text("Угол раскрытия: %.2f", tuning.config.theta);
+				ImGui::Text("Ошибка силы %.1e, расчёт ~%.1f мс%s", tuning.error, tuning.seconds * 1000.0, tuning.cached ? " (кэш)" : "");
+				if (ImGui::Button("Подобрать заново"))
+					tuning = tuneScenario(scenario, scenarioSettings.softening, forceError, true);
+			}
+		}
+		if (ImGui::CollapsingHeader("Частицы"))
+		{
+			const char* modes[PARTICLE_MODE_COUNT];
+			for (int i = 0; i < PARTICLE_MODE_COUNT; i++)
+				modes[i] = particleModeName((ParticleMode)i);
+			ImGui::Combo("Вид", &particleStyle.mode, modes, PARTICLE_MODE_COUNT);
+			ImGui::SliderFloat("Радиус", &particleStyle.radius, 0.01f, 5.f, "%.2f", 3.f);
+			if (particleStyle.mode == PARTICLE_SPRITES)
+				ImGui::SliderFloat("Яркость", &particleStyle.intensity, 0.01f, 1.f, "%.2f", 2.f);
+			ImGui::ColorEdit3("Цвет", particleStyle.color);
+		}
+		if (ImGui::CollapsingHeader("Интегралы движения"))
+		{
+			ConservationError error = conservationError(conservation, conservationStart);
+			ImGui::Text("Энергия: %.3e", error.energy);
+			ImGui::Text("Импульс: %.3e", error.momentum);
+			ImGui::Text("Момент импульса: %.3e", error.angular);
+			ImGui::Text("Дрейф центра масс: %.3e а.е.", error.drift / AU_M);
+			if (ImGui::Button("Сбросить"))
+				resetReference = true;
+		}
+		if (ImGui::CollapsingHeader("Воспроизведение"))
+		{
+			if (ImGui::Checkbox("Из файла траекторий", &playback))
+			{
+				if (playback)
+				{
+					if (recordTrajectory || !player.open(TRAJECTORY_FILE))
+					{
+						SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Warning!", "Trajectory file couldn't be opened!", gWindow);
+						playback = false;
+					}
+					else if (player.bodies() != (scenario.size() > 0 ? scenario.size() : bodies.size()))
+					{
+						SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Warning!", "Trajectory doesn't match the scenario!", gWindow);
+						player.close();
+						playback = false;
+					}
+					else
+					{
+						//Masses for the diagnostics of frames recorded without them
+						toState(bodies.data(), bodies.size(), state);
+						day = (float)std::max(player.firstDay(), 1.0);
+						loopPause = true;
+						resetReference = true;
+						repredict = true;
+					}
+				}
+				else
+				{
+					player.close();
+					resetReference = true;
+				}
+			}
+			if (playback)
+			{
+				if (ImGui::SliderFloat("День", &day, (float)std::max(player.firstDay(), 1.0), (float)player.lastDay()))
+					repredict = true;
+			}
+		}
 		ImGui::End();
 		//!Second frame
 		//Third frame
@@ -847,39 +1425,200 @@ void mainLoop()
 		bodies[currBody].print();
 		ImGui::End();
 		//!Third frame
+		if (showProfiler)
+			drawProfiler();
 		ImGui::PopStyleVar(1);
 		//Render UI
 		ImGui::Render();
+		ALLOC_END(ui);
+		PROFILE_END(ui);
 		//Swap buffers
-		SDL_GL_SwapWindow(gWindow);
+		{
+			PROFILE_SCOPE("SwapWindow");
+			SDL_GL_SwapWindow(gWindow);
+		}
 		//n-body simulation
-		if (!loopPause)
+		PROFILE_BEGIN(physics, "Physics");
+		ALLOC_BEGIN(physics, "physics");
+		if (!loopPause && playback)
+		{
+			day += step / 86400.0f;
+			if (day >= player.lastDay())
+			{
+				day = (float)player.lastDay();
+				loopPause = true;
+			}
+		}
+		else if (!loopPause && scenario.size() > 0)
+		{
+			//Tuned again when N leaves the bucket the solver was chosen for
+			if (!tuned || needsRetune(tuning, scenario.size(), scenarioPulling))
+			{
+				tuning = tuneScenario(scenario, scenarioSettings.softening, forceError, false);
+				tuned = true;
+			}
+			PROFILE_SCOPE("stepState");
+			scenario.day = day;
+			//The conserved quantities are those of the state before the step, so that state is recorded
+			if (recordTrajectory && stepsSinceOutput + 1 >= trajectoryInterval)
+				recordedScenario = scenario;
+			stepState(scenario, step, scenarioSettings.softening, tuning.config, &conservation);
+			profileSteps(1, (double)scenario.size() * scenarioPulling);
+			day += step / 86400.0f;
+		}
+		else if (!loopPause && fixedPoint)
+		{
+			PROFILE_SCOPE("FixedIntegrator::step");
+			fixed.step(step);
+			profileSteps(1, (double)fixed.size() * (fixed.size() - 1));
+			fixed.store(state);
+			fromState(state, bodies.data(), bodies.size());
+			day += std::llround(step) / 86400.0f;
+		}
+		else if (!loopPause)
 		{
-			for (auto& body : bodies)
 			{
-				body.resetG();
-				for (auto& other : bodies)
+				PERF_SCOPE("force");
+				for (auto& body : bodies)
 				{
-					if (body.getName().compare(other.getName()))
+					body.resetG();
+					for (auto& other : bodies)
 					{
-						body.addG(other);
+						if (&body != &other)
+						{
+							body.addG(other);
+						}
 					}
 				}
 			}
-			for (auto& body : bodies)
 			{
-				body.update();
+				PERF_SCOPE("integrate");
+				for (auto& body : bodies)
+				{
+					body.update();
+				}
 			}
+			profileSteps(1, (double)bodies.size() * (bodies.size() - 1));
 			day += step / 86400.0f;
 		}
+		//Trails follow the simulation steps, or the frames of a playback
+		if (scenario.size() == 0 && (!loopPause || playback))
+		{
+			PROFILE_SCOPE("TrailStore::sample");
+			for (auto& body : bodies)
+				body.sampleOrbit(trailStore, (int64_t)day);
+		}
+		//Conserved quantities, the scenario gets them from its force pass
+		if (!loopPause && !playback && scenario.size() == 0)
+		{
+			PROFILE_SCOPE("Diagnostics");
+			if (!fixedPoint)
+				toState(bodies.data(), bodies.size(), state);
+			state.day = day;
+			measureConservation(state, 0.0, conservation);
+		}
+		if (resetReference && conservation.mass != 0.0)
+		{
+			conservationStart = conservation;
+			resetReference = false;
+		}
+		//Catalog bodies move in the field of the planets
+		if (!loopPause && !playback && scenario.size() == 0 && catalog.size() > 0)
+		{
+			PROFILE_SCOPE("stepParticles");
+			if (!fixedPoint)
+				toState(bodies.data(), bodies.size(), state);
+			stepParticles(catalog, state, step);
+			profileSteps(0, (double)catalog.size() * bodies.size());
+		}
+		//Trajectory output, only a copy into the queue happens here
+		if (!loopPause && !playback && recordTrajectory && ++stepsSinceOutput >= trajectoryInterval)
+		{
+			PROFILE_SCOPE("TrajectorySink::push");
+			stepsSinceOutput = 0;
+			if (scenario.size() > 0)
+			{
+				trajectory.push(recordedScenario, &conservation);
+			}
+			else
+			{
+				if (!fixedPoint)
+					toState(bodies.data(), bodies.size(), state);
+				state.day = day;
+				trajectory.push(state, &conservation);
+			}
+		}
+		ALLOC_END(physics);
+		PROFILE_END(physics);
 		//!n-body simulation
+		//Checkpoint, the copy is taken here and written on the background thread
+		if (lastCheckpoint < 0.f || (autoCheckpoint && day - lastCheckpoint >= checkpointDays))
+		{
+			ALLOC_SCOPE("checkpoint");
+			//A generated scenario is saved instead of the Solar System hidden behind it
+			if (scenario.size() > 0)
+			{
+				scenario.day = day;
+				scenario.step = step;
+				if (checkpoints.save(CHECKPOINT_FILE, scenario, NULL))
+					lastCheckpoint = day;
+			}
+			else
+			{
+				if (!fixedPoint)
+					toState(bodies.data(), bodies.size(), state);
+				state.day = day;
+				state.step = step;
+				if (checkpoints.save(CHECKPOINT_FILE, state, fixedPoint ? &fixed : NULL))
+					lastCheckpoint = day;
+			}
+		}
 		SDL_Delay(10);
+		profileFrame();
+		allocFrame();
+		if (gAllocTest)
+		{
+			frame++;
+			if (frame == ALLOC_WARMUP_FRAMES)
+				allocSteadyState();
+			else if (frame == ALLOC_WARMUP_FRAMES + ALLOC_TEST_FRAMES)
+				break;
+		}
 	}
 	//!Main loop
 }
 
+//Result of the allocation test, printed per subsystem; true if the steady state allocated nothing
+bool allocTestPassed()
+{
+#if ALLOC_TRACKING
+	AllocStats stats[ALLOC_MAX_SUBSYSTEMS];
+	int count = allocStats(stats, ALLOC_MAX_SUBSYSTEMS);
+	bool passed = true;
+	for (int i = 0; i < count; i++)
+	{
+		if (stats[i].steadyAllocations == 0)
+			continue;
+		fprintf(stderr, "%s: %llu allocations, %llu bytes after warm-up\n", stats[i].name,
+			(unsigned long long)stats[i].steadyAllocations, (unsigned long long)stats[i].steadyBytes);
+		passed = false;
+	}
+	fprintf(stderr, "Allocation test %s: %d frames after %d frames of warm-up\n", passed ? "passed" : "FAILED", ALLOC_TEST_FRAMES, ALLOC_WARMUP_FRAMES);
+	return passed;
+#else
+	fprintf(stderr, "Allocation test needs ALLOC_TRACKING=1\n");
+	return false;
+#endif
+}
+
 int main(int argc, char* args[])
 {
+	profileThreadName("main");
+	for (int i = 1; i < argc; i++)
+		if (!strcmp(args[i], "--alloc-test"))
+			gAllocTest = true;
+	//Before the first parallelFor, the pool workers open their own counters as they start
+	perfOpen();
 	//Init SDL and OpenGL
 	if (init())
 	{
@@ -888,5 +1627,7 @@ int main(int argc, char* args[])
 	}
 	//Close the program
 	close();
+	if (gAllocTest)
+		return allocTestPassed() ? 0 : 1;
 	return 0;
 }
\ No newline at end of file
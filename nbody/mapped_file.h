@@ -0,0 +1,37 @@
+#pragma once
+#include <string>
+#include <cstddef>
+
+//Read-only memory-mapped file
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+	//Map the whole file, returns false if it can't be opened or is empty
+	bool open(const std::string& path);
+	//Unmap and close
+	void close();
+	//Mapped bytes
+	const unsigned char* data() const
+	{
+		return bytes;
+	}
+	//Size in bytes
+	size_t size() const
+	{
+		return length;
+	}
+
+private:
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	const unsigned char* bytes;
+	size_t length;
+#ifdef _WIN32
+	void* file;
+	void* mapping;
+#else
+	int fd;
+#endif
+};
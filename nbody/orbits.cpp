@@ -0,0 +1,218 @@
+#include <cmath>
+#include <algorithm>
+#include "orbits.h"
+#include "shader.h"
+#include "frame.h"
+#include "profiler.h"
+#include "parallel.h"
+
+namespace
+{
+	const size_t STRIDE = ORBIT_ELEMENTS * sizeof(float);
+	//Fewer bodies, such as the planets of the Solar System, are not worth waking the pool
+	const size_t PARALLEL_ORBITS = 4096;
+
+	const char* ORBIT_VERTEX_SHADER =
+		"#version 330\n"
+		"layout(location = 0) in vec3 Shape;\n"
+		"layout(location = 1) in vec3 Orientation;\n"
+		FRAME_BLOCK
+		"uniform vec3 Focus;\n"
+		"uniform int Segments;\n"
+		"void main()\n"
+		"{\n"
+		"	float a = Shape.x;\n"
+		"	float e = Shape.y;\n"
+		"	float ci = cos(Shape.z), si = sin(Shape.z);\n"
+		"	float cn = cos(Orientation.x), sn = sin(Orientation.x);\n"
+		"	float cw = cos(Orientation.y), sw = sin(Orientation.y);\n"
+		//Towards the periapsis and 90 degrees ahead of it in the orbit plane
+		"	vec3 P = vec3(cw * cn - sw * ci * sn, cw * sn + sw * ci * cn, sw * si);\n"
+		"	vec3 Q = vec3(-sw * cn - cw * ci * sn, -sw * sn + cw * ci * cn, cw * si);\n"
+		//Backwards from the body, the last vertex closes the orbit
+		"	float E = Orientation.z - 6.28318531 * float(gl_VertexID) / float(Segments);\n"
+		"	vec2 xy = a * vec2(cos(E) - e, sqrt(max(1.0 - e * e, 0.0)) * sin(E));\n"
+		"	vec3 position = Focus + xy.x * P + xy.y * Q;\n"
+		"	gl_Position = Projection * View * vec4(position, 1.0);\n"
+		"}\n";
+
+	const char* ORBIT_FRAGMENT_SHADER =
+		"#version 330\n"
+		"uniform vec4 Color;\n"
+		"out vec4 Out_Color;\n"
+		"void main()\n"
+		"{\n"
+		"	Out_Color = Color;\n"
+		"}\n";
+}
+
+void stateToElements(const State& s, size_t central, float scale, float* out)
+{
+	size_t n = s.size();
+	if (central >= n)
+		return;
+	const double cx = s.px[central], cy = s.py[central], cz = s.pz[central];
+	const double cvx = s.vx[central], cvy = s.vy[central], cvz = s.vz[central];
+	const double cgm = s.gm[central];
+	//Every body takes the same path: the elements are computed whatever the orbit and the
+	//central body or an open orbit, whose values may be infinite or NaN, is zeroed by selects
+	parallelFor(n, n < PARALLEL_ORBITS ? 1 : 0, [&](size_t begin, size_t end)
+	{
+		for (size_t k = begin; k < end; k++)
+		{
+			double x = s.px[k] - cx, y = s.py[k] - cy, z = s.pz[k] - cz;
+			double u = s.vx[k] - cvx, v = s.vy[k] - cvy, w = s.vz[k] - cvz;
+			double mu = cgm + s.gm[k];
+			double r = std::sqrt(x * x + y * y + z * z);
+			double speed2 = u * u + v * v + w * w;
+			//Angular momentum and eccentricity vector
+			double hx = y * w - z * v, hy = z * u - x * w, hz = x * v - y * u;
+			double h = std::sqrt(hx * hx + hy * hy + hz * hz);
+			double radial = x * u + y * v + z * w;
+			double ex = ((speed2 - mu / r) * x - radial * u) / mu;
+			double ey = ((speed2 - mu / r) * y - radial * v) / mu;
+			double ez = ((speed2 - mu / r) * z - radial * w) / mu;
+			double e = std::sqrt(ex * ex + ey * ey + ez * ez);
+			double energy = 0.5 * speed2 - mu / r;
+			bool closed = k != central && r > 0.0 && h > 0.0 && energy < 0.0 && e < 1.0;
+			double a = -0.5 * mu / energy;
+			double incl = std::acos(std::min(std::max(hz / h, -1.0), 1.0));
+			//An equatorial orbit has no node line, any direction in the plane does
+			double node = std::atan2(hx, -hy);
+			node = closed ? node : 0.0;
+			double cn = std::cos(node), sn = std::sin(node);
+			//Node direction and the one 90 degrees ahead of it in the plane
+			double nx = cn, ny = sn;
+			double mx = -hz * sn / h;
+			double my = hz * cn / h;
+			double mz = (hx * sn - hy * cn) / h;
+			//A circular orbit has no periapsis, the node line stands in for it
+			double peri = std::atan2(ex * mx + ey * my + ez * mz, ex * nx + ey * ny);
+			peri = closed && e > 1e-12 ? peri : 0.0;
+			//The anomaly from the position in the perifocal frame, so the orbit passes exactly
+			//through the body however badly a nearly circular one fixes the periapsis
+			double cw = std::cos(peri), sw = std::sin(peri);
+			double along = x * (cw * nx + sw * mx) + y * (cw * ny + sw * my) + z * (sw * mz);
+			double across = x * (cw * mx - sw * nx) + y * (cw * my - sw * ny) + z * (cw * mz);
+			double root = std::sqrt(std::max(1.0 - e * e, 0.0));
+			double anomaly = std::atan2(across / root, along + a * e);
+			float* o = out + ORBIT_ELEMENTS * k;
+			o[0] = (float)(closed ? a * scale : 0.0);
+			o[1] = (float)(closed ? e : 0.0);
+			o[2] = (float)(closed ? incl : 0.0);
+			o[3] = (float)node;
+			o[4] = (float)peri;
+			o[5] = (float)(closed ? anomaly : 0.0);
+		}
+	});
+}
+
+OrbitRenderer::OrbitRenderer()
+	: program(0)
+	, focusLocation(-1)
+	, vao(0)
+	, buffer(0)
+	, allocated(0)
+{
+	focus[0] = focus[1] = focus[2] = 0.f;
+	last.orbits = last.vertices = last.draws = 0;
+}
+
+bool OrbitRenderer::init()
+{
+	program = compileProgram("OrbitRenderer", ORBIT_VERTEX_SHADER, ORBIT_FRAGMENT_SHADER);
+	if (!program)
+		return false;
+	focusLocation = glGetUniformLocation(program, "Focus");
+	glUseProgram(program);
+	glUniform4f(glGetUniformLocation(program, "Color"), 1.f, 1.f, 1.f, 1.f);
+	glUniform1i(glGetUniformLocation(program, "Segments"), ORBIT_SEGMENTS);
+	glUseProgram(0);
+	glGenVertexArrays(1, &vao);
+	glGenBuffers(1, &buffer);
+	//One set of elements per instance, the vertex index walks along the orbit
+	glBindVertexArray(vao);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, (GLsizei)STRIDE, (const GLvoid*)0);
+	glVertexAttribDivisor(0, 1);
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, (GLsizei)STRIDE, (const GLvoid*)(3 * sizeof(float)));
+	glVertexAttribDivisor(1, 1);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	return glGetError() == GL_NO_ERROR;
+}
+
+void OrbitRenderer::release()
+{
+	if (program)
+		glDeleteProgram(program);
+	if (vao)
+		glDeleteVertexArrays(1, &vao);
+	if (buffer)
+		glDeleteBuffers(1, &buffer);
+	program = vao = buffer = 0;
+	allocated = 0;
+	elements.clear();
+	queued.clear();
+}
+
+void OrbitRenderer::update(const State& s, size_t central, float scale)
+{
+	PROFILE_SCOPE("OrbitRenderer::update");
+	elements.resize(ORBIT_ELEMENTS * s.size());
+	if (central >= s.size())
+	{
+		std::fill(elements.begin(), elements.end(), 0.f);
+		return;
+	}
+	stateToElements(s, central, scale, elements.data());
+	focus[0] = (float)(s.px[central] * scale);
+	focus[1] = (float)(s.py[central] * scale);
+	focus[2] = (float)(s.pz[central] * scale);
+}
+
+bool OrbitRenderer::bound(size_t body) const
+{
+	return ORBIT_ELEMENTS * body < elements.size() && elements[ORBIT_ELEMENTS * body] > 0.f;
+}
+
+void OrbitRenderer::begin()
+{
+	queued.clear();
+}
+
+void OrbitRenderer::queue(size_t body)
+{
+	if (bound(body))
+		queued.insert(queued.end(), elements.begin() + ORBIT_ELEMENTS * body, elements.begin() + ORBIT_ELEMENTS * (body + 1));
+}
+
+void OrbitRenderer::draw(RenderQueue& queue)
+{
+	PROFILE_SCOPE("OrbitRenderer::draw");
+	size_t count = queued.size() / ORBIT_ELEMENTS;
+	last.orbits = count;
+	last.vertices = count * (ORBIT_SEGMENTS + 1);
+	last.draws = 0;
+	if (!program || count == 0)
+		return;
+
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	if (count > allocated)
+		allocated = std::max(count, 2 * allocated);
+	//Fresh storage, the last frame may still draw from the old one
+	glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)(allocated * STRIDE), NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, (GLsizeiptr)(count * STRIDE), queued.data());
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glUseProgram(program);
+	glUniform3fv(focusLocation, 1, focus);
+	glUseProgram(0);
+	DrawItem item(RENDER_OPAQUE, program, vao, 0, 0, GL_LINE_STRIP);
+	item.count = ORBIT_SEGMENTS + 1;
+	item.instances = (GLsizei)count;
+	queue.add(item);
+	last.draws = 1;
+}
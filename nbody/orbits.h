@@ -0,0 +1,67 @@
+#pragma once
+#include <vector>
+#include <cstddef>
+#include <glew.h>
+#include "state.h"
+#include "render.h"
+
+//Osculating Keplerian orbits drawn without sampled trails. The elements of every body
+//around a central one follow from its position and velocity; each orbit is uploaded as
+//ORBIT_ELEMENTS floats and the vertex shader places the vertices of a closed line strip
+//along the ellipse from the vertex index. The whole orbit shows from the first frame and
+//takes the same memory for a body of any period. All queued orbits are one instanced draw.
+
+//Floats per orbit: semi-major axis in render units, eccentricity, inclination, longitude of
+//the ascending node, argument of periapsis, eccentric anomaly of the body
+const int ORBIT_ELEMENTS = 6;
+//Segments of one orbit, the strip starts and ends at the body
+const int ORBIT_SEGMENTS = 256;
+
+//Elements of the bodies of s around body central, gravitational parameters of both summed,
+//ORBIT_ELEMENTS floats per body into out. The central body and bodies on open orbits get a
+//zero semi-major axis
+void stateToElements(const State& s, size_t central, float scale, float* out);
+
+//Last frame of the renderer
+struct OrbitStats
+{
+	size_t orbits;
+	size_t vertices;
+	size_t draws;
+};
+
+class OrbitRenderer
+{
+public:
+	OrbitRenderer();
+	//Needs a current GL 3.3 context
+	bool init();
+	void release();
+	//Elements of all bodies of s around body central, after the steps of a frame
+	void update(const State& s, size_t central, float scale);
+	//Whether a body had a closed orbit at the last update
+	bool bound(size_t body) const;
+	//Start collecting the orbits of a frame
+	void begin();
+	void queue(size_t body);
+	//Upload the orbits of the frame and queue them as one item
+	void draw(RenderQueue& queue);
+	const OrbitStats& stats() const
+	{
+		return last;
+	}
+
+private:
+	GLuint program;
+	GLint focusLocation;
+	GLuint vao;
+	GLuint buffer;
+	//Orbits the buffer holds
+	size_t allocated;
+	//Central body in render units
+	float focus[3];
+	std::vector<float> elements;
+	//Elements of the queued orbits, back to back
+	std::vector<float> queued;
+	OrbitStats last;
+};
@@ -0,0 +1,116 @@
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include "parallel.h"
+#include "counters.h"
+
+namespace
+{
+	//Set while the thread runs a block of a pool loop, a loop nested in it must not take the
+	//owner mutex again (block 0 runs on the thread that holds it)
+	thread_local bool inPool = false;
+
+	//Workers sleep between loops; a loop is published by bumping the generation
+	struct Pool
+	{
+		//Held by the caller whose loop runs on the pool
+		std::mutex owner;
+		std::mutex lock;
+		std::condition_variable wake;
+		std::condition_variable done;
+		std::vector<std::thread> workers;
+		uint64_t generation;
+		bool quit;
+		//The published loop
+		void (*call)(void*, size_t, size_t);
+		void* fn;
+		size_t n;
+		size_t chunk;
+		unsigned int blocks;
+		unsigned int remaining;
+
+		Pool()
+			: generation(0)
+			, quit(false)
+			, call(NULL)
+			, fn(NULL)
+			, n(0)
+			, chunk(0)
+			, blocks(0)
+			, remaining(0)
+		{
+		}
+
+		~Pool()
+		{
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				quit = true;
+			}
+			wake.notify_all();
+			for (auto& w : workers)
+				w.join();
+		}
+
+		//Worker index runs block index of every loop that has that many blocks
+		void run(unsigned int index)
+		{
+			perfThreadStart();
+			uint64_t seen = 0;
+			std::unique_lock<std::mutex> guard(lock);
+			while (true)
+			{
+				wake.wait(guard, [&] { return quit || generation != seen; });
+				if (quit)
+					return;
+				seen = generation;
+				if (index >= blocks)
+					continue;
+				size_t begin = index * chunk;
+				size_t end = begin + chunk < n ? begin + chunk : n;
+				guard.unlock();
+				if (begin < end)
+				{
+					inPool = true;
+					call(fn, begin, end);
+					inPool = false;
+				}
+				guard.lock();
+				if (--remaining == 0)
+					done.notify_one();
+			}
+		}
+	};
+
+	Pool pool;
+}
+
+bool parallelRun(unsigned int t, size_t n, void (*call)(void*, size_t, size_t), void* fn)
+{
+	if (inPool)
+		return false;
+	std::unique_lock<std::mutex> owner(pool.owner, std::try_to_lock);
+	if (!owner)
+		return false;
+	size_t chunk = (n + t - 1) / t;
+	{
+		std::lock_guard<std::mutex> guard(pool.lock);
+		//Grows once to the widest loop, after that nothing is allocated
+		while (pool.workers.size() + 1 < t)
+			pool.workers.emplace_back(&Pool::run, &pool, (unsigned int)pool.workers.size() + 1);
+		pool.call = call;
+		pool.fn = fn;
+		pool.n = n;
+		pool.chunk = chunk;
+		pool.blocks = t;
+		pool.remaining = t - 1;
+		pool.generation++;
+	}
+	pool.wake.notify_all();
+	inPool = true;
+	call(fn, 0, chunk < n ? chunk : n);
+	inPool = false;
+	std::unique_lock<std::mutex> guard(pool.lock);
+	pool.done.wait(guard, [] { return pool.remaining == 0; });
+	return true;
+}
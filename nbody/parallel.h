@@ -0,0 +1,60 @@
+#pragma once
+#include <thread>
+#include <vector>
+#include <cstddef>
+
+//Number of worker threads used by the simulation, 0 - hardware concurrency
+extern unsigned int gThreads;
+
+//Resolve the thread count actually used for a loop of n items; threads 0 - gThreads
+inline unsigned int threadCount(size_t n, unsigned int threads = 0)
+{
+	unsigned int t = threads ? threads : gThreads ? gThreads : std::thread::hardware_concurrency();
+	if (t == 0)
+		t = 1;
+	if (t > n)
+		t = n > 0 ? (unsigned int)n : 1;
+	return t;
+}
+
+//Run call(fn, begin, end) for the t blocks of [0, n) on the persistent worker pool, block 0
+//on the calling thread. The pool serves one loop at a time; returns false without running
+//anything if it is busy with another caller's loop (or this is a nested loop).
+bool parallelRun(unsigned int t, size_t n, void (*call)(void*, size_t, size_t), void* fn);
+
+//Split [0, n) into contiguous blocks and run fn(begin, end) for each block on its own thread.
+//Workers are kept between calls, so a loop costs no thread creation and no allocation;
+//only a concurrent second caller falls back to threads of its own. threads overrides gThreads
+//for this loop, e.g. with a count picked by the autotuner.
+template <typename Fn>
+void parallelFor(size_t n, unsigned int threads, Fn fn)
+{
+	unsigned int t = threadCount(n, threads);
+	if (t <= 1)
+	{
+		fn((size_t)0, n);
+		return;
+	}
+	if (parallelRun(t, n, [](void* f, size_t begin, size_t end) { (*(Fn*)f)(begin, end); }, &fn))
+		return;
+	std::vector<std::thread> workers;
+	workers.reserve(t - 1);
+	size_t chunk = (n + t - 1) / t;
+	for (unsigned int i = 1; i < t; i++)
+	{
+		size_t begin = i * chunk;
+		size_t end = begin + chunk < n ? begin + chunk : n;
+		if (begin >= end)
+			break;
+		workers.emplace_back(fn, begin, end);
+	}
+	fn((size_t)0, chunk < n ? chunk : n);
+	for (auto& w : workers)
+		w.join();
+}
+
+template <typename Fn>
+void parallelFor(size_t n, Fn fn)
+{
+	parallelFor(n, 0, fn);
+}
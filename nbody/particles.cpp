@@ -0,0 +1,310 @@
+#include <algorithm>
+#include "particles.h"
+#include "shader.h"
+#include "frame.h"
+#include "parallel.h"
+#include "profiler.h"
+
+namespace
+{
+	//Bytes of one particle in the buffer: position, 3 floats
+	const size_t STRIDE = 3 * sizeof(float);
+	//Fence waits in nanoseconds before trying again
+	const GLuint64 WAIT_NS = 1000000000;
+
+	//Size attenuation: the diameter in pixels from the distance, at least a pixel. A particle
+	//smaller than a pixel keeps its share of the light in Frag_Coverage instead of vanishing
+#define PARTICLE_VERTEX \
+		"#version 330\n" \
+		"layout(location = 0) in vec3 Position;\n" \
+		FRAME_BLOCK \
+		"uniform float Radius;\n" \
+		"uniform float MaxSize;\n" \
+		"out float Frag_Coverage;\n" \
+		"flat out vec3 Frag_Center;\n" \
+		"void main()\n" \
+		"{\n" \
+		"	vec4 v = View * vec4(Position, 1.0);\n" \
+		"	float pixels = 2.0 * Radius * Viewport.z / max(-v.z, Radius);\n" \
+		"	gl_PointSize = clamp(pixels, 1.0, MaxSize);\n" \
+		"	Frag_Coverage = min(pixels * pixels, 1.0);\n" \
+		"	Frag_Center = v.xyz;\n" \
+		"	gl_Position = Projection * v;\n" \
+		"}\n"
+
+	const char* SPRITE_VERTEX_SHADER = PARTICLE_VERTEX;
+
+	//A disc fading to the edge, added to what is already there
+	const char* SPRITE_FRAGMENT_SHADER =
+		"#version 330\n"
+		"uniform vec3 Color;\n"
+		"in float Frag_Coverage;\n"
+		"out vec4 Out_Color;\n"
+		"void main()\n"
+		"{\n"
+		"	vec2 d = gl_PointCoord * 2.0 - 1.0;\n"
+		"	float r2 = dot(d, d);\n"
+		"	if (r2 > 1.0)\n"
+		"		discard;\n"
+		"	Out_Color = vec4(Color * (Frag_Coverage * (1.0 - r2) * (1.0 - r2)), 1.0);\n"
+		"}\n";
+
+	const char* IMPOSTOR_VERTEX_SHADER = PARTICLE_VERTEX;
+
+	//The sprite as the front half of a sphere facing the camera, lit as the bodies are. The
+	//view is a rotation and a translation, its transpose takes the hit back to the world
+	const char* IMPOSTOR_FRAGMENT_SHADER =
+		"#version 330\n"
+		FRAME_BLOCK
+		"uniform float Radius;\n"
+		"uniform vec3 Color;\n"
+		"flat in vec3 Frag_Center;\n"
+		"out vec4 Out_Color;\n"
+		"void main()\n"
+		"{\n"
+		"	vec2 d = vec2(gl_PointCoord.x * 2.0 - 1.0, 1.0 - gl_PointCoord.y * 2.0);\n"
+		"	float r2 = dot(d, d);\n"
+		"	if (r2 > 1.0)\n"
+		"		discard;\n"
+		"	vec3 normal = vec3(d, sqrt(1.0 - r2));\n"
+		"	vec3 hit = Frag_Center + normal * Radius;\n"
+		"	vec4 clip = Projection * vec4(hit, 1.0);\n"
+		"	gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;\n"
+		"	mat3 toWorld = transpose(mat3(View));\n"
+		"	float diffuse = lightAt(Eye.xyz + toWorld * hit, toWorld * normal);\n"
+		"	Out_Color = vec4(Color * min(Lighting.z + diffuse, 1.0), 1.0);\n"
+		"}\n";
+
+	bool bufferStorage()
+	{
+		return GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+	}
+}
+
+const char* particleModeName(ParticleMode mode)
+{
+	static const char* names[PARTICLE_MODE_COUNT] =
+	{
+		"Точки",
+		"Сферы",
+	};
+	return mode < PARTICLE_MODE_COUNT ? names[mode] : "";
+}
+
+ParticleRenderer::ParticleRenderer()
+	: vao(0)
+	, buffer(0)
+	, persistent(false)
+	, mapped(NULL)
+	, region(0)
+	, capacity(0)
+	, largestPoint(1.f)
+{
+	for (int m = 0; m < PARTICLE_MODE_COUNT; m++)
+	{
+		programs[m] = 0;
+		radius[m] = maxSize[m] = color[m] = -1;
+	}
+	for (auto& f : fences)
+		f = NULL;
+	last.particles = last.bytes = last.draws = 0;
+	last.persistent = false;
+}
+
+bool ParticleRenderer::init()
+{
+	programs[PARTICLE_SPRITES] = compileProgram("ParticleRenderer sprites", SPRITE_VERTEX_SHADER, SPRITE_FRAGMENT_SHADER);
+	programs[PARTICLE_IMPOSTORS] = compileProgram("ParticleRenderer impostors", IMPOSTOR_VERTEX_SHADER, IMPOSTOR_FRAGMENT_SHADER);
+	for (int m = 0; m < PARTICLE_MODE_COUNT; m++)
+	{
+		if (!programs[m])
+			return false;
+		radius[m] = glGetUniformLocation(programs[m], "Radius");
+		maxSize[m] = glGetUniformLocation(programs[m], "MaxSize");
+		color[m] = glGetUniformLocation(programs[m], "Color");
+	}
+	GLfloat range[2] = { 1.f, 1.f };
+	glGetFloatv(GL_ALIASED_POINT_SIZE_RANGE, range);
+	largestPoint = std::max(range[1], 1.f);
+	for (int m = 0; m < PARTICLE_MODE_COUNT; m++)
+	{
+		glUseProgram(programs[m]);
+		glUniform1f(maxSize[m], largestPoint);
+	}
+	glUseProgram(0);
+	return true;
+}
+
+void ParticleRenderer::release()
+{
+	freeBuffer();
+	begin();
+	for (auto& p : programs)
+	{
+		if (p)
+			glDeleteProgram(p);
+		p = 0;
+	}
+}
+
+void ParticleRenderer::retire()
+{
+	for (auto& f : fences)
+	{
+		if (f)
+			glDeleteSync(f);
+		f = NULL;
+	}
+	if (mapped)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		mapped = NULL;
+	}
+	if (buffer)
+		retiredBuffers.push_back(buffer);
+	if (vao)
+		retiredVaos.push_back(vao);
+	buffer = vao = 0;
+	capacity = 0;
+}
+
+void ParticleRenderer::freeBuffer()
+{
+	retire();
+	if (!retiredBuffers.empty())
+		glDeleteBuffers((GLsizei)retiredBuffers.size(), retiredBuffers.data());
+	if (!retiredVaos.empty())
+		glDeleteVertexArrays((GLsizei)retiredVaos.size(), retiredVaos.data());
+	retiredBuffers.clear();
+	retiredVaos.clear();
+}
+
+bool ParticleRenderer::allocate(size_t particles)
+{
+	//Draws queued this frame keep reading the old storage through the old vertex array
+	retire();
+	glGenVertexArrays(1, &vao);
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	persistent = false;
+	if (bufferStorage())
+	{
+		//Immutable storage, written by the CPU while mapped and read by the GPU
+		const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		GLsizeiptr bytes = (GLsizeiptr)(PARTICLE_RING * particles * STRIDE);
+		glBufferStorage(GL_ARRAY_BUFFER, bytes, NULL, flags);
+		mapped = (float*)glMapBufferRange(GL_ARRAY_BUFFER, 0, bytes, flags);
+		persistent = mapped != NULL;
+		if (!persistent)
+		{
+			//Immutable storage can't be resized for the fallback, it needs a new buffer
+			glDeleteBuffers(1, &buffer);
+			glGenBuffers(1, &buffer);
+			glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		}
+	}
+	if (!persistent)
+		glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)(PARTICLE_RING * particles * STRIDE), NULL, GL_STREAM_DRAW);
+	glBindVertexArray(vao);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, (GLsizei)STRIDE, (const GLvoid*)0);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	capacity = particles;
+	region = 0;
+	return glGetError() == GL_NO_ERROR;
+}
+
+float* ParticleRenderer::nextRegion(size_t particles)
+{
+	region = (region + 1) % PARTICLE_RING;
+	GLsync& fence = fences[region];
+	if (fence)
+	{
+		//Normally long signalled: the region was drawn PARTICLE_RING draws ago
+		GLenum result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, WAIT_NS);
+		while (result == GL_TIMEOUT_EXPIRED)
+			result = glClientWaitSync(fence, 0, WAIT_NS);
+		glDeleteSync(fence);
+		fence = NULL;
+	}
+	if (persistent)
+		return mapped + region * capacity * 3;
+	//Orphaning would take the storage from under draws still queued; the fence already
+	//kept the region from being read
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	return (float*)glMapBufferRange(GL_ARRAY_BUFFER, (GLintptr)(region * capacity * STRIDE), (GLsizeiptr)(particles * STRIDE),
+		GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+}
+
+void ParticleRenderer::begin()
+{
+	last.particles = last.bytes = last.draws = 0;
+	last.persistent = persistent;
+	if (!retiredBuffers.empty())
+		glDeleteBuffers((GLsizei)retiredBuffers.size(), retiredBuffers.data());
+	if (!retiredVaos.empty())
+		glDeleteVertexArrays((GLsizei)retiredVaos.size(), retiredVaos.data());
+	retiredBuffers.clear();
+	retiredVaos.clear();
+}
+
+void ParticleRenderer::draw(const State& s, float scale, const ParticleStyle& style, RenderQueue& queue)
+{
+	PROFILE_SCOPE("ParticleRenderer::draw");
+	size_t n = s.size();
+	int mode = style.mode;
+	if (n == 0 || mode < 0 || mode >= PARTICLE_MODE_COUNT || !programs[mode])
+		return;
+	if (n > capacity && !allocate(n))
+	{
+		retire();
+		return;
+	}
+	float* out = nextRegion(n);
+	if (!out)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		return;
+	}
+	{
+		PROFILE_SCOPE("ParticleRenderer stream");
+		const double* px = s.px.data();
+		const double* py = s.py.data();
+		const double* pz = s.pz.data();
+		double k = scale;
+		//Sequential writes only, the mapping may be uncached write-combined memory
+		parallelFor(n, [=](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				out[3 * i] = (float)(px[i] * k);
+				out[3 * i + 1] = (float)(py[i] * k);
+				out[3 * i + 2] = (float)(pz[i] * k);
+			}
+		});
+	}
+	if (!persistent)
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	//The calls of a frame share the style, the uniforms hold for all of them
+	glUseProgram(programs[mode]);
+	glUniform1f(radius[mode], style.radius);
+	float brightness = mode == PARTICLE_SPRITES ? style.intensity : 1.f;
+	glUniform3f(color[mode], style.color[0] * brightness, style.color[1] * brightness, style.color[2] * brightness);
+	glUseProgram(0);
+	//Sprites are additive and unordered: depth-tested against the scene, never written
+	DrawItem item(mode == PARTICLE_SPRITES ? RENDER_ADDITIVE : RENDER_OPAQUE, programs[mode], vao, 0,
+		mode == PARTICLE_SPRITES ? RENDER_POINT_SIZE | RENDER_NO_DEPTH_WRITE | RENDER_BLEND_ADD : RENDER_POINT_SIZE, GL_POINTS);
+	item.first = (GLint)(region * capacity);
+	item.count = (GLsizei)n;
+	item.fence = &fences[region];
+	queue.add(item);
+	last.particles += n;
+	last.bytes += n * STRIDE;
+	last.draws++;
+	last.persistent = persistent;
+}
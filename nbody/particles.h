@@ -0,0 +1,93 @@
+#pragma once
+#include <vector>
+#include <cstddef>
+#include <glew.h>
+#include "state.h"
+#include "render.h"
+
+//Particle rendering for scenarios and catalogs of up to millions of bodies. Positions are
+//converted straight from the State arrays into a vertex buffer and drawn as points in one
+//call. The buffer is split into regions guarded by fences, so the conversion never waits for
+//the GPU. With GL 4.4 / ARB_buffer_storage it is mapped once, persistently, and the driver
+//never copies; otherwise each draw maps its region unsynchronized.
+
+enum ParticleMode
+{
+	//Soft discs added up, dense regions get brighter
+	PARTICLE_SPRITES,
+	//Ray-cast spheres lit by the Sun, depth-tested against each other
+	PARTICLE_IMPOSTORS,
+	PARTICLE_MODE_COUNT
+};
+
+struct ParticleStyle
+{
+	int mode;
+	//Radius of a particle in render units
+	float radius;
+	//Brightness of one sprite
+	float intensity;
+	float color[3];
+};
+
+const ParticleStyle DEFAULT_PARTICLES = { PARTICLE_SPRITES, 0.1f, 0.5f, { 0.7f, 0.7f, 0.6f } };
+
+const char* particleModeName(ParticleMode mode);
+
+//Regions of the buffer: the GPU may still read two draws while the third is written. A frame
+//queues up to PARTICLE_RING draws, each until submitted reads a region of its own
+const int PARTICLE_RING = 3;
+
+//Last frame of the renderer
+struct ParticleStats
+{
+	size_t particles;
+	size_t bytes;
+	size_t draws;
+	bool persistent;
+};
+
+class ParticleRenderer
+{
+public:
+	ParticleRenderer();
+	//Needs a current GL 3.3 context
+	bool init();
+	void release();
+	//Stream the bodies of s, positions in metres multiplied by scale, and queue them. Counts
+	//add up over the calls of a frame until begin()
+	void draw(const State& s, float scale, const ParticleStyle& style, RenderQueue& queue);
+	//Start a frame, the queue of the last one submitted
+	void begin();
+	const ParticleStats& stats() const
+	{
+		return last;
+	}
+
+private:
+	//Storage for capacity particles in every region, in a new buffer and vertex array
+	bool allocate(size_t particles);
+	//Hand the buffer and vertex array over to begin() to delete, draws may still be queued
+	void retire();
+	void freeBuffer();
+	//Pointer to the region the next draw writes, waiting for the GPU to finish reading it
+	float* nextRegion(size_t particles);
+
+	GLuint programs[PARTICLE_MODE_COUNT];
+	//Uniform locations per program
+	GLint radius[PARTICLE_MODE_COUNT], maxSize[PARTICLE_MODE_COUNT];
+	GLint color[PARTICLE_MODE_COUNT];
+	GLuint vao;
+	GLuint buffer;
+	bool persistent;
+	//Persistently mapped storage, PARTICLE_RING regions of capacity particles
+	float* mapped;
+	//Replaced during the frame
+	std::vector<GLuint> retiredBuffers;
+	std::vector<GLuint> retiredVaos;
+	GLsync fences[PARTICLE_RING];
+	int region;
+	size_t capacity;
+	float largestPoint;
+	ParticleStats last;
+};
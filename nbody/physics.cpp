@@ -0,0 +1,299 @@
+#include <cmath>
+#include <mutex>
+#include <algorithm>
+#include "physics.h"
+#include "parallel.h"
+#include "counters.h"
+#include "tree.h"
+
+void stepParticles(State& particles, const State& sources, float dt)
+{
+	PROFILE_SCOPE("stepParticles");
+	//Only bodies with mass pull; the list keeps its capacity between steps. A reference
+	//is what the workers capture, they must not see their own thread_local.
+	static thread_local std::vector<size_t> pullingScratch;
+	std::vector<size_t>& pulling = pullingScratch;
+	pulling.clear();
+	for (size_t j = 0; j < sources.size(); j++)
+		if (sources.gm[j] != 0.0)
+			pulling.push_back(j);
+	PERF_SCOPE("force");
+	parallelFor(particles.size(), [&](size_t begin, size_t end)
+	{
+		PROFILE_SCOPE("stepParticles block");
+		for (size_t i = begin; i < end; i++)
+		{
+			double ax = 0.0, ay = 0.0, az = 0.0;
+			for (size_t j : pulling)
+			{
+				double dx = sources.px[j] - particles.px[i];
+				double dy = sources.py[j] - particles.py[i];
+				double dz = sources.pz[j] - particles.pz[i];
+				double r2 = dx * dx + dy * dy + dz * dz;
+				if (r2 == 0.0)
+					continue;
+				double F = sources.gm[j] / (r2 * std::sqrt(r2));
+				ax += dx * F;
+				ay += dy * F;
+				az += dz * F;
+			}
+			particles.vx[i] += ax * dt;
+			particles.vy[i] += ay * dt;
+			particles.vz[i] += az * dt;
+			particles.px[i] += particles.vx[i] * dt;
+			particles.py[i] += particles.vy[i] * dt;
+			particles.pz[i] += particles.vz[i] * dt;
+		}
+	});
+}
+
+//Buffers of the force passes, per calling thread
+struct StepScratch
+{
+	std::vector<size_t> pulling;
+	std::vector<double> ax, ay, az;
+	//Pulling bodies gathered into contiguous columns for the tiled solver
+	std::vector<double> sx, sy, sz, sgm;
+	Octree tree;
+};
+
+static StepScratch& stepScratch()
+{
+	static thread_local StepScratch scratch;
+	return scratch;
+}
+
+//Accelerations of targets [begin, end) (bodies if targets is null), with Potential
+//also their potential energy
+template <bool Potential>
+static double forceBlock(const State& s, const std::vector<size_t>& pulling, double eps2, const uint32_t* targets,
+	size_t begin, size_t end, double* ax, double* ay, double* az)
+{
+	double potential = 0.0;
+	for (size_t k = begin; k < end; k++)
+	{
+		size_t i = targets ? targets[k] : k;
+		double sx = 0.0, sy = 0.0, sz = 0.0, phi = 0.0;
+		for (size_t j : pulling)
+		{
+			double dx = s.px[j] - s.px[i];
+			double dy = s.py[j] - s.py[i];
+			double dz = s.pz[j] - s.pz[i];
+			double r2 = dx * dx + dy * dy + dz * dz + eps2;
+			//Self term: zero offset, only reachable without softening
+			if (r2 == 0.0)
+				continue;
+			double rinv = 1.0 / std::sqrt(r2);
+			double G = s.gm[j] * rinv;
+			double F = G * rinv * rinv;
+			sx += dx * F;
+			sy += dy * F;
+			sz += dz * F;
+			if (Potential)
+				phi -= G;
+		}
+		ax[k] = sx;
+		ay[k] = sy;
+		az[k] = sz;
+		if (Potential)
+		{
+			//The softened self term isn't skipped above
+			if (eps2 != 0.0 && s.gm[i] != 0.0)
+				phi += s.gm[i] / std::sqrt(eps2);
+			potential += 0.5 * s.mass[i] * phi;
+		}
+	}
+	return potential;
+}
+
+//forceBlock over gathered sources, tile sources at a time for a chunk of targets, so a
+//tile stays in cache while every target of the chunk reads it
+template <bool Potential>
+static double forceTiled(const State& s, const StepScratch& src, double eps2, size_t tile, const uint32_t* targets,
+	size_t begin, size_t end, double* ax, double* ay, double* az)
+{
+	const size_t CHUNK = 16;
+	size_t m = src.sx.size();
+	double potential = 0.0;
+	for (size_t first = begin; first < end; first += CHUNK)
+	{
+		size_t last = std::min(first + CHUNK, end);
+		double tx[CHUNK] = { 0.0 }, ty[CHUNK] = { 0.0 }, tz[CHUNK] = { 0.0 }, phi[CHUNK] = { 0.0 };
+		for (size_t j0 = 0; j0 < m; j0 += tile)
+		{
+			size_t j1 = std::min(j0 + tile, m);
+			for (size_t k = first; k < last; k++)
+			{
+				size_t i = targets ? targets[k] : k;
+				double x = s.px[i], y = s.py[i], z = s.pz[i];
+				double sx = 0.0, sy = 0.0, sz = 0.0, p = 0.0;
+				for (size_t j = j0; j < j1; j++)
+				{
+					double dx = src.sx[j] - x;
+					double dy = src.sy[j] - y;
+					double dz = src.sz[j] - z;
+					double r2 = dx * dx + dy * dy + dz * dz + eps2;
+					if (r2 == 0.0)
+						continue;
+					double rinv = 1.0 / std::sqrt(r2);
+					double G = src.sgm[j] * rinv;
+					double F = G * rinv * rinv;
+					sx += dx * F;
+					sy += dy * F;
+					sz += dz * F;
+					if (Potential)
+						p -= G;
+				}
+				tx[k - first] += sx;
+				ty[k - first] += sy;
+				tz[k - first] += sz;
+				phi[k - first] += p;
+			}
+		}
+		for (size_t k = first; k < last; k++)
+		{
+			ax[k] = tx[k - first];
+			ay[k] = ty[k - first];
+			az[k] = tz[k - first];
+			if (Potential)
+			{
+				size_t i = targets ? targets[k] : k;
+				double selfTerm = eps2 != 0.0 && s.gm[i] != 0.0 ? s.gm[i] / std::sqrt(eps2) : 0.0;
+				potential += 0.5 * s.mass[i] * (phi[k - first] + selfTerm);
+			}
+		}
+	}
+	return potential;
+}
+
+//Accelerations of count targets (all bodies if targets is null) with the configured solver.
+//With c the conserved quantities of the state come from the same pass; targets must be null.
+static void forces(const State& s, double softening, const SolverConfig& config, const uint32_t* targets, size_t count,
+	double* ax, double* ay, double* az, Conservation* c)
+{
+	StepScratch& scratch = stepScratch();
+	std::vector<size_t>& pulling = scratch.pulling;
+	pulling.clear();
+	for (size_t j = 0; j < s.size(); j++)
+		if (s.gm[j] != 0.0)
+			pulling.push_back(j);
+	double eps2 = softening * softening;
+	std::mutex guard;
+	if (config.solver == SOLVER_TILED)
+	{
+		size_t m = pulling.size();
+		scratch.sx.resize(m);
+		scratch.sy.resize(m);
+		scratch.sz.resize(m);
+		scratch.sgm.resize(m);
+		for (size_t j = 0; j < m; j++)
+		{
+			scratch.sx[j] = s.px[pulling[j]];
+			scratch.sy[j] = s.py[pulling[j]];
+			scratch.sz[j] = s.pz[pulling[j]];
+			scratch.sgm[j] = s.gm[pulling[j]];
+		}
+	}
+	else if (config.solver == SOLVER_TREE)
+	{
+		PERF_SCOPE("tree build");
+		scratch.tree.build(s);
+	}
+	size_t tile = std::max(config.tile, 1u);
+	double theta2 = config.theta * config.theta;
+	parallelFor(count, config.threads, [&](size_t begin, size_t end)
+	{
+		PROFILE_SCOPE("stepState force");
+		Conservation partial;
+		resetConservation(partial);
+		switch (config.solver)
+		{
+		case SOLVER_TILED:
+			if (c)
+				partial.potential = forceTiled<true>(s, scratch, eps2, tile, targets, begin, end, ax, ay, az);
+			else
+				forceTiled<false>(s, scratch, eps2, tile, targets, begin, end, ax, ay, az);
+			break;
+		case SOLVER_TREE:
+			for (size_t k = begin; k < end; k++)
+			{
+				size_t i = targets ? targets[k] : k;
+				scratch.tree.accel(s.px[i], s.py[i], s.pz[i], eps2, theta2, ax[k], ay[k], az[k]);
+			}
+			break;
+		default:
+			if (c)
+				partial.potential = forceBlock<true>(s, pulling, eps2, targets, begin, end, ax, ay, az);
+			else
+				forceBlock<false>(s, pulling, eps2, targets, begin, end, ax, ay, az);
+			break;
+		}
+		if (!c)
+			return;
+		//Diagnostics of the state before the step, from the same pass
+		addMoments(s, begin, end, partial);
+		std::lock_guard<std::mutex> lock(guard);
+		addConservation(*c, partial);
+	});
+	if (c && config.solver == SOLVER_TREE)
+	{
+		//Potential from the same tree, the opening angle kept below 1/sqrt(3) (see Octree::potential)
+		double potentialTheta = std::min(config.theta, 0.55);
+		parallelFor(scratch.tree.size(), config.threads, [&](size_t begin, size_t end)
+		{
+			double partial = 0.0;
+			for (size_t k = begin; k < end; k++)
+				partial += s.mass[scratch.tree.body(k)] * scratch.tree.potential(k, eps2, potentialTheta * potentialTheta);
+			std::lock_guard<std::mutex> lock(guard);
+			c->potential += 0.5 * partial;
+		});
+	}
+}
+
+const char* solverName(Solver solver)
+{
+	static const char* names[SOLVER_COUNT] = { "Прямой", "Блочный", "Дерево" };
+	return solver < SOLVER_COUNT ? names[solver] : "";
+}
+
+void computeForces(const State& s, double softening, const SolverConfig& config, const uint32_t* targets, size_t count,
+	double* ax, double* ay, double* az)
+{
+	forces(s, softening, config, targets, count, ax, ay, az, nullptr);
+}
+
+void stepState(State& s, float dt, double softening, const SolverConfig& config, Conservation* c)
+{
+	//Scratch kept between steps, a step of the same size allocates nothing
+	StepScratch& scratch = stepScratch();
+	std::vector<double>& ax = scratch.ax;
+	std::vector<double>& ay = scratch.ay;
+	std::vector<double>& az = scratch.az;
+	ax.resize(s.size());
+	ay.resize(s.size());
+	az.resize(s.size());
+	if (c)
+	{
+		resetConservation(*c);
+		c->day = s.day;
+	}
+	{
+		PERF_SCOPE("force");
+		forces(s, softening, config, nullptr, s.size(), ax.data(), ay.data(), az.data(), c);
+	}
+	PERF_SCOPE("integrate");
+	for (size_t i = 0; i < s.size(); i++)
+	{
+		s.vx[i] += ax[i] * dt;
+		s.vy[i] += ay[i] * dt;
+		s.vz[i] += az[i] * dt;
+		s.px[i] += s.vx[i] * dt;
+		s.py[i] += s.vy[i] * dt;
+		s.pz[i] += s.vz[i] * dt;
+	}
+}
+
+void stepState(State& s, float dt, double softening, Conservation* c)
+{
+	stepState(s, dt, softening, DEFAULT_SOLVER, c);
+}
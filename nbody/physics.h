@@ -0,0 +1,48 @@
+#pragma once
+#include <cstdint>
+#include "state.h"
+#include "diagnostics.h"
+
+//Force solvers of stepState
+enum Solver
+{
+	//Every pulling body for every body, O(N*M)
+	SOLVER_DIRECT = 0,
+	//The same sum over gathered sources in cache-sized tiles
+	SOLVER_TILED = 1,
+	//Barnes-Hut octree, O(N log M), approximate
+	SOLVER_TREE = 2,
+	SOLVER_COUNT
+};
+
+struct SolverConfig
+{
+	Solver solver;
+	//Sources per tile of SOLVER_TILED
+	unsigned int tile;
+	//Threads of the force pass, 0 - gThreads
+	unsigned int threads;
+	//Opening angle of SOLVER_TREE
+	double theta;
+};
+
+const SolverConfig DEFAULT_SOLVER = { SOLVER_DIRECT, 256, 0, 0.5 };
+
+//Solver name for the UI
+const char* solverName(Solver solver);
+
+//Advance particles by one semi-implicit Euler step (the scheme of Body::update) in the
+//gravity of the sources only. Used for catalogs of massless bodies moving among the planets.
+void stepParticles(State& particles, const State& sources, float dt);
+
+//Advance a self-gravitating state by one semi-implicit Euler step with Plummer softening
+//(m). Bodies with gm = 0 feel gravity but don't pull, so test particles cost O(N*M).
+//If c is not null it receives the conserved quantities of the state before the step,
+//the potential accumulated in the force loop itself.
+void stepState(State& s, float dt, double softening, Conservation* c = nullptr);
+//The same with a chosen force solver
+void stepState(State& s, float dt, double softening, const SolverConfig& config, Conservation* c = nullptr);
+//Accelerations (m/s^2) of count bodies, the indices in targets or all bodies if it is null,
+//into ax, ay, az[0, count). For calibrating solvers on a sample of the bodies.
+void computeForces(const State& s, double softening, const SolverConfig& config, const uint32_t* targets, size_t count,
+	double* ax, double* ay, double* az);
@@ -0,0 +1,260 @@
+#include <cstring>
+#include <algorithm>
+#include "playback.h"
+#include "parallel.h"
+#include "profiler.h"
+#include "alloc.h"
+
+TrajectoryReader::TrajectoryReader()
+	: lastChunk(NONE)
+	, stop(false)
+	, wanted(NONE)
+{
+	memset(&header, 0, sizeof(header));
+	current.chunk = NONE;
+	ahead.chunk = NONE;
+}
+
+TrajectoryReader::~TrajectoryReader()
+{
+	close();
+}
+
+bool TrajectoryReader::open(const std::string& path)
+{
+	close();
+	if (!file.open(path) || file.size() < sizeof(header))
+		return false;
+	memcpy(&header, file.data(), sizeof(header));
+	if (memcmp(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic)) != 0
+		|| header.version < 1 || header.version > TRAJECTORY_VERSION || header.columns != TRAJECTORY_COLUMNS
+		|| !buildIndex())
+	{
+		close();
+		return false;
+	}
+	stop = false;
+	worker = std::thread(&TrajectoryReader::run, this);
+	return true;
+}
+
+void TrajectoryReader::close()
+{
+	if (worker.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stop = true;
+		}
+		wake.notify_one();
+		worker.join();
+	}
+	index.clear();
+	file.close();
+	current.chunk = NONE;
+	ahead.chunk = NONE;
+	wanted = NONE;
+	lastChunk = NONE;
+}
+
+bool TrajectoryReader::readChunk(uint64_t offset, TrajectoryChunk& chunk) const
+{
+	uint64_t size = file.size();
+	if (offset < sizeof(header) || offset > size || size - offset < sizeof(chunk))
+		return false;
+	memcpy(&chunk, file.data() + offset, sizeof(chunk));
+	return memcmp(chunk.magic, TRAJECTORY_CHUNK_MAGIC, sizeof(chunk.magic)) == 0
+		&& chunk.frames > 0 && chunk.size <= size - offset - sizeof(chunk);
+}
+
+bool TrajectoryReader::buildIndex()
+{
+	index.clear();
+	//Index written on close, trusted only if every entry points at a whole chunk
+	TrajectoryFooter footer;
+	if (file.size() >= sizeof(header) + sizeof(footer))
+	{
+		memcpy(&footer, file.data() + file.size() - sizeof(footer), sizeof(footer));
+		uint64_t available = file.size() - sizeof(footer);
+		if (memcmp(footer.magic, TRAJECTORY_FOOTER_MAGIC, sizeof(footer.magic)) == 0
+			&& footer.chunks <= available / sizeof(TrajectoryIndexEntry)
+			&& footer.indexOffset == available - footer.chunks * sizeof(TrajectoryIndexEntry))
+		{
+			index.resize((size_t)footer.chunks);
+			memcpy(index.data(), file.data() + footer.indexOffset, (size_t)(footer.chunks * sizeof(TrajectoryIndexEntry)));
+			bool valid = !index.empty();
+			for (const TrajectoryIndexEntry& entry : index)
+			{
+				TrajectoryChunk chunk;
+				if (!readChunk(entry.offset, chunk) || chunk.frames != entry.frames
+					|| entry.offset + sizeof(chunk) + chunk.size > footer.indexOffset)
+				{
+					valid = false;
+					break;
+				}
+			}
+			if (valid)
+				return true;
+			index.clear();
+		}
+	}
+	//No usable footer, e.g. the writer didn't finish: walk the chunks and stop at the first torn one
+	uint64_t offset = sizeof(header);
+	TrajectoryChunk chunk;
+	while (readChunk(offset, chunk))
+	{
+		TrajectoryIndexEntry entry = { chunk.firstDay, chunk.lastDay, offset, chunk.frames };
+		index.push_back(entry);
+		offset += sizeof(chunk) + chunk.size;
+	}
+	return !index.empty();
+}
+
+size_t TrajectoryReader::findChunk(double day) const
+{
+	//Last chunk starting at or before day
+	auto it = std::upper_bound(index.begin(), index.end(), day,
+		[](double d, const TrajectoryIndexEntry& e) { return d < e.firstDay; });
+	return it == index.begin() ? 0 : (size_t)(it - index.begin()) - 1;
+}
+
+bool TrajectoryReader::decode(size_t k, Decoded& out) const
+{
+	PROFILE_SCOPE("TrajectoryReader::decode");
+	const TrajectoryIndexEntry& entry = index[k];
+	TrajectoryChunk chunk;
+	if (!readChunk(entry.offset, chunk))
+		return false;
+	size_t n = bodies();
+	const unsigned char* p = file.data() + entry.offset + sizeof(chunk);
+	const unsigned char* end = p + chunk.size;
+	if (chunk.frames * sizeof(double) > chunk.size)
+		return false;
+	out.days.resize(chunk.frames);
+	memcpy(out.days.data(), p, chunk.frames * sizeof(double));
+	p += chunk.frames * sizeof(double);
+	out.conservation.assign(chunk.frames, Conservation());
+	if (chunk.flags & TRAJECTORY_DIAGNOSTICS)
+	{
+		if (chunk.frames * sizeof(Conservation) > (size_t)(end - p))
+			return false;
+		memcpy(out.conservation.data(), p, chunk.frames * sizeof(Conservation));
+		p += chunk.frames * sizeof(Conservation);
+	}
+	const unsigned char* block[TRAJECTORY_COLUMNS];
+	size_t blockSize[TRAJECTORY_COLUMNS];
+	for (uint32_t c = 0; c < TRAJECTORY_COLUMNS; c++)
+	{
+		uint64_t size;
+		if (sizeof(size) > (size_t)(end - p))
+			return false;
+		memcpy(&size, p, sizeof(size));
+		p += sizeof(size);
+		if (size > (uint64_t)(end - p))
+			return false;
+		block[c] = p;
+		blockSize[c] = (size_t)size;
+		if (n > columnCapacity((Codec)chunk.codec, p, blockSize[c]) / chunk.frames)
+			return false;
+		out.columns[c].resize(chunk.frames * n);
+		p += size;
+	}
+	//Velocities first, positions of the quantized codec are predicted from them
+	Codec codec = (Codec)chunk.codec;
+	bool ok[TRAJECTORY_COLUMNS];
+	parallelFor(3, [&](size_t first, size_t last)
+	{
+		PROFILE_SCOPE("decode velocities");
+		for (size_t c = first + 3; c < last + 3; c++)
+			ok[c] = decodeColumn(codec, block[c], blockSize[c], chunk.frames, n, out.columns[c].data());
+	});
+	parallelFor(3, [&](size_t first, size_t last)
+	{
+		PROFILE_SCOPE("decode positions");
+		for (size_t c = first; c < last; c++)
+		{
+			CodecParams params;
+			if (columnNeedsRate(codec, block[c], blockSize[c]))
+			{
+				params.rate = out.columns[c + 3].data();
+				params.days = out.days.data();
+			}
+			ok[c] = decodeColumn(codec, block[c], blockSize[c], chunk.frames, n, out.columns[c].data(), params);
+		}
+	});
+	for (uint32_t c = 0; c < TRAJECTORY_COLUMNS; c++)
+		if (!ok[c])
+			return false;
+	out.chunk = k;
+	return true;
+}
+
+bool TrajectoryReader::read(double day, State& s, Conservation* c)
+{
+	if (index.empty())
+		return false;
+	size_t k = findChunk(day);
+	if (current.chunk != k)
+	{
+		bool ready = false;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			if (ahead.chunk == k)
+			{
+				std::swap(current, ahead);
+				ready = true;
+			}
+		}
+		if (!ready && !decode(k, current))
+		{
+			current.chunk = NONE;
+			return false;
+		}
+	}
+	//Read ahead in the direction of playback
+	size_t next = (lastChunk != NONE && k < lastChunk) ? k - 1 : k + 1;
+	lastChunk = k;
+	if (next < index.size())
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			wanted = next;
+		}
+		wake.notify_one();
+	}
+
+	size_t frame = std::upper_bound(current.days.begin(), current.days.end(), day) - current.days.begin();
+	frame = frame > 0 ? frame - 1 : 0;
+	size_t n = bodies();
+	if (s.size() != n)
+		s.resize(n);
+	std::vector<double>* columns[TRAJECTORY_COLUMNS] = { &s.px, &s.py, &s.pz, &s.vx, &s.vy, &s.vz };
+	for (uint32_t c = 0; c < TRAJECTORY_COLUMNS; c++)
+		memcpy(columns[c]->data(), current.columns[c].data() + frame * n, n * sizeof(double));
+	s.day = current.days[frame];
+	if (c)
+		*c = current.conservation[frame];
+	return true;
+}
+
+void TrajectoryReader::run()
+{
+	profileThreadName("playback prefetch");
+	ALLOC_SCOPE("playback");
+	Decoded decoded;
+	std::unique_lock<std::mutex> guard(lock);
+	while (true)
+	{
+		wake.wait(guard, [this] { return stop || (wanted != NONE && wanted != ahead.chunk); });
+		if (stop)
+			return;
+		size_t k = wanted;
+		guard.unlock();
+		bool ok = decode(k, decoded);
+		guard.lock();
+		if (ok)
+			std::swap(decoded, ahead);
+		if (wanted == k)
+			wanted = NONE;
+	}
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "state.h"
+#include "trajectory.h"
+#include "mapped_file.h"
+
+//Plays back a trajectory file written by TrajectorySink. The file is memory-mapped,
+//seeks are binary searches over the chunk index and the frame days of a chunk, and
+//a worker thread decodes the chunk after the current one in the playback direction.
+class TrajectoryReader
+{
+public:
+	TrajectoryReader();
+	~TrajectoryReader();
+	//Map the file and build the chunk index
+	bool open(const std::string& path);
+	void close();
+	bool isOpen() const
+	{
+		return !index.empty();
+	}
+	//Number of bodies per frame
+	size_t bodies() const
+	{
+		return (size_t)header.count;
+	}
+	double firstDay() const
+	{
+		return index.empty() ? 0.0 : index.front().firstDay;
+	}
+	double lastDay() const
+	{
+		return index.empty() ? 0.0 : index.back().lastDay;
+	}
+	//Fill positions, velocities and day with the last frame at or before day, and c,
+	//if not null, with its recorded conserved quantities (mass 0 if none were recorded)
+	bool read(double day, State& s, Conservation* c = nullptr);
+
+private:
+	struct Decoded
+	{
+		size_t chunk;
+		std::vector<double> days;
+		std::vector<Conservation> conservation;
+		std::vector<double> columns[TRAJECTORY_COLUMNS];
+	};
+	static const size_t NONE = (size_t)-1;
+	bool buildIndex();
+	//Header of the chunk at offset, false unless it has frames and it and its data lie within the file
+	bool readChunk(uint64_t offset, TrajectoryChunk& chunk) const;
+	size_t findChunk(double day) const;
+	bool decode(size_t chunk, Decoded& out) const;
+	void run();
+	MappedFile file;
+	TrajectoryHeader header;
+	std::vector<TrajectoryIndexEntry> index;
+	//Main thread only
+	Decoded current;
+	size_t lastChunk;
+	//Shared with the prefetch worker
+	std::thread worker;
+	std::mutex lock;
+	std::condition_variable wake;
+	bool stop;
+	size_t wanted;
+	Decoded ahead;
+};
@@ -0,0 +1,172 @@
+#include <cmath>
+#include <algorithm>
+#include "predictor.h"
+#include "profiler.h"
+#include "alloc.h"
+
+TrailPredictor::TrailPredictor(size_t budgetBytes, size_t maxTrails)
+	: stop(false)
+	, requested(false)
+	, start(0)
+	, steps(0)
+	, pastDone(0)
+	, futureDone(0)
+	, computed(0)
+	, backward(budgetBytes, maxTrails)
+	, forward(budgetBytes, maxTrails)
+{
+	worker = std::thread(&TrailPredictor::run, this);
+}
+
+TrailPredictor::~TrailPredictor()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stop = true;
+	}
+	wake.notify_one();
+	worker.join();
+}
+
+void TrailPredictor::predict(const State& s, int64_t tick, const uint32_t* lengths)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		request = s;
+		requestLengths.assign(lengths, lengths + s.size());
+		requested = true;
+		pastDone = futureDone = 0;
+	}
+	start = tick;
+	wake.notify_one();
+}
+
+float TrailPredictor::progress() const
+{
+	int64_t total = steps;
+	return total > 0 ? (float)(pastDone + futureDone) / (2.f * total) : 1.f;
+}
+
+void TrailPredictor::begin()
+{
+	requested = false;
+	//Copies into the states of the last prediction, the same bodies allocate nothing
+	back = request;
+	ahead = request;
+	lengths = requestLengths;
+	size_t n = back.size();
+	int64_t longest = 0;
+	for (uint32_t length : lengths)
+		longest = std::max(longest, (int64_t)length);
+	positions.resize(3 * PREDICT_CHUNK * n);
+	ax.resize(n);
+	ay.resize(n);
+	az.resize(n);
+	for (size_t i = 0; i < std::max(n, backward.size()); i++)
+	{
+		uint32_t length = i < n ? lengths[i] : 0;
+		if (i >= backward.size())
+		{
+			backward.add(length);
+			forward.add(length);
+		}
+		else
+		{
+			backward.restart((int)i, length);
+			forward.restart((int)i, length);
+		}
+		if (length == 0)
+			continue;
+		//Both start where the trail of the simulation does
+		const double p[3] = { back.px[i], back.py[i], back.pz[i] };
+		backward.sample((int)i, 0, p);
+		forward.sample((int)i, 0, p);
+	}
+	pastDone = futureDone = 0;
+	steps = longest;
+}
+
+void TrailPredictor::compute(State& s, float dt, int64_t done)
+{
+	PROFILE_SCOPE("TrailPredictor::compute");
+	size_t n = s.size();
+	computed = std::min((int64_t)PREDICT_CHUNK, steps - done);
+	for (int64_t k = 0; k < computed; k++)
+	{
+		//The step of Body::update: velocity first, then position with the new velocity
+		for (size_t i = 0; i < n; i++)
+		{
+			double x = 0.0, y = 0.0, z = 0.0;
+			for (size_t j = 0; j < n; j++)
+			{
+				if (j == i || s.gm[j] == 0.0)
+					continue;
+				double dx = s.px[j] - s.px[i], dy = s.py[j] - s.py[i], dz = s.pz[j] - s.pz[i];
+				double r2 = dx * dx + dy * dy + dz * dz;
+				double f = s.gm[j] / (r2 * std::sqrt(r2));
+				x += dx * f;
+				y += dy * f;
+				z += dz * f;
+			}
+			ax[i] = x;
+			ay[i] = y;
+			az[i] = z;
+		}
+		double* p = &positions[3 * n * k];
+		for (size_t i = 0; i < n; i++)
+		{
+			s.vx[i] += ax[i] * dt;
+			s.vy[i] += ay[i] * dt;
+			s.vz[i] += az[i] * dt;
+			s.px[i] += s.vx[i] * dt;
+			s.py[i] += s.vy[i] * dt;
+			s.pz[i] += s.vz[i] * dt;
+			p[3 * i] = s.px[i];
+			p[3 * i + 1] = s.py[i];
+			p[3 * i + 2] = s.pz[i];
+		}
+	}
+}
+
+void TrailPredictor::publish(TrailStore& store, int64_t done)
+{
+	size_t n = lengths.size();
+	for (size_t i = 0; i < n; i++)
+	{
+		int64_t last = std::min(computed, (int64_t)lengths[i] - done);
+		for (int64_t k = 0; k < last; k++)
+			store.sample((int)i, done + k + 1, &positions[3 * (n * k + i)]);
+	}
+}
+
+void TrailPredictor::run()
+{
+	profileThreadName("trail predictor");
+	ALLOC_SCOPE("prediction");
+	std::unique_lock<std::mutex> guard(lock);
+	while (true)
+	{
+		wake.wait(guard, [this] { return stop || requested || pastDone < steps || futureDone < steps; });
+		if (stop)
+			return;
+		if (requested)
+			begin();
+		//The past and the future take turns
+		bool past = pastDone < steps && (pastDone <= futureDone || futureDone >= steps);
+		int64_t done = past ? pastDone : futureDone;
+		guard.unlock();
+		compute(past ? back : ahead, past ? -PREDICT_STEP : PREDICT_STEP, done);
+		guard.lock();
+		//A newer request makes the chunk worthless
+		if (requested)
+			continue;
+		{
+			PROFILE_SCOPE("TrailPredictor::publish");
+			publish(past ? backward : forward, done);
+		}
+		if (past)
+			pastDone += computed;
+		else
+			futureDone += computed;
+	}
+}
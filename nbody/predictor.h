@@ -0,0 +1,92 @@
+#pragma once
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+#include "state.h"
+#include "history.h"
+
+//Trails around a state computed ahead of time on a background thread. From a state at some
+//step a copy of the bodies is stepped backwards to fill the past trails and forwards for the
+//predicted ones, each body over its own number of steps, with the semi-implicit Euler scheme
+//of the simulation and a direct force sum on the worker alone. That is cheap enough for a few
+//bodies: Pluto's 90560 days take a fraction of a second.
+//
+//The trails are published every PREDICT_CHUNK steps, the past and the future in turns, so
+//both grow from the bodies outwards. The past trails are sampled with the steps back from the
+//start as their ticks. The render loop reads them between tryLock() and unlock() and skips
+//a frame rather than wait for a chunk being published.
+
+//Steps computed between publications
+const int PREDICT_CHUNK = 512;
+//Seconds per step, one trail tick
+const float PREDICT_STEP = 86400.0f;
+
+class TrailPredictor
+{
+public:
+	//The past and the future trails of up to maxTrails bodies share budgetBytes each
+	TrailPredictor(size_t budgetBytes, size_t maxTrails);
+	~TrailPredictor();
+	//Start over from s at step tick, lengths[i] steps back and ahead for body i, 0 - none.
+	//A prediction still running is dropped
+	void predict(const State& s, int64_t tick, const uint32_t* lengths);
+	//Step the prediction started from
+	int64_t origin() const
+	{
+		return start;
+	}
+	//Share of the steps of the last prediction done, 0 to 1
+	float progress() const;
+	//The trails may be read while locked; false if the worker is publishing right now
+	bool tryLock()
+	{
+		return lock.try_lock();
+	}
+	void unlock()
+	{
+		lock.unlock();
+	}
+	//Trail i is body i of the predicted state
+	const TrailStore& past() const
+	{
+		return backward;
+	}
+	const TrailStore& future() const
+	{
+		return forward;
+	}
+
+private:
+	void run();
+	//Take over the request and restart the trails, under the lock
+	void begin();
+	//Step a state by PREDICT_CHUNK steps of dt, keeping the positions
+	void compute(State& s, float dt, int64_t done);
+	//Sample the kept positions of steps done + 1 on into the store
+	void publish(TrailStore& store, int64_t done);
+
+	std::thread worker;
+	std::mutex lock;
+	std::condition_variable wake;
+	bool stop;
+	bool requested;
+	//Request of predict(), taken over by the worker
+	State request;
+	std::vector<uint32_t> requestLengths;
+	int64_t start;
+	//Worker side
+	State back, ahead;
+	std::vector<uint32_t> lengths;
+	std::atomic<int64_t> steps;
+	std::atomic<int64_t> pastDone;
+	std::atomic<int64_t> futureDone;
+	//Positions of the last chunk, PREDICT_CHUNK steps of x, y, z per body
+	std::vector<double> positions;
+	std::vector<double> ax, ay, az;
+	int64_t computed;
+	TrailStore backward;
+	TrailStore forward;
+};
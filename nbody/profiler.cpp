@@ -0,0 +1,358 @@
+#include <atomic>
+#include <cstring>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include "profiler.h"
+
+namespace
+{
+	struct TraceEvent
+	{
+		uint64_t start;
+		uint64_t end;
+		int scope;
+	};
+
+	//Ring of finished scopes of one thread. Only the owner writes; the exporter copies
+	//and then drops whatever the owner may have overwritten meanwhile. Buffers of exited
+	//threads are handed to new ones, so short-lived parallelFor workers reuse a few lanes.
+	struct TraceBuffer
+	{
+		TraceEvent events[PROFILE_TRACE_EVENTS];
+		std::atomic<uint64_t> head;
+		bool used;
+		int lane;
+		char name[32];
+	};
+
+	struct LaneEvent
+	{
+		int lane;
+		TraceEvent event;
+	};
+
+	struct Profiler
+	{
+		std::mutex lock;
+		const char* names[PROFILE_MAX_SCOPES];
+		std::atomic<int> scopes;
+		//Sums of the running frame
+		std::atomic<uint64_t> current[PROFILE_MAX_SCOPES];
+		std::atomic<uint64_t> steps;
+		std::atomic<uint64_t> interactions;
+		//Main thread only, ring of closed frames
+		uint64_t history[PROFILE_HISTORY][PROFILE_MAX_SCOPES];
+		uint64_t frameTicks[PROFILE_HISTORY];
+		uint64_t frameSteps[PROFILE_HISTORY];
+		double frameInteractions[PROFILE_HISTORY];
+		int frames;
+		int next;
+		uint64_t frameStart;
+		//Tick rate calibration against the steady clock
+		uint64_t calibrationTicks;
+		std::chrono::steady_clock::time_point calibrationTime;
+		double ticksPerMs;
+		//Sorting buffer for the percentiles
+		double sorted[PROFILE_HISTORY];
+		//Start of every frame in the history
+		uint64_t frameBegin[PROFILE_HISTORY];
+		//Trace buffers, never freed
+		std::mutex traceLock;
+		std::vector<TraceBuffer*> buffers;
+		//Events before the first profileFrame(), saved before the rings wrap
+		std::vector<LaneEvent> startup;
+		uint64_t firstFrame;
+
+		Profiler()
+			: scopes(0)
+			, steps(0)
+			, interactions(0)
+			, frames(0)
+			, next(0)
+			, ticksPerMs(0.0)
+			, firstFrame(0)
+		{
+			for (auto& c : current)
+				c = 0;
+			memset(history, 0, sizeof(history));
+			memset(frameTicks, 0, sizeof(frameTicks));
+			memset(frameSteps, 0, sizeof(frameSteps));
+			memset(frameInteractions, 0, sizeof(frameInteractions));
+			memset(frameBegin, 0, sizeof(frameBegin));
+			frameStart = calibrationTicks = profileTicks();
+			calibrationTime = std::chrono::steady_clock::now();
+		}
+	};
+
+	Profiler& profiler()
+	{
+		static Profiler* p = new Profiler();
+		return *p;
+	}
+
+	TraceBuffer* acquireBuffer()
+	{
+		Profiler& p = profiler();
+		std::lock_guard<std::mutex> guard(p.traceLock);
+		for (auto buffer : p.buffers)
+		{
+			if (!buffer->used)
+			{
+				buffer->used = true;
+				snprintf(buffer->name, sizeof(buffer->name), "worker %d", buffer->lane);
+				return buffer;
+			}
+		}
+		TraceBuffer* buffer = new TraceBuffer();
+		buffer->head = 0;
+		buffer->used = true;
+		buffer->lane = (int)p.buffers.size();
+		snprintf(buffer->name, sizeof(buffer->name), "worker %d", buffer->lane);
+		p.buffers.push_back(buffer);
+		return buffer;
+	}
+
+	struct TraceHandle
+	{
+		TraceBuffer* buffer;
+		TraceHandle()
+			: buffer(NULL)
+		{
+		}
+		~TraceHandle()
+		{
+			if (!buffer)
+				return;
+			std::lock_guard<std::mutex> guard(profiler().traceLock);
+			buffer->used = false;
+		}
+		TraceBuffer* get()
+		{
+			if (!buffer)
+				buffer = acquireBuffer();
+			return buffer;
+		}
+	};
+
+	thread_local TraceHandle traceHandle;
+
+	//Copy the events of a ring that ended at or after since
+	void collect(TraceBuffer* buffer, uint64_t since, std::vector<LaneEvent>& out)
+	{
+		uint64_t head = buffer->head.load(std::memory_order_acquire);
+		uint64_t first = head > (uint64_t)PROFILE_TRACE_EVENTS ? head - PROFILE_TRACE_EVENTS : 0;
+		size_t begin = out.size();
+		for (uint64_t i = first; i < head; i++)
+		{
+			LaneEvent e = { buffer->lane, buffer->events[i % PROFILE_TRACE_EVENTS] };
+			out.push_back(e);
+		}
+		//Entries the owner overwrote while they were copied
+		uint64_t now = buffer->head.load(std::memory_order_acquire);
+		uint64_t valid = now > (uint64_t)PROFILE_TRACE_EVENTS ? now - PROFILE_TRACE_EVENTS : 0;
+		size_t keep = begin;
+		for (size_t i = begin; i < out.size(); i++)
+			if (first + (i - begin) >= valid && out[i].event.end >= since)
+				out[keep++] = out[i];
+		out.resize(keep);
+	}
+
+	void writeString(FILE* f, const char* s)
+	{
+		fputc('"', f);
+		for (; *s; s++)
+		{
+			if (*s == '"' || *s == '\\')
+				fputc('\\', f);
+			fputc(*s, f);
+		}
+		fputc('"', f);
+	}
+}
+
+int profileScope(const char* name)
+{
+	Profiler& p = profiler();
+	std::lock_guard<std::mutex> guard(p.lock);
+	int count = p.scopes.load();
+	for (int i = 0; i < count; i++)
+		if (!strcmp(p.names[i], name))
+			return i;
+	//Out of slots, the last one collects the rest
+	if (count == PROFILE_MAX_SCOPES)
+		return PROFILE_MAX_SCOPES - 1;
+	p.names[count] = name;
+	p.scopes = count + 1;
+	return count;
+}
+
+void profileAdd(int scope, uint64_t ticks)
+{
+	profiler().current[scope].fetch_add(ticks, std::memory_order_relaxed);
+}
+
+void profileEvent(int scope, uint64_t start, uint64_t end)
+{
+	TraceBuffer* buffer = traceHandle.get();
+	uint64_t head = buffer->head.load(std::memory_order_relaxed);
+	TraceEvent& e = buffer->events[head % PROFILE_TRACE_EVENTS];
+	e.start = start;
+	e.end = end;
+	e.scope = scope;
+	buffer->head.store(head + 1, std::memory_order_release);
+}
+
+void profileThreadName(const char* name)
+{
+	TraceBuffer* buffer = traceHandle.get();
+	std::lock_guard<std::mutex> guard(profiler().traceLock);
+	snprintf(buffer->name, sizeof(buffer->name), "%s", name);
+}
+
+void profileSteps(uint64_t steps, double interactions)
+{
+	Profiler& p = profiler();
+	p.steps += steps;
+	p.interactions += (uint64_t)interactions;
+}
+
+void profileFrame()
+{
+	Profiler& p = profiler();
+	uint64_t now = profileTicks();
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - p.calibrationTime).count();
+	if (ms > 100.0)
+		p.ticksPerMs = (now - p.calibrationTicks) / ms;
+	if (p.firstFrame == 0)
+	{
+		//The first call closes startup, which is kept out of reach of the ring buffers
+		p.firstFrame = now;
+		p.frameStart = now;
+		std::lock_guard<std::mutex> guard(p.traceLock);
+		for (auto buffer : p.buffers)
+			collect(buffer, 0, p.startup);
+		for (int i = 0; i < p.scopes.load(); i++)
+			p.current[i] = 0;
+		return;
+	}
+	int count = p.scopes.load();
+	for (int i = 0; i < count; i++)
+		p.history[p.next][i] = p.current[i].exchange(0, std::memory_order_relaxed);
+	p.frameTicks[p.next] = now - p.frameStart;
+	p.frameBegin[p.next] = p.frameStart;
+	p.frameSteps[p.next] = p.steps.exchange(0);
+	p.frameInteractions[p.next] = (double)p.interactions.exchange(0);
+	p.frameStart = now;
+	p.next = (p.next + 1) % PROFILE_HISTORY;
+	p.frames = std::min(p.frames + 1, PROFILE_HISTORY);
+}
+
+int profileStats(ScopeStats* out, int max)
+{
+	Profiler& p = profiler();
+	int count = std::min(p.scopes.load(), max);
+	if (p.ticksPerMs <= 0.0 || p.frames == 0)
+		return 0;
+	for (int i = 0; i < count; i++)
+	{
+		double sum = 0.0;
+		for (int f = 0; f < p.frames; f++)
+		{
+			p.sorted[f] = p.history[f][i] / p.ticksPerMs;
+			sum += p.sorted[f];
+		}
+		out[i].name = p.names[i];
+		out[i].mean = sum / p.frames;
+		std::nth_element(p.sorted, p.sorted + p.frames / 2, p.sorted + p.frames);
+		out[i].p50 = p.sorted[p.frames / 2];
+		int k99 = std::min(p.frames - 1, p.frames * 99 / 100);
+		std::nth_element(p.sorted, p.sorted + k99, p.sorted + p.frames);
+		out[i].p99 = p.sorted[k99];
+	}
+	return count;
+}
+
+int profileFrameTimes(float* out, int max)
+{
+	Profiler& p = profiler();
+	if (p.ticksPerMs <= 0.0)
+		return 0;
+	int count = std::min(p.frames, max);
+	for (int i = 0; i < count; i++)
+	{
+		int f = (p.next - count + i + PROFILE_HISTORY) % PROFILE_HISTORY;
+		out[i] = (float)(p.frameTicks[f] / p.ticksPerMs);
+	}
+	return count;
+}
+
+void profileRates(double& stepsPerSecond, double& interactionsPerSecond)
+{
+	Profiler& p = profiler();
+	stepsPerSecond = 0.0;
+	interactionsPerSecond = 0.0;
+	double ticks = 0.0, steps = 0.0, interactions = 0.0;
+	for (int f = 0; f < p.frames; f++)
+	{
+		ticks += p.frameTicks[f];
+		steps += p.frameSteps[f];
+		interactions += p.frameInteractions[f];
+	}
+	if (ticks <= 0.0 || p.ticksPerMs <= 0.0)
+		return;
+	double seconds = ticks / p.ticksPerMs / 1000.0;
+	stepsPerSecond = steps / seconds;
+	interactionsPerSecond = interactions / seconds;
+}
+
+bool profileExportTrace(const char* path, int frames)
+{
+	Profiler& p = profiler();
+	if (p.ticksPerMs <= 0.0)
+		return false;
+	frames = std::max(1, std::min(frames, p.frames));
+	int first = (p.next - frames + PROFILE_HISTORY) % PROFILE_HISTORY;
+	uint64_t since = p.frames > 0 ? p.frameBegin[first] : 0;
+	std::vector<LaneEvent> events(p.startup);
+	std::vector<TraceBuffer*> buffers;
+	{
+		std::lock_guard<std::mutex> guard(p.traceLock);
+		buffers = p.buffers;
+	}
+	for (auto buffer : buffers)
+		collect(buffer, since, events);
+	FILE* f = fopen(path, "w");
+	if (!f)
+		return false;
+	double usPerTick = 1000.0 / p.ticksPerMs;
+	uint64_t base = p.calibrationTicks;
+	int mainLane = traceHandle.get()->lane;
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	bool comma = false;
+	for (auto buffer : buffers)
+	{
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", comma ? ",\n" : "", buffer->lane);
+		writeString(f, buffer->name);
+		fprintf(f, "}}");
+		comma = true;
+	}
+	for (int i = 0; i < frames && p.frames > 0; i++)
+	{
+		int k = (first + i) % PROFILE_HISTORY;
+		fprintf(f, ",\n{\"name\":\"Frame\",\"cat\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+			mainLane, (p.frameBegin[k] - base) * usPerTick, p.frameTicks[k] * usPerTick);
+	}
+	for (auto& e : events)
+	{
+		if (e.event.start < base)
+			continue;
+		fprintf(f, ",\n{\"name\":");
+		writeString(f, p.names[e.event.scope]);
+		fprintf(f, ",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+			e.lane, (e.event.start - base) * usPerTick, (e.event.end - e.event.start) * usPerTick);
+	}
+	fprintf(f, "\n]}\n");
+	return fclose(f) == 0;
+}
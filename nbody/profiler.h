@@ -0,0 +1,108 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define PROFILE_RDTSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_RDTSC 1
+#endif
+
+//Scoped timers. Define PROFILE=0 in the preprocessor definitions to compile them out,
+//PROFILE_SCOPE then expands to nothing.
+#ifndef PROFILE
+#define PROFILE 1
+#endif
+
+const int PROFILE_MAX_SCOPES = 64;
+//Frames kept for the statistics
+const int PROFILE_HISTORY = 512;
+//Trace events kept per thread
+const int PROFILE_TRACE_EVENTS = 1 << 16;
+
+//Time stamp counter, or nanoseconds where there is none
+inline uint64_t profileTicks()
+{
+#ifdef PROFILE_RDTSC
+	return __rdtsc();
+#else
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+//Register a scope, returns its id. Called once per scope through a function-local static.
+int profileScope(const char* name);
+//Add ticks to a scope in the current frame, safe from any thread
+void profileAdd(int scope, uint64_t ticks);
+//Record a finished scope in the trace ring of the calling thread
+void profileEvent(int scope, uint64_t start, uint64_t end);
+//Name the calling thread in traces, e.g. "main" or "trajectory writer"
+void profileThreadName(const char* name);
+
+class ScopedTimer
+{
+public:
+	explicit ScopedTimer(int id)
+		: scope(id)
+		, start(profileTicks())
+	{
+	}
+	~ScopedTimer()
+	{
+		uint64_t end = profileTicks();
+		profileAdd(scope, end - start);
+		profileEvent(scope, start, end);
+	}
+private:
+	int scope;
+	uint64_t start;
+};
+
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#if PROFILE
+#define PROFILE_SCOPE(name) \
+	static const int PROFILE_CONCAT(profileId, __LINE__) = profileScope(name); \
+	ScopedTimer PROFILE_CONCAT(profileTimer, __LINE__)(PROFILE_CONCAT(profileId, __LINE__))
+//Begin and end of a section that isn't a block of its own, id names the section
+#define PROFILE_BEGIN(id, name) \
+	static const int id##Scope = profileScope(name); \
+	uint64_t id##Start = profileTicks()
+#define PROFILE_END(id) \
+	do \
+	{ \
+		uint64_t id##End = profileTicks(); \
+		profileAdd(id##Scope, id##End - id##Start); \
+		profileEvent(id##Scope, id##Start, id##End); \
+	} while (0)
+#else
+#define PROFILE_SCOPE(name)
+#define PROFILE_BEGIN(id, name)
+#define PROFILE_END(id)
+#endif
+
+//Simulation work done in the current frame
+void profileSteps(uint64_t steps, double interactions);
+//Close the frame: per-frame sums go into the history. The first call closes startup.
+void profileFrame();
+
+//Per-scope time per frame over the history, ms
+struct ScopeStats
+{
+	const char* name;
+	double mean;
+	double p50;
+	double p99;
+};
+
+//Statistics of every registered scope, returns the number written to out
+int profileStats(ScopeStats* out, int max);
+//Frame times in ms, oldest first; returns the count
+int profileFrameTimes(float* out, int max);
+//Steps and interactions per second over the history
+void profileRates(double& stepsPerSecond, double& interactionsPerSecond);
+//Write the trace of the last frames (at most PROFILE_HISTORY) as Chrome trace-event JSON,
+//for chrome://tracing or Perfetto. Startup, everything before the first frame, is always included.
+bool profileExportTrace(const char* path, int frames);
@@ -0,0 +1,160 @@
+#include <algorithm>
+#include "render.h"
+#include "profiler.h"
+
+namespace
+{
+	//Instance attributes not known to be set up for any offset
+	const size_t UNKNOWN_OFFSET = (size_t)-1;
+}
+
+DrawItem::DrawItem(RenderPass pass, GLuint program, GLuint vao, GLuint texture, uint32_t flags, GLenum mode)
+	: pass(pass)
+	, program(program)
+	, vao(vao)
+	, texture(texture)
+	, textureTarget(GL_TEXTURE_2D)
+	, flags(flags)
+	, mode(mode)
+	, first(0)
+	, count(0)
+	, indexed(false)
+	, instances(0)
+	, instanceBuffer(0)
+	, instanceAttrib(0)
+	, instanceVec4s(0)
+	, instanceOffset(0)
+	, firsts(NULL)
+	, counts(NULL)
+	, draws(0)
+	, fence(NULL)
+	, key(0)
+{
+}
+
+RenderQueue::RenderQueue()
+	: program(0)
+	, vao(0)
+	, texture(0)
+	, flags(0)
+	, instanceOffset(UNKNOWN_OFFSET)
+{
+	last.items = last.draws = last.programs = last.vaos = last.textures = last.states = 0;
+}
+
+void RenderQueue::begin()
+{
+	items.clear();
+}
+
+void RenderQueue::add(const DrawItem& item)
+{
+	items.push_back(item);
+	//GL names are small, a field each is enough to group equal ones; the queueing order
+	//keeps items of the same state as the renderers issued them
+	DrawItem& d = items.back();
+	d.key = (uint64_t)d.pass << 60 | (uint64_t)(d.program & 0xfff) << 48 | (uint64_t)(d.texture & 0xffff) << 32 |
+		(uint64_t)(d.flags & 0xff) << 24 | (uint64_t)(items.size() & 0xffffff);
+}
+
+void RenderQueue::setFlags(uint32_t wanted)
+{
+	uint32_t changed = flags ^ wanted;
+	if (changed & RENDER_CULL_BACK)
+	{
+		if (wanted & RENDER_CULL_BACK)
+			glEnable(GL_CULL_FACE);
+		else
+			glDisable(GL_CULL_FACE);
+		last.states++;
+	}
+	if (changed & RENDER_NO_DEPTH_WRITE)
+	{
+		glDepthMask(wanted & RENDER_NO_DEPTH_WRITE ? GL_FALSE : GL_TRUE);
+		last.states++;
+	}
+	if (changed & RENDER_BLEND_ADD)
+	{
+		if (wanted & RENDER_BLEND_ADD)
+			glBlendFunc(GL_ONE, GL_ONE);
+		else
+			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		last.states++;
+	}
+	if (changed & RENDER_POINT_SIZE)
+	{
+		if (wanted & RENDER_POINT_SIZE)
+			glEnable(GL_PROGRAM_POINT_SIZE);
+		else
+			glDisable(GL_PROGRAM_POINT_SIZE);
+		last.states++;
+	}
+	flags = wanted;
+}
+
+void RenderQueue::submit()
+{
+	PROFILE_SCOPE("RenderQueue::submit");
+	last.items = items.size();
+	last.draws = last.programs = last.vaos = last.textures = last.states = 0;
+	std::sort(items.begin(), items.end(), [](const DrawItem& a, const DrawItem& b) { return a.key < b.key; });
+	//Nothing is assumed bound between frames, the default state is
+	program = vao = texture = 0;
+	flags = 0;
+	instanceOffset = UNKNOWN_OFFSET;
+	glCullFace(GL_BACK);
+	glActiveTexture(GL_TEXTURE0);
+	for (const DrawItem& d : items)
+	{
+		if (d.program != program)
+		{
+			glUseProgram(d.program);
+			program = d.program;
+			last.programs++;
+		}
+		if (d.vao != vao)
+		{
+			glBindVertexArray(d.vao);
+			vao = d.vao;
+			instanceOffset = UNKNOWN_OFFSET;
+			last.vaos++;
+		}
+		if (d.texture && d.texture != texture)
+		{
+			glBindTexture(d.textureTarget, d.texture);
+			texture = d.texture;
+			last.textures++;
+		}
+		if (d.flags != flags)
+			setFlags(d.flags);
+		//Without a base instance in GL 3.3 a range of instances starts at its attributes
+		if (d.instanceVec4s > 0 && d.instanceOffset != instanceOffset)
+		{
+			GLsizei stride = d.instanceVec4s * 4 * sizeof(float);
+			glBindBuffer(GL_ARRAY_BUFFER, d.instanceBuffer);
+			for (GLsizei a = 0; a < d.instanceVec4s; a++)
+				glVertexAttribPointer(d.instanceAttrib + a, 4, GL_FLOAT, GL_FALSE, stride, (const GLvoid*)(d.instanceOffset + a * 4 * sizeof(float)));
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			instanceOffset = d.instanceOffset;
+			last.states++;
+		}
+		if (d.firsts)
+			glMultiDrawArrays(d.mode, d.firsts, d.counts, d.draws);
+		else if (d.indexed)
+			glDrawElementsInstanced(d.mode, d.count, GL_UNSIGNED_INT, (const GLvoid*)(d.first * sizeof(uint32_t)), d.instances);
+		else if (d.instances > 0)
+			glDrawArraysInstanced(d.mode, d.first, d.count, d.instances);
+		else
+			glDrawArrays(d.mode, d.first, d.count);
+		last.draws++;
+		if (d.fence)
+		{
+			if (*d.fence)
+				glDeleteSync(*d.fence);
+			*d.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		}
+	}
+	setFlags(0);
+	glBindVertexArray(0);
+	glUseProgram(0);
+}
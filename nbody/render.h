@@ -0,0 +1,112 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <glew.h>
+
+//The draws of a frame, collected from all renderers and issued in one place. Each item names
+//the program, vertex array, texture and fixed-function state it needs; submit() sorts them
+//by pass, program, texture and state and changes only what differs from the item before,
+//so the renderers don't set up and tear down state around every draw.
+//
+//Uniforms are program state and not part of an item: a renderer sets them while queueing,
+//the same for all its items of a program in a frame. Buffers an item reads must not be
+//orphaned or rewritten before submit().
+
+//Passes in the order they are drawn
+enum RenderPass
+{
+	//Everything writing depth: bodies, impostors, trails and orbits
+	RENDER_OPAQUE,
+	//The sky where nothing was drawn
+	RENDER_SKY,
+	//Additive sprites, tested against the depth of the rest
+	RENDER_ADDITIVE,
+	RENDER_PASS_COUNT
+};
+
+//Fixed-function state; without flags depth is written, no face is culled and blending is
+//by source alpha
+enum RenderFlag
+{
+	RENDER_CULL_BACK = 1,
+	RENDER_NO_DEPTH_WRITE = 2,
+	RENDER_BLEND_ADD = 4,
+	RENDER_POINT_SIZE = 8,
+};
+
+struct DrawItem
+{
+	DrawItem(RenderPass pass, GLuint program, GLuint vao, GLuint texture, uint32_t flags, GLenum mode);
+
+	RenderPass pass;
+	GLuint program;
+	GLuint vao;
+	//Bound to unit 0 as textureTarget, GL_TEXTURE_2D unless set; 0 - the item samples no texture
+	GLuint texture;
+	GLenum textureTarget;
+	//RenderFlag bits
+	uint32_t flags;
+	GLenum mode;
+	//Vertices first to first + count, or count 32-bit indices from index first
+	GLint first;
+	GLsizei count;
+	bool indexed;
+	//Instances, 0 - not instanced
+	GLsizei instances;
+	//Per-instance vec4 attributes from instanceAttrib on, instanceVec4s of them back to back
+	//from byte instanceOffset of instanceBuffer; 0 vec4s - as set up in the vertex array
+	GLuint instanceBuffer;
+	GLuint instanceAttrib;
+	GLsizei instanceVec4s;
+	size_t instanceOffset;
+	//glMultiDrawArrays of draws ranges instead of first and count, the arrays kept by the
+	//renderer until submit()
+	const GLint* firsts;
+	const GLsizei* counts;
+	GLsizei draws;
+	//Set to a fence after the item is drawn, if not null
+	GLsync* fence;
+	//Pass, program, texture, state and the order of queueing
+	uint64_t key;
+};
+
+//Last submit()
+struct RenderStats
+{
+	size_t items;
+	//GL draw calls, a multi-draw counted once
+	size_t draws;
+	//Bindings and state calls of the submit
+	size_t programs;
+	size_t vaos;
+	size_t textures;
+	size_t states;
+};
+
+class RenderQueue
+{
+public:
+	RenderQueue();
+	//Start collecting the items of a frame
+	void begin();
+	void add(const DrawItem& item);
+	//Sort and draw the items, leaving no program or vertex array bound and the default state
+	void submit();
+	const RenderStats& stats() const
+	{
+		return last;
+	}
+
+private:
+	void setFlags(uint32_t wanted);
+
+	std::vector<DrawItem> items;
+	//What is bound, valid during submit()
+	GLuint program;
+	GLuint vao;
+	GLuint texture;
+	uint32_t flags;
+	size_t instanceOffset;
+	RenderStats last;
+};
@@ -0,0 +1,256 @@
+#include <cmath>
+#include <algorithm>
+#include "scenario.h"
+#include "ingest.h"
+#include "parallel.h"
+#include "profiler.h"
+
+static const double PI = 3.14159265358979323846;
+//Gravity constant, for masses
+static const double G_SI = 6.673e-11;
+static const double GM_JUPITER = 1.26686534e17;
+
+//splitmix64 finalizer
+static uint64_t mix(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+//Random stream of one body: draw k of body i, uniform in (0, 1)
+struct Stream
+{
+	uint64_t key;
+	uint64_t k;
+	Stream(uint64_t seed, uint64_t body)
+		: key(mix(seed) ^ mix(body * 0x632be59bd9b4e019ULL + 1))
+		, k(0)
+	{
+	}
+	double next()
+	{
+		return ((mix(key + k++) >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+	}
+	//Approximately normal, sum of four uniforms
+	double normal()
+	{
+		return (next() + next() + next() + next() - 2.0) * 1.7320508075688772;
+	}
+};
+
+//Random unit vector scaled by length
+static void isotropic(Stream& r, double length, double& x, double& y, double& z)
+{
+	double cz = 1.0 - 2.0 * r.next();
+	double phi = 2.0 * PI * r.next();
+	double sz = std::sqrt(std::max(0.0, 1.0 - cz * cz));
+	x = length * sz * std::cos(phi);
+	y = length * sz * std::sin(phi);
+	z = length * cz;
+}
+
+static void setBody(State& s, size_t i, double x, double y, double z, double vx, double vy, double vz, double gm)
+{
+	s.px[i] = x; s.py[i] = y; s.pz[i] = z;
+	s.vx[i] = vx; s.vy[i] = vy; s.vz[i] = vz;
+	s.gm[i] = gm;
+	s.mass[i] = gm / G_SI;
+}
+
+//Plummer sphere of scale radius a and total gm (Aarseth, Henon & Wielen 1974)
+static void plummer(State& s, size_t n, uint64_t seed, double a, double gm)
+{
+	double vScale = std::sqrt(gm / a);
+	parallelFor(n, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; i++)
+		{
+			Stream r(seed, i);
+			double radius;
+			//Cut the tail at 20 scale radii
+			do
+			{
+				radius = 1.0 / std::sqrt(std::pow(r.next(), -2.0 / 3.0) - 1.0);
+			} while (radius > 20.0);
+			double q, g;
+			do
+			{
+				q = r.next();
+				g = 0.1 * r.next();
+			} while (g > q * q * std::pow(1.0 - q * q, 3.5));
+			double speed = q * std::sqrt(2.0) * std::pow(1.0 + radius * radius, -0.25);
+			double x, y, z, vx, vy, vz;
+			isotropic(r, radius * a, x, y, z);
+			isotropic(r, speed * vScale, vx, vy, vz);
+			setBody(s, i, x, y, z, vx, vy, vz, gm / n);
+		}
+	});
+}
+
+//Exponential disk of scale length rd around a central mass, bodies [first, first + n) of s,
+//centred on the origin in the xy plane. The central mass is the first body.
+static void disk(State& s, size_t first, size_t n, uint64_t seed, double rd, double centralGm, double diskGm)
+{
+	if (n == 0)
+		return;
+	setBody(s, first, 0, 0, 0, 0, 0, 0, centralGm);
+	parallelFor(n - 1, [&](size_t begin, size_t end)
+	{
+		for (size_t k = begin; k < end; k++)
+		{
+			size_t i = first + 1 + k;
+			Stream r(seed, i);
+			double R;
+			//Surface density exp(-R/rd): R is Gamma(2) distributed, truncated at 8 rd
+			do
+			{
+				R = -rd * std::log(r.next() * r.next());
+			} while (R > 8.0 * rd);
+			double phi = 2.0 * PI * r.next();
+			double x = R / rd;
+			double enclosed = centralGm + diskGm * (1.0 - (1.0 + x) * std::exp(-x));
+			double vc = std::sqrt(enclosed / R);
+			//Thin and slightly warm
+			double z = 0.05 * rd * r.normal();
+			double dispersion = 0.05 * vc;
+			double vr = dispersion * r.normal();
+			double vt = vc + dispersion * r.normal();
+			double c = std::cos(phi), sn = std::sin(phi);
+			setBody(s, i, R * c, R * sn, z,
+				vr * c - vt * sn, vr * sn + vt * c, dispersion * 0.5 * r.normal(), diskGm / (n - 1));
+		}
+	});
+}
+
+ScenarioSettings generateScenario(ScenarioType type, size_t n, uint64_t seed, State& s)
+{
+	PROFILE_SCOPE("generateScenario");
+	s.resize(n);
+	s.day = 1.0;
+	s.seed = seed;
+	ScenarioSettings settings = { 0.0, 86400.0f };
+	switch (type)
+	{
+	case SCENARIO_PLUMMER:
+	{
+		double a = 10.0 * AU_M;
+		plummer(s, n, seed, a, GM_SUN);
+		settings.softening = 0.02 * a;
+		//Thousandth of the crossing time
+		settings.step = (float)std::min(86400.0, 1e-3 * a / std::sqrt(GM_SUN / a));
+		break;
+	}
+	case SCENARIO_DISK:
+	{
+		double rd = 10.0 * AU_M;
+		disk(s, 0, n, seed, rd, GM_SUN, 0.2 * GM_SUN);
+		settings.softening = 0.02 * rd;
+		break;
+	}
+	case SCENARIO_COLLISION:
+	{
+		double rd = 8.0 * AU_M;
+		size_t half = n / 2;
+		disk(s, 0, half, seed, rd, GM_SUN, 0.2 * GM_SUN);
+		disk(s, half, n - half, seed, rd, GM_SUN, 0.2 * GM_SUN);
+		//Head on with an impact parameter, the second disk tilted by 60 degrees
+		double offsetX = 5.0 * rd, offsetY = 1.0 * rd;
+		double speed = 0.5 * std::sqrt(2.4 * GM_SUN / (2.0 * offsetX));
+		double ct = std::cos(PI / 3.0), st = std::sin(PI / 3.0);
+		parallelFor(n, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				if (i < half)
+				{
+					s.px[i] -= offsetX; s.py[i] -= offsetY;
+					s.vx[i] += speed;
+				}
+				else
+				{
+					double y = s.py[i], z = s.pz[i];
+					s.py[i] = y * ct - z * st; s.pz[i] = y * st + z * ct;
+					double vy = s.vy[i], vz = s.vz[i];
+					s.vy[i] = vy * ct - vz * st; s.vz[i] = vy * st + vz * ct;
+					s.px[i] += offsetX; s.py[i] += offsetY;
+					s.vx[i] -= speed;
+				}
+			}
+		});
+		settings.softening = 0.02 * rd;
+		break;
+	}
+	case SCENARIO_COLLAPSE:
+	{
+		double radius = 30.0 * AU_M;
+		parallelFor(n, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				Stream r(seed, i);
+				double x, y, z;
+				isotropic(r, radius * std::cbrt(r.next()), x, y, z);
+				setBody(s, i, x, y, z, 0, 0, 0, GM_SUN / n);
+			}
+		});
+		settings.softening = 0.01 * radius;
+		break;
+	}
+	case SCENARIO_BELT:
+	default:
+	{
+		if (n < 2)
+		{
+			s.resize(2);
+			n = 2;
+		}
+		setBody(s, 0, 0, 0, 0, 0, 0, 0, GM_SUN);
+		double jupiterA = 5.2026 * AU_M;
+		double jupiterV = std::sqrt(GM_SUN / jupiterA);
+		setBody(s, 1, jupiterA, 0, 0, 0, jupiterV, 0, GM_JUPITER);
+		size_t count = n - 2;
+		std::vector<double> a(count), e(count), incl(count), node(count), peri(count), M(count);
+		parallelFor(count, [&](size_t begin, size_t end)
+		{
+			for (size_t k = begin; k < end; k++)
+			{
+				Stream r(seed, k + 2);
+				a[k] = (2.1 + 1.2 * r.next()) * AU_M;
+				e[k] = 0.3 * r.next() * r.next();
+				incl[k] = 20.0 * PI / 180.0 * r.next() * r.next();
+				node[k] = 2.0 * PI * r.next();
+				peri[k] = 2.0 * PI * r.next();
+				M[k] = 2.0 * PI * r.next();
+			}
+			//Pointer arithmetic, the block is empty and the columns hold just the Sun and Jupiter for n 2
+			elementsToState(end - begin, a.data() + begin, e.data() + begin, incl.data() + begin, node.data() + begin,
+				peri.data() + begin, M.data() + begin, GM_SUN, s.px.data() + begin + 2, s.py.data() + begin + 2,
+				s.pz.data() + begin + 2, s.vx.data() + begin + 2, s.vy.data() + begin + 2, s.vz.data() + begin + 2);
+			for (size_t k = begin; k < end; k++)
+			{
+				s.gm[k + 2] = 0.0;
+				s.mass[k + 2] = 0.0;
+			}
+		});
+		break;
+	}
+	}
+	s.softening = settings.softening;
+	s.generated = true;
+	return settings;
+}
+
+const char* scenarioName(ScenarioType type)
+{
+	static const char* names[SCENARIO_COUNT] =
+	{
+		"Сфера Пламмера",
+		"Экспоненциальный диск",
+		"Столкновение галактик",
+		"Холодный коллапс",
+		"Пояс астероидов",
+	};
+	return type < SCENARIO_COUNT ? names[type] : "";
+}
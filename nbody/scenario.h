@@ -0,0 +1,37 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include "state.h"
+
+//Procedural scenarios, the standard workloads for performance comparisons.
+//Sizes are tens of AU and the total mass about one solar mass, so they fit the viewer.
+enum ScenarioType
+{
+	//Plummer sphere in equilibrium
+	SCENARIO_PLUMMER = 0,
+	//Exponential disk around a central mass
+	SCENARIO_DISK = 1,
+	//Two disks on a collision course
+	SCENARIO_COLLISION = 2,
+	//Cold uniform sphere, zero velocities
+	SCENARIO_COLLAPSE = 3,
+	//Sun, Jupiter and massless asteroids between 2.1 and 3.3 AU
+	SCENARIO_BELT = 4,
+	SCENARIO_COUNT
+};
+
+//Integration settings a generated scenario is meant to run with
+struct ScenarioSettings
+{
+	//Plummer softening length, m
+	double softening;
+	//Time step, s
+	float step;
+};
+
+//Fill s with n bodies of the scenario. Every body draws from its own counter-based
+//random stream, so the result depends on seed only, not on the thread count.
+ScenarioSettings generateScenario(ScenarioType type, size_t n, uint64_t seed, State& s);
+
+//Scenario name for the UI
+const char* scenarioName(ScenarioType type);
@@ -0,0 +1,58 @@
+#include <cstdio>
+#include "shader.h"
+#include "frame.h"
+
+static GLuint compileShader(const char* name, GLenum type, const char* source)
+{
+	GLuint shader = glCreateShader(type);
+	glShaderSource(shader, 1, &source, NULL);
+	glCompileShader(shader);
+	GLint compiled = GL_FALSE;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+	if (compiled != GL_TRUE)
+	{
+		char log[1024];
+		glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+		fprintf(stderr, "Unable to compile the %s shader of %s:\n%s\n", type == GL_VERTEX_SHADER ? "vertex" : "fragment", name, log);
+		glDeleteShader(shader);
+		return 0;
+	}
+	return shader;
+}
+
+GLuint compileProgram(const char* name, const char* vertexSource, const char* fragmentSource)
+{
+	GLuint vertex = compileShader(name, GL_VERTEX_SHADER, vertexSource);
+	if (!vertex)
+		return 0;
+	GLuint fragment = compileShader(name, GL_FRAGMENT_SHADER, fragmentSource);
+	if (!fragment)
+	{
+		glDeleteShader(vertex);
+		return 0;
+	}
+	GLuint program = glCreateProgram();
+	glAttachShader(program, vertex);
+	glAttachShader(program, fragment);
+	glLinkProgram(program);
+	//The program keeps the compiled code
+	glDetachShader(program, vertex);
+	glDetachShader(program, fragment);
+	glDeleteShader(vertex);
+	glDeleteShader(fragment);
+	GLint linked = GL_FALSE;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if (linked != GL_TRUE)
+	{
+		char log[1024];
+		glGetProgramInfoLog(program, sizeof(log), NULL, log);
+		fprintf(stderr, "Unable to link %s:\n%s\n", name, log);
+		glDeleteProgram(program);
+		return 0;
+	}
+	//The camera and the light of the frame
+	GLuint frame = glGetUniformBlockIndex(program, "Frame");
+	if (frame != GL_INVALID_INDEX)
+		glUniformBlockBinding(program, frame, FRAME_BINDING);
+	return program;
+}
@@ -0,0 +1,7 @@
+#pragma once
+#include <glew.h>
+
+//Compile and link a program from GLSL sources, its Frame block (frame.h) bound to
+//FRAME_BINDING. On failure the info log goes to stderr with name, nothing is leaked and
+//0 is returned.
+GLuint compileProgram(const char* name, const char* vertexSource, const char* fragmentSource);
@@ -0,0 +1,85 @@
+#include "sky.h"
+#include "shader.h"
+#include "frame.h"
+
+namespace
+{
+	const char* SKY_VERTEX_SHADER =
+		"#version 330\n"
+		"out vec2 Frag_Position;\n"
+		"void main()\n"
+		"{\n"
+		"	Frag_Position = vec2(gl_VertexID == 1 ? 3.0 : -1.0, gl_VertexID == 2 ? 3.0 : -1.0);\n"
+		"	gl_Position = vec4(Frag_Position, 0.0, 1.0);\n"
+		"}\n";
+
+	//Pixels whose ray misses the sphere or leaves it beyond the far plane stay clear
+	const char* SKY_FRAGMENT_SHADER =
+		"#version 330\n"
+		FRAME_BLOCK
+		"uniform float Radius;\n"
+		"uniform sampler2D Texture;\n"
+		"in vec2 Frag_Position;\n"
+		"out vec4 Out_Color;\n"
+		"const float PI = 3.14159265;\n"
+		"void main()\n"
+		"{\n"
+		"	vec4 near = InverseViewProjection * vec4(Frag_Position, -1.0, 1.0);\n"
+		"	vec4 far = InverseViewProjection * vec4(Frag_Position, 1.0, 1.0);\n"
+		"	vec3 ray = normalize(far.xyz / far.w - near.xyz / near.w);\n"
+		"	float b = dot(Eye.xyz, ray);\n"
+		"	float h = b * b - dot(Eye.xyz, Eye.xyz) + Radius * Radius;\n"
+		"	if (h < 0.0)\n"
+		"		discard;\n"
+		"	float t = -b + sqrt(h);\n"
+		"	if (t <= 0.0)\n"
+		"		discard;\n"
+		"	vec3 hit = Eye.xyz + t * ray;\n"
+		"	vec4 clip = Projection * View * vec4(hit, 1.0);\n"
+		"	float depth = clip.z / clip.w;\n"
+		"	if (depth > 1.0)\n"
+		"		discard;\n"
+		"	gl_FragDepth = depth * 0.5 + 0.5;\n"
+		"	vec3 n = hit / Radius;\n"
+		"	vec2 around = dot(n.xy, n.xy) > 1e-12 ? n.xy : vec2(0.0, 1.0);\n"
+		"	vec2 uv = vec2(fract(atan(-around.x, around.y) / (2.0 * PI)), 1.0 - acos(clamp(n.z, -1.0, 1.0)) / PI);\n"
+		"	Out_Color = vec4(texture(Texture, uv).rgb, 1.0);\n"
+		"}\n";
+}
+
+SkyRenderer::SkyRenderer()
+	: program(0)
+	, vao(0)
+{
+}
+
+bool SkyRenderer::init()
+{
+	program = compileProgram("SkyRenderer", SKY_VERTEX_SHADER, SKY_FRAGMENT_SHADER);
+	if (!program)
+		return false;
+	glUseProgram(program);
+	glUniform1f(glGetUniformLocation(program, "Radius"), SKY_RADIUS);
+	glUniform1i(glGetUniformLocation(program, "Texture"), 0);
+	glUseProgram(0);
+	glGenVertexArrays(1, &vao);
+	return glGetError() == GL_NO_ERROR;
+}
+
+void SkyRenderer::release()
+{
+	if (program)
+		glDeleteProgram(program);
+	if (vao)
+		glDeleteVertexArrays(1, &vao);
+	program = vao = 0;
+}
+
+void SkyRenderer::draw(GLuint texture, RenderQueue& queue)
+{
+	if (!program)
+		return;
+	DrawItem item(RENDER_SKY, program, vao, texture, 0, GL_TRIANGLES);
+	item.count = 3;
+	queue.add(item);
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <glew.h>
+#include "render.h"
+
+//The star sphere around the origin, traced per pixel instead of tessellated. One triangle
+//covers the screen; the ray of each pixel through the frame block's inverse view-projection
+//leaves the sphere at its far intersection, which gives the depth and gluSphere's texture
+//coordinates, so the sky hides behind the bodies as the textured sphere did.
+
+//Radius of the sphere in render units
+const float SKY_RADIUS = 6000.f;
+
+class SkyRenderer
+{
+public:
+	SkyRenderer();
+	//Needs a current GL 3.3 context
+	bool init();
+	void release();
+	//Queue the sky with its texture
+	void draw(GLuint texture, RenderQueue& queue);
+
+private:
+	GLuint program;
+	//Empty, the vertices come from gl_VertexID
+	GLuint vao;
+};
@@ -0,0 +1,75 @@
+#include "solar.h"
+
+const BodyData SOLAR_SYSTEM[SOLAR_BODIES] =
+{
+	{ 0, "Sun", "Солнце",
+		{ 4.321102017786880E5, 7.332029220261886E5, -2.173368199099370E4 },
+		{ -7.189825590990792E-3, 1.078719625403305E-2, 1.611861005709897E-4 },
+		1.98892e30, 1.327124400189e20, 695700 * 0.07, 0.0f, 0 },
+	{ 1, "Mercury", "Меркурий",
+		{ 4.827977920456001E7, -3.593848175336351E7, -7.407821383784354E6 },
+		{ 2.001998825524805E1, 4.093878958529241E1, 1.507185201945884E0 },
+		0.33011e24, 2.20329e13, 2439.7, 0.1f, 88 },
+	{ 2, "Venus", "Венера",
+		{ 3.081230776389965E7, -1.037662195648798E8, -3.208271884613059E6 },
+		{ 3.338454368178189E1, 9.667951253108880E0, -1.794288490452711E0 },
+		4.8685e24, 3.248599e14, 6051.8, 177.36f, 224 },
+	{ 3, "Earth", "Земля",
+		{ -5.969534792469550E7, -1.384328330091216E8, -1.539442552493513E4 },
+		{ 2.686684747512509E1, -1.191462405401140E1, -1.789306645543220E-4 },
+		5.97219e24, 3.9860044189e14, 6378.1, 23.45f, 365 },
+	{ 4, "Mars", "Марс",
+		{ -2.457432353017395E7, 2.363419494094334E8, 5.529273093965277E6 },
+		{ -2.318343075686108E1, -4.864803362557868E-1, 5.585276593733890E-1 },
+		6.4185e23, 4.2828372e13, 3396.2, 25.19f, 687 },
+	{ 5, "Jupiter", "Юпитер",
+		{ -7.569735834852062E8, -3.021406720368661E8, 1.818386330099623E7 },
+		{ 4.691818986427708E0, -1.151682040045604E1, -5.715174720721627E-2 },
+		1898.19e24, 1.266865349e17, 71499, 3.13f, 4332 },
+	{ 6, "Saturn", "Сатурн",
+		{ -1.644374719486625E8, -1.494399735641233E9, 3.252789329873234E7 },
+		{ 9.071782458885481E0, -1.088556624490897E0, -3.415607795777443E-1 },
+		568.34e24, 3.79311879e16, 60268, 26.73f, 10759 },
+	{ 7, "Uranus", "Уран",
+		{ 2.708324010627307E9, 1.246406855535664E9, -3.045762012091076E7 },
+		{ -2.896814088567216E0, 5.868838238458174E0, 5.925130485071195E-2 },
+		86.8103e24, 5.7939399e15, 24973, 97.77f, 30685 },
+	{ 8, "Neptune", "Нептун",
+		{ 4.260892227618985E9, -1.383625744199709E9, -6.970338029718751E7 },
+		{ 1.643322631738114E0, 5.202138396781843E0, -1.453302666708880E-1 },
+		102.41e24, 6.8365299e15, 24342, 28.32f, 60189 },
+	{ 9, "Pluto", "Плутон",
+		{ 1.512995164271581E9, -4.750856430852462E9, 7.072265548052478E7 },
+		{ 5.291385672638518E0, 5.025608122645461E-1, -1.605961044129924E0 },
+		0.01303e24, 8.719e11, 2187, 122.53f, 90560 },
+	{ 10, "Ceres", "Церера",
+		{ 1.171404652999866E8, 3.898786439553194E8, -9.285654429283202E6 },
+		{ -1.749907309328118E1, 3.939248912132300E0, 3.348447503365496E0 },
+		939300e15, 0.626284e11, 469.7 * 15, 4, 1679 },
+	{ 11, "Pallas", "Паллада",
+		{ 4.291592316654775E8, 4.130737867650583E7, -6.396862972703221E7 },
+		{ -6.437734248047895E0, 1.322396929216813E1, -8.591155928319642E0 },
+		205000e15, 0.143e11, 272.5 * 15, 84, 1683 },
+	{ 12, "Juno", "Юнона",
+		{ 3.857026210081980E7, -4.565575631972048E+08, 1.022702769186957E8 },
+		{ 1.466155363544588E1, 3.856604107629098E0, -1.468972870833428E0 },
+		20000e15, 20000e15*G, 123.298 * 15, 50, 1591 },
+	{ 13, "Vesta", "Веста",
+		{ -3.096651822378528E8, 1.773993080224814E8, 3.240229550527219E7 },
+		{ -7.810311925207990E0, -1.736557473811398E1, 1.470044682760689E0 },
+		259000e15, 0.178e11, 262.7 * 15, 29, 1325 }
+};
+
+void solarSystem(State& s)
+{
+	s.resize(SOLAR_BODIES);
+	for (size_t i = 0; i < SOLAR_BODIES; i++)
+	{
+		const BodyData& b = SOLAR_SYSTEM[i];
+		s.px[i] = b.p[0] * 1000.0; s.py[i] = b.p[1] * 1000.0; s.pz[i] = b.p[2] * 1000.0;
+		s.vx[i] = b.v[0] * 1000.0; s.vy[i] = b.v[1] * 1000.0; s.vz[i] = b.v[2] * 1000.0;
+		s.gm[i] = b.GM;
+		s.mass[i] = b.mass;
+	}
+	s.day = 1.0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include "state.h"
+
+//Gravity constant
+const double G = 6.673e-11;
+
+//Initial data of a Solar System body, positions and velocities in km and km/s
+struct BodyData
+{
+	short id;
+	const char* name;
+	const char* ruName;
+	double p[3];
+	double v[3];
+	//Mass, kg
+	double mass;
+	//Gravitational parameter, m^3/s^2
+	double GM;
+	//Drawn radius, km
+	double rad;
+	//Axial tilt, degrees
+	float tilt;
+	//Orbital period, days
+	int days;
+};
+
+const size_t SOLAR_BODIES = 14;
+//The Sun, the planets, Pluto and the four largest asteroids
+extern const BodyData SOLAR_SYSTEM[SOLAR_BODIES];
+
+//Fill s with the bundled Solar System in SI units, the state the viewer starts from
+void solarSystem(State& s);
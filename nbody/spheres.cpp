@@ -0,0 +1,418 @@
+#include <cmath>
+#include <map>
+#include <algorithm>
+#include "spheres.h"
+#include "shader.h"
+#include "frame.h"
+#include "profiler.h"
+
+namespace
+{
+	//Subdivisions of the icosphere levels, finest first
+	const int SUBDIVISIONS[SPHERE_IMPOSTOR] = { 5, 4, 3, 2, 1 };
+	//Smallest projected radius in pixels of every level; the silhouette of each stays
+	//within 0.2 px of the true circle down to it
+	const float LOD_PIXELS[SPHERE_LODS] = { 160.f, 48.f, 14.f, 5.f, 1.5f, 0.f };
+	//Relative margin around the thresholds before the level changes
+	const float HYSTERESIS = 0.15f;
+	const uint8_t UNSEEN = 0xff;
+	const size_t INITIAL_INSTANCES = 256;
+
+	//The frame block and the body orientation: glRotatef(tilt, 0, 1, 0), then
+	//glRotatef(rotation, 0, 0, 1) applied to the vertex first
+#define SPHERE_COMMON \
+		FRAME_BLOCK \
+		"const float PI = 3.14159265;\n" \
+		"vec3 rotateBody(vec3 p, vec2 angles)\n" \
+		"{\n" \
+		"	float r = radians(angles.y);\n" \
+		"	float t = radians(angles.x);\n" \
+		"	p = vec3(cos(r) * p.x - sin(r) * p.y, sin(r) * p.x + cos(r) * p.y, p.z);\n" \
+		"	return vec3(cos(t) * p.x + sin(t) * p.z, p.y, -sin(t) * p.x + cos(t) * p.z);\n" \
+		"}\n" \
+		"vec3 unrotateBody(vec3 p, vec2 angles)\n" \
+		"{\n" \
+		"	float r = radians(angles.y);\n" \
+		"	float t = radians(angles.x);\n" \
+		"	p = vec3(cos(t) * p.x - sin(t) * p.z, p.y, sin(t) * p.x + cos(t) * p.z);\n" \
+		"	return vec3(cos(r) * p.x + sin(r) * p.y, -sin(r) * p.x + cos(r) * p.y, p.z);\n" \
+		"}\n"
+
+	//gluSphere's texture layout (s around the z axis from +y, t from the south pole) in the
+	//layer of the body and the light of the frame, texture modulated. Where s wraps from 1 to 0
+	//its derivatives would pick the smallest mipmap along the seam; those of s shifted by half
+	//a turn are continuous there, the smaller of the two is the true one.
+#define SPHERE_SHADING \
+		"uniform sampler2DArray Texture;\n" \
+		"out vec4 Out_Color;\n" \
+		"vec2 sphereUV(vec3 n)\n" \
+		"{\n" \
+		"	vec2 around = dot(n.xy, n.xy) > 1e-12 ? n.xy : vec2(0.0, 1.0);\n" \
+		"	return vec2(fract(atan(-around.x, around.y) / (2.0 * PI)), 1.0 - acos(clamp(n.z, -1.0, 1.0)) / PI);\n" \
+		"}\n" \
+		"vec4 shade(vec3 world, vec3 normal, vec3 object, float emission, float layer)\n" \
+		"{\n" \
+		"	vec2 uv = sphereUV(normalize(object));\n" \
+		"	vec2 dx = dFdx(uv), dy = dFdy(uv);\n" \
+		"	float shifted = fract(uv.x + 0.5);\n" \
+		"	float sx = dFdx(shifted), sy = dFdy(shifted);\n" \
+		"	dx.x = abs(sx) < abs(dx.x) ? sx : dx.x;\n" \
+		"	dy.x = abs(sy) < abs(dy.x) ? sy : dy.x;\n" \
+		"	float light = min(emission + Lighting.z + lightAt(world, normalize(normal)), 1.0);\n" \
+		"	return vec4(textureGrad(Texture, vec3(uv, layer), dx, dy).rgb * light, 1.0);\n" \
+		"}\n"
+
+	const char* MESH_VERTEX_SHADER =
+		"#version 330\n"
+		"layout(location = 0) in vec3 Position;\n"
+		"layout(location = 2) in vec4 Center;\n"
+		"layout(location = 3) in vec4 Params;\n"
+		SPHERE_COMMON
+		"out vec3 Frag_Object;\n"
+		"out vec3 Frag_Normal;\n"
+		"out vec3 Frag_World;\n"
+		"flat out vec2 Frag_Surface;\n"
+		"void main()\n"
+		"{\n"
+		"	vec3 p = rotateBody(Position, Params.xy);\n"
+		"	Frag_Object = Position;\n"
+		"	Frag_Normal = p;\n"
+		"	Frag_World = Center.xyz + p * Center.w;\n"
+		"	Frag_Surface = Params.zw;\n"
+		"	gl_Position = Projection * View * vec4(Frag_World, 1.0);\n"
+		"}\n";
+
+	const char* MESH_FRAGMENT_SHADER =
+		"#version 330\n"
+		SPHERE_COMMON
+		SPHERE_SHADING
+		"in vec3 Frag_Object;\n"
+		"in vec3 Frag_Normal;\n"
+		"in vec3 Frag_World;\n"
+		"flat in vec2 Frag_Surface;\n"
+		"void main()\n"
+		"{\n"
+		"	Out_Color = shade(Frag_World, Frag_Normal, Frag_Object, Frag_Surface.y, Frag_Surface.x);\n"
+		"}\n";
+
+	//A view-aligned quad through the centre, enlarged to cover the silhouette under perspective
+	const char* IMPOSTOR_VERTEX_SHADER =
+		"#version 330\n"
+		"layout(location = 0) in vec3 Position;\n"
+		"layout(location = 2) in vec4 Center;\n"
+		"layout(location = 3) in vec4 Params;\n"
+		SPHERE_COMMON
+		"out vec3 Frag_Ray;\n"
+		"flat out vec4 Frag_Center;\n"
+		"flat out vec4 Frag_Params;\n"
+		"void main()\n"
+		"{\n"
+		"	vec3 c = (View * vec4(Center.xyz, 1.0)).xyz;\n"
+		"	Frag_Ray = c + vec3(Position.xy * Center.w * 1.5, 0.0);\n"
+		"	Frag_Center = vec4(c, Center.w);\n"
+		"	Frag_Params = Params;\n"
+		"	gl_Position = Projection * vec4(Frag_Ray, 1.0);\n"
+		"}\n";
+
+	//Ray-sphere intersection in view space; the depth is that of the sphere, not the quad.
+	//Pixels missing the sphere are shaded at its rim before they are discarded, so the
+	//texture derivatives of their neighbours stay defined
+	const char* IMPOSTOR_FRAGMENT_SHADER =
+		"#version 330\n"
+		SPHERE_COMMON
+		SPHERE_SHADING
+		"in vec3 Frag_Ray;\n"
+		"flat in vec4 Frag_Center;\n"
+		"flat in vec4 Frag_Params;\n"
+		"void main()\n"
+		"{\n"
+		"	vec3 d = normalize(Frag_Ray);\n"
+		"	vec3 c = Frag_Center.xyz;\n"
+		"	float r = Frag_Center.w;\n"
+		"	float b = dot(d, c);\n"
+		"	vec3 miss = c - b * d;\n"
+		"	float disc = r * r - dot(miss, miss);\n"
+		"	vec3 hit = d * (b - sqrt(max(disc, 0.0)));\n"
+		"	vec4 clip = Projection * vec4(hit, 1.0);\n"
+		"	gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;\n"
+		"	mat3 toWorld = transpose(mat3(View));\n"
+		"	vec3 normal = toWorld * ((hit - c) / r);\n"
+		"	vec3 world = toWorld * (hit - View[3].xyz);\n"
+		"	Out_Color = shade(world, normal, unrotateBody(normal, Frag_Params.xy), Frag_Params.w, Frag_Params.z);\n"
+		"	if (disc < 0.0)\n"
+		"		discard;\n"
+		"}\n";
+
+	//Vertex on the unit sphere halfway between a and b, shared by both triangles of the edge
+	uint32_t midpoint(SphereMesh& mesh, std::map<uint64_t, uint32_t>& cache, uint32_t a, uint32_t b)
+	{
+		uint64_t key = a < b ? (uint64_t)a << 32 | b : (uint64_t)b << 32 | a;
+		auto it = cache.find(key);
+		if (it != cache.end())
+			return it->second;
+		float p[3];
+		for (int k = 0; k < 3; k++)
+			p[k] = 0.5f * (mesh.vertices[3 * a + k] + mesh.vertices[3 * b + k]);
+		float length = std::sqrt(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+		uint32_t index = (uint32_t)(mesh.vertices.size() / 3);
+		for (int k = 0; k < 3; k++)
+			mesh.vertices.push_back(p[k] / length);
+		cache[key] = index;
+		return index;
+	}
+
+	GLuint programUniforms(GLuint program)
+	{
+		if (!program)
+			return 0;
+		glUseProgram(program);
+		glUniform1i(glGetUniformLocation(program, "Texture"), 0);
+		glUseProgram(0);
+		return program;
+	}
+}
+
+void icosphere(int subdivisions, SphereMesh& mesh)
+{
+	const float t = (1.f + std::sqrt(5.f)) / 2.f;
+	const float corners[12][3] =
+	{
+		{ -1, t, 0 }, { 1, t, 0 }, { -1, -t, 0 }, { 1, -t, 0 },
+		{ 0, -1, t }, { 0, 1, t }, { 0, -1, -t }, { 0, 1, -t },
+		{ t, 0, -1 }, { t, 0, 1 }, { -t, 0, -1 }, { -t, 0, 1 }
+	};
+	//Counter-clockwise seen from outside
+	const uint32_t faces[20][3] =
+	{
+		{ 0, 11, 5 }, { 0, 5, 1 }, { 0, 1, 7 }, { 0, 7, 10 }, { 0, 10, 11 },
+		{ 1, 5, 9 }, { 5, 11, 4 }, { 11, 10, 2 }, { 10, 7, 6 }, { 7, 1, 8 },
+		{ 3, 9, 4 }, { 3, 4, 2 }, { 3, 2, 6 }, { 3, 6, 8 }, { 3, 8, 9 },
+		{ 4, 9, 5 }, { 2, 4, 11 }, { 6, 2, 10 }, { 8, 6, 7 }, { 9, 8, 1 }
+	};
+	mesh.vertices.clear();
+	mesh.indices.clear();
+	float length = std::sqrt(1.f + t * t);
+	for (auto& c : corners)
+		for (int k = 0; k < 3; k++)
+			mesh.vertices.push_back(c[k] / length);
+	for (auto& f : faces)
+		mesh.indices.insert(mesh.indices.end(), f, f + 3);
+	std::map<uint64_t, uint32_t> cache;
+	for (int level = 0; level < subdivisions; level++)
+	{
+		std::vector<uint32_t> split;
+		split.reserve(mesh.indices.size() * 4);
+		for (size_t i = 0; i < mesh.indices.size(); i += 3)
+		{
+			uint32_t a = mesh.indices[i], b = mesh.indices[i + 1], c = mesh.indices[i + 2];
+			uint32_t ab = midpoint(mesh, cache, a, b);
+			uint32_t bc = midpoint(mesh, cache, b, c);
+			uint32_t ca = midpoint(mesh, cache, c, a);
+			const uint32_t children[12] = { a, ab, ca, b, bc, ab, c, ca, bc, ab, bc, ca };
+			split.insert(split.end(), children, children + 12);
+		}
+		mesh.indices.swap(split);
+		cache.clear();
+	}
+}
+
+SphereRenderer::SphereRenderer()
+	: meshProgram(0)
+	, impostorProgram(0)
+	, vao(0)
+	, vertexBuffer(0)
+	, indexBuffer(0)
+	, instanceBuffer(0)
+	, capacity(0)
+{
+	for (int l = 0; l < SPHERE_LODS; l++)
+	{
+		firstIndex[l] = 0;
+		indexCount[l] = 0;
+		last.lod[l] = 0;
+	}
+	last.culled = last.triangles = last.draws = 0;
+}
+
+bool SphereRenderer::init()
+{
+	meshProgram = programUniforms(compileProgram("SphereRenderer mesh", MESH_VERTEX_SHADER, MESH_FRAGMENT_SHADER));
+	impostorProgram = programUniforms(compileProgram("SphereRenderer impostor", IMPOSTOR_VERTEX_SHADER, IMPOSTOR_FRAGMENT_SHADER));
+	if (!meshProgram || !impostorProgram)
+		return false;
+
+	//All levels in one vertex and one index buffer, indices absolute
+	std::vector<float> vertices;
+	std::vector<uint32_t> indices;
+	SphereMesh mesh;
+	for (int l = 0; l < SPHERE_IMPOSTOR; l++)
+	{
+		icosphere(SUBDIVISIONS[l], mesh);
+		uint32_t base = (uint32_t)(vertices.size() / 3);
+		firstIndex[l] = (GLsizei)indices.size();
+		indexCount[l] = (GLsizei)mesh.indices.size();
+		vertices.insert(vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+		for (uint32_t i : mesh.indices)
+			indices.push_back(base + i);
+	}
+	const float quad[12] = { -1, -1, 0, 1, -1, 0, 1, 1, 0, -1, 1, 0 };
+	uint32_t base = (uint32_t)(vertices.size() / 3);
+	vertices.insert(vertices.end(), quad, quad + 12);
+	firstIndex[SPHERE_IMPOSTOR] = (GLsizei)indices.size();
+	indexCount[SPHERE_IMPOSTOR] = 6;
+	const uint32_t quadIndices[6] = { 0, 1, 2, 0, 2, 3 };
+	for (uint32_t i : quadIndices)
+		indices.push_back(base + i);
+
+	glGenVertexArrays(1, &vao);
+	glGenBuffers(1, &vertexBuffer);
+	glGenBuffers(1, &indexBuffer);
+	glGenBuffers(1, &instanceBuffer);
+	glBindVertexArray(vao);
+	glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(), GL_STATIC_DRAW);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (const GLvoid*)0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint32_t), indices.data(), GL_STATIC_DRAW);
+	//Instance attributes advance once per sphere; the queue sets their offsets per item
+	capacity = INITIAL_INSTANCES * sizeof(SphereInstance);
+	glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+	glBufferData(GL_ARRAY_BUFFER, capacity, NULL, GL_STREAM_DRAW);
+	glEnableVertexAttribArray(2);
+	glVertexAttribDivisor(2, 1);
+	glEnableVertexAttribArray(3);
+	glVertexAttribDivisor(3, 1);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	instances.reserve(INITIAL_INSTANCES);
+	keys.reserve(INITIAL_INSTANCES);
+	sorted.reserve(INITIAL_INSTANCES);
+	levels.reserve(INITIAL_INSTANCES);
+	return true;
+}
+
+void SphereRenderer::release()
+{
+	if (meshProgram)
+		glDeleteProgram(meshProgram);
+	if (impostorProgram)
+		glDeleteProgram(impostorProgram);
+	if (vao)
+		glDeleteVertexArrays(1, &vao);
+	GLuint buffers[3] = { vertexBuffer, indexBuffer, instanceBuffer };
+	glDeleteBuffers(3, buffers);
+	meshProgram = impostorProgram = vao = vertexBuffer = indexBuffer = instanceBuffer = 0;
+	capacity = 0;
+}
+
+void SphereRenderer::begin()
+{
+	instances.clear();
+	keys.clear();
+}
+
+void SphereRenderer::add(const SphereInstance& instance, uint32_t key)
+{
+	instances.push_back(instance);
+	keys.push_back(key);
+}
+
+int SphereRenderer::pickLod(float pixels, int current)
+{
+	int lod = current;
+	while (lod > 0 && pixels >= LOD_PIXELS[lod - 1] * (1.f + HYSTERESIS))
+		lod--;
+	while (lod < SPHERE_IMPOSTOR && pixels < LOD_PIXELS[lod] * (1.f - HYSTERESIS))
+		lod++;
+	return lod;
+}
+
+void SphereRenderer::queueLod(int lod, size_t first, size_t end, GLuint textures, RenderQueue& queue)
+{
+	if (first == end)
+		return;
+	bool impostor = lod == SPHERE_IMPOSTOR;
+	//The meshes cull their back faces, the impostor quad faces the camera anyway
+	DrawItem item(RENDER_OPAQUE, impostor ? impostorProgram : meshProgram, vao, textures,
+		impostor ? 0 : RENDER_CULL_BACK, GL_TRIANGLES);
+	item.textureTarget = GL_TEXTURE_2D_ARRAY;
+	item.indexed = true;
+	item.first = firstIndex[lod];
+	item.count = indexCount[lod];
+	item.instances = (GLsizei)(end - first);
+	item.instanceBuffer = instanceBuffer;
+	item.instanceAttrib = 2;
+	item.instanceVec4s = sizeof(SphereInstance) / (4 * sizeof(float));
+	item.instanceOffset = first * sizeof(SphereInstance);
+	queue.add(item);
+	last.draws++;
+	last.triangles += (size_t)indexCount[lod] / 3 * (end - first);
+}
+
+void SphereRenderer::draw(const FrameData& frame, GLuint textures, RenderQueue& queue)
+{
+	PROFILE_SCOPE("SphereRenderer::draw");
+	for (int l = 0; l < SPHERE_LODS; l++)
+		last.lod[l] = 0;
+	last.culled = last.triangles = last.draws = 0;
+	if (instances.empty() || !meshProgram)
+		return;
+
+	//Frustum side planes and the pixels per unit of radius at unit distance
+	const glm::mat4& view = frame.view;
+	float fx = frame.projection[0][0];
+	float fy = frame.projection[1][1];
+	float nx = 1.f / std::sqrt(fx * fx + 1.f);
+	float ny = 1.f / std::sqrt(fy * fy + 1.f);
+	float pixelsPerUnit = frame.viewport.z;
+	levels.resize(instances.size());
+	for (size_t i = 0; i < instances.size(); i++)
+	{
+		const SphereInstance& s = instances[i];
+		glm::vec4 c = view * glm::vec4(s.position[0], s.position[1], s.position[2], 1.f);
+		float r = s.radius;
+		if (c.z > r || (fx * c.x + c.z) * nx > r || (-fx * c.x + c.z) * nx > r || (fy * c.y + c.z) * ny > r || (-fy * c.y + c.z) * ny > r)
+		{
+			levels[i] = UNSEEN;
+			last.culled++;
+			continue;
+		}
+		float distance = std::max(std::sqrt(c.x * c.x + c.y * c.y + c.z * c.z), r);
+		float pixels = r * pixelsPerUnit / distance;
+		uint32_t key = keys[i];
+		if (key >= history.size())
+			history.resize(key + 1, UNSEEN);
+		int lod = pickLod(pixels, history[key] == UNSEEN ? SPHERE_IMPOSTOR : history[key]);
+		history[key] = (uint8_t)lod;
+		levels[i] = (uint8_t)lod;
+		last.lod[lod]++;
+	}
+
+	//Group by level, the layer of every body is its own
+	size_t start[SPHERE_LODS + 1];
+	start[0] = 0;
+	for (int l = 0; l < SPHERE_LODS; l++)
+		start[l + 1] = start[l] + last.lod[l];
+	size_t visible = start[SPHERE_LODS];
+	if (visible == 0)
+		return;
+	sorted.resize(visible);
+	size_t next[SPHERE_LODS];
+	std::copy(start, start + SPHERE_LODS, next);
+	for (size_t i = 0; i < instances.size(); i++)
+		if (levels[i] != UNSEEN)
+			sorted[next[levels[i]]++] = instances[i];
+
+	size_t bytes = visible * sizeof(SphereInstance);
+	glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+	if (bytes > capacity)
+		capacity = std::max(bytes, 2 * capacity);
+	//Orphan the storage of the previous frame, the driver doesn't have to wait for it
+	glBufferData(GL_ARRAY_BUFFER, capacity, NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, sorted.data());
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	for (int l = 0; l < SPHERE_LODS; l++)
+		queueLod(l, start[l], start[l + 1], textures, queue);
+}
@@ -0,0 +1,102 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <glew.h>
+#include <glm\glm.hpp>
+#include "frame.h"
+#include "render.h"
+
+//Instanced sphere rendering. The meshes are generated once into a VAO with its vertex and
+//index buffers; every frame the bodies are collected as instances and drawn with one
+//instanced call per level of detail, whatever their textures, so the cost doesn't grow with
+//the tessellation or the number of bodies. The textures are the layers of one array.
+//
+//Level of detail follows the projected radius: icospheres of 5 down to 1 subdivisions,
+//then a camera-facing quad ray-casting the sphere per pixel. Texture coordinates and
+//lighting are computed per pixel from the sphere normal, so the levels look alike and
+//coarse meshes lose only the silhouette.
+
+//Icosphere levels 5..1 and the impostor quad
+const int SPHERE_LODS = 6;
+const int SPHERE_IMPOSTOR = SPHERE_LODS - 1;
+
+//Per-instance data, two vec4 attributes
+struct SphereInstance
+{
+	//Centre in render units
+	float position[3];
+	//Radius in render units
+	float radius;
+	//Axial tilt and rotation about the own axis, degrees
+	float tilt;
+	float rotation;
+	//Layer of the body in the texture array, shared by bodies looking alike
+	float layer;
+	//1 - self-luminous (the Sun), 0 - lit by the Sun
+	float emission;
+};
+
+//Unit sphere mesh, z axis through the poles; the position is also the normal
+struct SphereMesh
+{
+	std::vector<float> vertices;
+	std::vector<uint32_t> indices;
+};
+
+//Icosahedron with every triangle split in four subdivisions times, projected to the sphere
+void icosphere(int subdivisions, SphereMesh& mesh);
+
+//Instances of the last frame per level
+struct SphereStats
+{
+	size_t lod[SPHERE_LODS];
+	size_t culled;
+	size_t triangles;
+	size_t draws;
+};
+
+class SphereRenderer
+{
+public:
+	SphereRenderer();
+	//Needs a current GL 3.3 context
+	bool init();
+	void release();
+	//Start collecting the instances of a frame
+	void begin();
+	//key identifies the body across frames for the hysteresis of its level
+	void add(const SphereInstance& instance, uint32_t key);
+	//Cull, pick the levels and queue the collected instances for the camera of the frame,
+	//one item per level with the GL_TEXTURE_2D_ARRAY textures
+	void draw(const FrameData& frame, GLuint textures, RenderQueue& queue);
+	const SphereStats& stats() const
+	{
+		return last;
+	}
+
+private:
+	//Level for a projected radius, starting from the level of the last frame
+	static int pickLod(float pixels, int current);
+	void queueLod(int lod, size_t first, size_t end, GLuint textures, RenderQueue& queue);
+
+	GLuint meshProgram;
+	GLuint impostorProgram;
+	GLuint vao;
+	GLuint vertexBuffer;
+	GLuint indexBuffer;
+	GLuint instanceBuffer;
+	//Index range of every level in indexBuffer
+	GLsizei firstIndex[SPHERE_LODS];
+	GLsizei indexCount[SPHERE_LODS];
+	//Bytes allocated in instanceBuffer
+	size_t capacity;
+	std::vector<SphereInstance> instances;
+	std::vector<uint32_t> keys;
+	//Instances after culling, grouped by level
+	std::vector<SphereInstance> sorted;
+	std::vector<uint8_t> levels;
+	//Level of every key in the last frame, 0xff - not seen yet
+	std::vector<uint8_t> history;
+	SphereStats last;
+};
@@ -0,0 +1,40 @@
+#pragma once
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+//Simulation state in structure-of-arrays layout, one column per component
+struct State
+{
+	//Position, m
+	std::vector<double> px, py, pz;
+	//Velocity, m/s
+	std::vector<double> vx, vy, vz;
+	//Gravitational parameter, m^3/s^2
+	std::vector<double> gm;
+	//Mass, kg
+	std::vector<double> mass;
+	//Days since start
+	double day = 1.0;
+	//Time step, s
+	float step = 86400.0f;
+	//Random generator state of procedural scenarios
+	uint64_t seed = 0;
+	//Plummer softening length of procedural scenarios, m; 0 - none
+	double softening = 0.0;
+	//A procedural scenario, not the Solar System
+	bool generated = false;
+
+	size_t size() const
+	{
+		return px.size();
+	}
+
+	void resize(size_t n)
+	{
+		px.resize(n); py.resize(n); pz.resize(n);
+		vx.resize(n); vy.resize(n); vz.resize(n);
+		gm.resize(n);
+		mass.resize(n);
+	}
+};
@@ -0,0 +1,147 @@
+#include <cmath>
+#include <algorithm>
+#include "textures.h"
+#include "profiler.h"
+
+namespace
+{
+	const unsigned char GREY = 128;
+
+	int mipLevels(int width, int height)
+	{
+		int levels = 1;
+		for (int size = std::max(width, height); size > 1; size /= 2)
+			levels++;
+		return levels;
+	}
+
+	//Weights of the source samples under target sample i, each the length of the source
+	//interval it covers; the same for all rows or columns
+	void footprint(int i, int source, int target, int& first, std::vector<float>& weights)
+	{
+		double scale = (double)source / target;
+		double a = i * scale, b = (i + 1) * scale;
+		first = (int)std::floor(a);
+		int last = std::min((int)std::ceil(b), source) - 1;
+		weights.clear();
+		for (int s = first; s <= last; s++)
+			weights.push_back((float)((std::min(b, s + 1.0) - std::max(a, (double)s)) / scale));
+	}
+
+	//Area-weighted resampling, the rows first; a box filter when shrinking and nearest
+	//with blended edges when enlarging
+	void resample(const unsigned char* pixels, int width, int height, int pitch, unsigned char* out, int outWidth, int outHeight)
+	{
+		std::vector<float> rows((size_t)height * outWidth * 3);
+		std::vector<float> weights;
+		int first;
+		for (int x = 0; x < outWidth; x++)
+		{
+			footprint(x, width, outWidth, first, weights);
+			for (int y = 0; y < height; y++)
+			{
+				const unsigned char* row = pixels + (size_t)y * pitch;
+				float sum[3] = { 0.f, 0.f, 0.f };
+				for (size_t k = 0; k < weights.size(); k++)
+					for (int c = 0; c < 3; c++)
+						sum[c] += weights[k] * row[3 * (first + k) + c];
+				for (int c = 0; c < 3; c++)
+					rows[3 * ((size_t)y * outWidth + x) + c] = sum[c];
+			}
+		}
+		for (int y = 0; y < outHeight; y++)
+		{
+			footprint(y, height, outHeight, first, weights);
+			for (int x = 0; x < outWidth; x++)
+			{
+				float sum[3] = { 0.f, 0.f, 0.f };
+				for (size_t k = 0; k < weights.size(); k++)
+					for (int c = 0; c < 3; c++)
+						sum[c] += weights[k] * rows[3 * ((first + k) * outWidth + x) + c];
+				for (int c = 0; c < 3; c++)
+					out[3 * ((size_t)y * outWidth + x) + c] = (unsigned char)std::min(std::max(sum[c] + 0.5f, 0.f), 255.f);
+			}
+		}
+	}
+}
+
+TextureArray::TextureArray()
+	: id(0)
+	, width(0)
+	, height(0)
+	, count(0)
+	, levels(0)
+{
+}
+
+bool TextureArray::init(int width, int height, int layers)
+{
+	this->width = width;
+	this->height = height;
+	count = layers;
+	levels = mipLevels(width, height);
+	glGenTextures(1, &id);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, id);
+	if (GLEW_VERSION_4_2 || GLEW_ARB_texture_storage)
+		glTexStorage3D(GL_TEXTURE_2D_ARRAY, levels, GL_RGBA8, width, height, layers);
+	else
+		for (int l = 0, w = width, h = height; l < levels; l++, w = std::max(w / 2, 1), h = std::max(h / 2, 1))
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, l, GL_RGBA8, w, h, layers, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+	//Longitude wraps around, latitude ends at the poles
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	resampled.assign((size_t)width * height * 3, GREY);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (int layer = 0; layer < layers; layer++)
+		glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, width, height, 1, GL_RGB, GL_UNSIGNED_BYTE, resampled.data());
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	return glGetError() == GL_NO_ERROR;
+}
+
+void TextureArray::release()
+{
+	if (id)
+		glDeleteTextures(1, &id);
+	id = 0;
+	count = 0;
+	resampled.clear();
+	resampled.shrink_to_fit();
+}
+
+bool TextureArray::setLayer(int layer, const unsigned char* pixels, int width, int height, int pitch)
+{
+	PROFILE_SCOPE("TextureArray::setLayer");
+	if (!id || layer < 0 || layer >= count || width <= 0 || height <= 0)
+		return false;
+	const unsigned char* data = pixels;
+	GLint rowLength = pitch / 3;
+	if (width != this->width || height != this->height || pitch % 3 != 0)
+	{
+		resampled.resize((size_t)this->width * this->height * 3);
+		resample(pixels, width, height, pitch, resampled.data(), this->width, this->height);
+		data = resampled.data();
+		rowLength = this->width;
+	}
+	glBindTexture(GL_TEXTURE_2D_ARRAY, id);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, rowLength);
+	glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, this->width, this->height, 1, GL_RGB, GL_UNSIGNED_BYTE, data);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	return glGetError() == GL_NO_ERROR;
+}
+
+void TextureArray::finish()
+{
+	PROFILE_SCOPE("TextureArray::finish");
+	glBindTexture(GL_TEXTURE_2D_ARRAY, id);
+	glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	//The scratch layer is allocated again if a layer is set later
+	resampled.clear();
+	resampled.shrink_to_fit();
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <vector>
+#include <glew.h>
+
+//Images of any size in the layers of one mipmapped GL_TEXTURE_2D_ARRAY. Every image is
+//resampled on the CPU to the size of the array when it is set, so the bodies are drawn with
+//the array bound once and pick their layer per instance. Layers never set stay grey.
+
+class TextureArray
+{
+public:
+	TextureArray();
+	//Storage for layers of width x height with all their mipmaps; needs a current GL 3.3 context
+	bool init(int width, int height, int layers);
+	void release();
+	//Fill a layer from an RGB image whose rows are pitch bytes apart
+	bool setLayer(int layer, const unsigned char* pixels, int width, int height, int pitch);
+	//Build the mipmaps, after the last setLayer()
+	void finish();
+	GLuint texture() const
+	{
+		return id;
+	}
+	int layers() const
+	{
+		return count;
+	}
+
+private:
+	GLuint id;
+	int width;
+	int height;
+	int count;
+	//Mipmap levels of the storage
+	int levels;
+	//A layer at the size of the array, kept until finish()
+	std::vector<unsigned char> resampled;
+};
@@ -0,0 +1,343 @@
+#include <algorithm>
+#include <cstring>
+#include "trails.h"
+#include "shader.h"
+#include "frame.h"
+#include "profiler.h"
+
+namespace
+{
+	//Bytes of one sample: position, 3 floats
+	const size_t STRIDE = 3 * sizeof(float);
+	const size_t INITIAL_STAGING = 1024;
+	//Fence waits in nanoseconds before trying again
+	const GLuint64 WAIT_NS = 1000000000;
+
+	const char* TRAIL_VERTEX_SHADER =
+		"#version 330\n"
+		"layout(location = 0) in vec3 Position;\n"
+		FRAME_BLOCK
+		"void main()\n"
+		"{\n"
+		"	gl_Position = Projection * View * vec4(Position, 1.0);\n"
+		"}\n";
+
+	const char* TRAIL_FRAGMENT_SHADER =
+		"#version 330\n"
+		"uniform vec4 Color;\n"
+		"out vec4 Out_Color;\n"
+		"void main()\n"
+		"{\n"
+		"	Out_Color = Color;\n"
+		"}\n";
+
+	bool bufferStorage()
+	{
+		return GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+	}
+}
+
+TrailRenderer::TrailRenderer()
+	: program(0)
+	, vao(0)
+	, buffer(0)
+	, allocated(0)
+	, used(0)
+	, persistent(false)
+	, staging(0)
+	, mapped(NULL)
+	, stagingCapacity(0)
+	, region(0)
+{
+	for (auto& f : fences)
+		f = NULL;
+	last.trails = last.vertices = last.uploaded = last.draws = 0;
+	last.persistent = false;
+}
+
+bool TrailRenderer::init()
+{
+	program = compileProgram("TrailRenderer", TRAIL_VERTEX_SHADER, TRAIL_FRAGMENT_SHADER);
+	if (!program)
+		return false;
+	glUseProgram(program);
+	glUniform4f(glGetUniformLocation(program, "Color"), 1.f, 1.f, 1.f, 1.f);
+	glUseProgram(0);
+	glGenVertexArrays(1, &vao);
+	persistent = bufferStorage();
+	return !persistent || reserveStaging(INITIAL_STAGING);
+}
+
+void TrailRenderer::release()
+{
+	freeStaging();
+	if (program)
+		glDeleteProgram(program);
+	if (vao)
+		glDeleteVertexArrays(1, &vao);
+	if (buffer)
+		glDeleteBuffers(1, &buffer);
+	program = vao = buffer = 0;
+	allocated = used = 0;
+	trails.clear();
+	pendingVertex.clear();
+	pendingData.clear();
+}
+
+void TrailRenderer::freeStaging()
+{
+	for (auto& f : fences)
+	{
+		if (f)
+			glDeleteSync(f);
+		f = NULL;
+	}
+	if (mapped)
+	{
+		glBindBuffer(GL_COPY_READ_BUFFER, staging);
+		glUnmapBuffer(GL_COPY_READ_BUFFER);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		mapped = NULL;
+	}
+	if (staging)
+		glDeleteBuffers(1, &staging);
+	staging = 0;
+	stagingCapacity = 0;
+}
+
+bool TrailRenderer::reserveStaging(size_t samples)
+{
+	freeStaging();
+	const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	GLsizeiptr bytes = (GLsizeiptr)(TRAIL_RING * samples * STRIDE);
+	glGenBuffers(1, &staging);
+	glBindBuffer(GL_COPY_READ_BUFFER, staging);
+	glBufferStorage(GL_COPY_READ_BUFFER, bytes, NULL, flags);
+	mapped = (float*)glMapBufferRange(GL_COPY_READ_BUFFER, 0, bytes, flags);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	if (!mapped)
+	{
+		//Uploads go through glBufferSubData instead
+		glDeleteBuffers(1, &staging);
+		staging = 0;
+		persistent = false;
+		return true;
+	}
+	stagingCapacity = samples;
+	region = 0;
+	return true;
+}
+
+bool TrailRenderer::reserve(size_t vertices)
+{
+	if (vertices <= allocated)
+		return true;
+	size_t size = std::max(vertices, 2 * allocated);
+	GLuint grown;
+	glGenBuffers(1, &grown);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, grown);
+	glBufferData(GL_COPY_WRITE_BUFFER, (GLsizeiptr)(size * STRIDE), NULL, GL_DYNAMIC_DRAW);
+	if (buffer)
+	{
+		//The trails so far move over on the GPU
+		glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, (GLsizeiptr)(used * STRIDE));
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		glDeleteBuffers(1, &buffer);
+	}
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	buffer = grown;
+	allocated = size;
+	glBindVertexArray(vao);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, (GLsizei)STRIDE, (const GLvoid*)0);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	return glGetError() == GL_NO_ERROR;
+}
+
+int TrailRenderer::add(size_t capacity)
+{
+	Trail t;
+	t.first = used;
+	t.capacity = std::max(capacity, (size_t)1);
+	t.head = t.count = 0;
+	t.sample = 0;
+	//The mirror of slot 0 follows the ring
+	if (!reserve(used + t.capacity + 1))
+		return -1;
+	used += t.capacity + 1;
+	trails.push_back(t);
+	return (int)trails.size() - 1;
+}
+
+void TrailRenderer::write(size_t vertex, const float position[3])
+{
+	pendingVertex.push_back(vertex);
+	pendingData.insert(pendingData.end(), position, position + 3);
+}
+
+void TrailRenderer::record(int trail, int64_t sample, const float position[3])
+{
+	if (trail < 0 || trail >= (int)trails.size())
+		return;
+	Trail& t = trails[trail];
+	size_t slot;
+	if (t.count > 0 && sample == t.sample)
+		slot = (t.head + t.capacity - 1) % t.capacity;
+	else
+	{
+		if (t.count > 0 && sample < t.sample)
+			t.head = t.count = 0;
+		slot = t.head;
+		t.head = (t.head + 1) % t.capacity;
+		t.count = std::min(t.count + 1, t.capacity);
+		t.sample = sample;
+	}
+	write(t.first + slot, position);
+	if (slot == 0)
+		write(t.first + t.capacity, position);
+}
+
+void TrailRenderer::trim(int trail, size_t count)
+{
+	if (trail >= 0 && trail < (int)trails.size())
+		trails[trail].count = std::min(trails[trail].count, count);
+}
+
+void TrailRenderer::update(int trail, const TrailStore& store, int source, float scale)
+{
+	if (trail < 0 || trail >= (int)trails.size())
+		return;
+	const Trail& t = trails[trail];
+	size_t count = std::min(store.count(source), t.capacity);
+	if (count == 0)
+	{
+		trim(trail, 0);
+		return;
+	}
+	uint64_t newest = store.newest(source);
+	uint64_t first = newest + 1 - count;
+	if (t.count > 0 && t.sample >= (int64_t)first && t.sample <= (int64_t)newest)
+		first = (uint64_t)t.sample;
+	double p[3];
+	for (uint64_t id = first; id <= newest; id++)
+	{
+		store.position(source, id, p);
+		const float sample[3] = { (float)(p[0] * scale), (float)(p[1] * scale), (float)(p[2] * scale) };
+		record(trail, (int64_t)id, sample);
+	}
+	trim(trail, count);
+}
+
+void TrailRenderer::begin()
+{
+	queued.clear();
+}
+
+void TrailRenderer::queue(int trail)
+{
+	if (trail >= 0 && trail < (int)trails.size())
+		queued.push_back(trail);
+}
+
+void TrailRenderer::upload()
+{
+	size_t n = pendingVertex.size();
+	last.uploaded = n;
+	if (n == 0)
+		return;
+	if (persistent && n > stagingCapacity)
+		reserveStaging(std::max(n, 2 * stagingCapacity));
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+	if (persistent)
+	{
+		region = (region + 1) % TRAIL_RING;
+		GLsync& fence = fences[region];
+		if (fence)
+		{
+			//Normally long signalled: the region was copied TRAIL_RING frames ago
+			GLenum result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, WAIT_NS);
+			while (result == GL_TIMEOUT_EXPIRED)
+				result = glClientWaitSync(fence, 0, WAIT_NS);
+			glDeleteSync(fence);
+			fence = NULL;
+		}
+		size_t base = region * stagingCapacity;
+		memcpy(mapped + 3 * base, pendingData.data(), n * STRIDE);
+		glBindBuffer(GL_COPY_READ_BUFFER, staging);
+		//One copy per run of consecutive vertices, in order, so a later sample of the same
+		//vertex wins
+		for (size_t i = 0; i < n;)
+		{
+			size_t end = i + 1;
+			while (end < n && pendingVertex[end] == pendingVertex[end - 1] + 1)
+				end++;
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, (GLintptr)((base + i) * STRIDE),
+				(GLintptr)(pendingVertex[i] * STRIDE), (GLsizeiptr)((end - i) * STRIDE));
+			i = end;
+		}
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+	else
+	{
+		for (size_t i = 0; i < n;)
+		{
+			size_t end = i + 1;
+			while (end < n && pendingVertex[end] == pendingVertex[end - 1] + 1)
+				end++;
+			glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr)(pendingVertex[i] * STRIDE), (GLsizeiptr)((end - i) * STRIDE),
+				pendingData.data() + 3 * i);
+			i = end;
+		}
+	}
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	pendingVertex.clear();
+	pendingData.clear();
+}
+
+void TrailRenderer::draw(RenderQueue& queue)
+{
+	PROFILE_SCOPE("TrailRenderer::draw");
+	last.trails = last.vertices = last.uploaded = last.draws = 0;
+	last.persistent = persistent;
+	if (!program || !buffer)
+		return;
+	upload();
+
+	//Oldest to newest: a wrapped ring runs from the oldest sample to the mirror of slot 0
+	//and goes on from slot 0 to the newest sample
+	firsts.clear();
+	counts.clear();
+	for (int trail : queued)
+	{
+		const Trail& t = trails[trail];
+		GLint first = (GLint)t.first;
+		size_t oldest = (t.head + t.capacity - t.count) % t.capacity;
+		if (oldest + t.count <= t.capacity)
+		{
+			firsts.push_back(first + (GLint)oldest);
+			counts.push_back((GLsizei)t.count);
+		}
+		else
+		{
+			firsts.push_back(first + (GLint)oldest);
+			counts.push_back((GLsizei)(t.capacity + 1 - oldest));
+			firsts.push_back(first);
+			counts.push_back((GLsizei)t.head);
+		}
+		last.vertices += t.count;
+		last.trails++;
+	}
+	if (firsts.empty())
+		return;
+
+	DrawItem item(RENDER_OPAQUE, program, vao, 0, 0, GL_LINE_STRIP);
+	item.firsts = firsts.data();
+	item.counts = counts.data();
+	item.draws = (GLsizei)firsts.size();
+	queue.add(item);
+	last.draws = 1;
+}
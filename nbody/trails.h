@@ -0,0 +1,96 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <glew.h>
+#include "history.h"
+#include "render.h"
+
+//Orbit trails kept on the GPU. All trails share one vertex buffer, each owning a ring of
+//capacity samples plus one slot mirroring the first, so a wrapped ring is still drawn as two
+//connected line strips. Only the samples written since the last frame are uploaded: they
+//go through a persistently mapped staging ring (GL 4.4 / ARB_buffer_storage) and are copied
+//into place on the GPU, behind the draws of earlier frames that may still read the trail
+//buffer. All queued trails are drawn with one glMultiDrawArrays.
+
+//Regions of the staging ring, written while the GPU copies from the other two
+const int TRAIL_RING = 3;
+
+//Last frame of the renderer
+struct TrailStats
+{
+	size_t trails;
+	size_t vertices;
+	size_t uploaded;
+	size_t draws;
+	bool persistent;
+};
+
+class TrailRenderer
+{
+public:
+	TrailRenderer();
+	//Needs a current GL 3.3 context
+	bool init();
+	void release();
+	//New empty trail of capacity samples, returns its index
+	int add(size_t capacity);
+	//Position of a trail at sample, in render units. The same sample again replaces the
+	//newest point, a later one appends, an earlier one restarts the trail
+	void record(int trail, int64_t sample, const float position[3]);
+	//Draw only the newest count samples of a trail
+	void trim(int trail, size_t count);
+	//Bring a trail up to the points of source in store, positions multiplied by scale.
+	//Only points new since the last update and the moving newest one are recorded
+	void update(int trail, const TrailStore& store, int source, float scale);
+	//Start collecting the trails of a frame
+	void begin();
+	void queue(int trail);
+	//Upload the recorded samples and queue the trails of the frame as one item
+	void draw(RenderQueue& queue);
+	const TrailStats& stats() const
+	{
+		return last;
+	}
+
+private:
+	struct Trail
+	{
+		//First vertex in the buffer
+		size_t first;
+		size_t capacity;
+		//Next slot to write and samples held
+		size_t head;
+		size_t count;
+		int64_t sample;
+	};
+
+	void write(size_t vertex, const float position[3]);
+	//Vertex storage for at least vertices, keeping the trails already there
+	bool reserve(size_t vertices);
+	bool reserveStaging(size_t samples);
+	void freeStaging();
+	void upload();
+
+	GLuint program;
+	GLuint vao;
+	GLuint buffer;
+	//Vertices allocated in buffer and used by the trails
+	size_t allocated;
+	size_t used;
+	bool persistent;
+	GLuint staging;
+	float* mapped;
+	//Samples per staging region
+	size_t stagingCapacity;
+	GLsync fences[TRAIL_RING];
+	int region;
+	std::vector<Trail> trails;
+	//Samples waiting for upload: destination vertex and position
+	std::vector<size_t> pendingVertex;
+	std::vector<float> pendingData;
+	std::vector<int> queued;
+	std::vector<GLint> firsts;
+	std::vector<GLsizei> counts;
+	TrailStats last;
+};
@@ -0,0 +1,242 @@
+#include <cstring>
+#include <chrono>
+#include "trajectory.h"
+#include "parallel.h"
+#include "profiler.h"
+#include "alloc.h"
+
+const char TRAJECTORY_MAGIC[8] = { 'N', 'B', 'O', 'D', 'Y', 'T', 'R', 'J' };
+const char TRAJECTORY_CHUNK_MAGIC[4] = { 'C', 'H', 'N', 'K' };
+const char TRAJECTORY_FOOTER_MAGIC[8] = { 'N', 'B', 'T', 'I', 'N', 'D', 'E', 'X' };
+
+TrajectorySink::TrajectorySink()
+	: file(NULL)
+	, count(0)
+	, codec(CODEC_RAW)
+	, framesPerChunk(64)
+	, head(0)
+	, tail(0)
+	, framesWritten(0)
+	, framesDropped(0)
+	, bytesWritten(0)
+	, writeFailed(false)
+	, stop(false)
+	, positionError(1000.0)
+	, velocityError(0.01)
+	, chunkHasConservation(false)
+	, offset(0)
+{
+}
+
+TrajectorySink::~TrajectorySink()
+{
+	close();
+}
+
+bool TrajectorySink::open(const std::string& path, size_t bodies, Codec c, uint32_t chunkFrames, size_t queueFrames)
+{
+	close();
+	file = fopen(path.c_str(), "wb");
+	if (!file)
+		return false;
+	count = bodies;
+	codec = c;
+	framesPerChunk = chunkFrames > 0 ? chunkFrames : 1;
+	TrajectoryHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, TRAJECTORY_MAGIC, sizeof(h.magic));
+	h.version = TRAJECTORY_VERSION;
+	h.columns = TRAJECTORY_COLUMNS;
+	h.count = count;
+	h.framesPerChunk = framesPerChunk;
+	if (fwrite(&h, sizeof(h), 1, file) != 1)
+	{
+		fclose(file);
+		file = NULL;
+		return false;
+	}
+	offset = sizeof(h);
+
+	//Everything the hot path touches is allocated up front
+	slots.assign(queueFrames > 0 ? queueFrames : 1, Frame());
+	for (auto& slot : slots)
+		for (auto& column : slot.columns)
+			column.resize(count);
+	for (auto& column : chunk)
+	{
+		column.clear();
+		column.reserve(framesPerChunk * count);
+	}
+	chunkDays.clear();
+	chunkConservation.clear();
+	chunkConservation.reserve(framesPerChunk);
+	chunkHasConservation = false;
+	index.clear();
+	head = 0;
+	tail = 0;
+	framesWritten = 0;
+	framesDropped = 0;
+	bytesWritten = sizeof(h);
+	writeFailed = false;
+	stop = false;
+	worker = std::thread(&TrajectorySink::run, this);
+	return true;
+}
+
+void TrajectorySink::close()
+{
+	if (!file)
+		return;
+	stop = true;
+	wake.notify_one();
+	worker.join();
+	fclose(file);
+	file = NULL;
+}
+
+bool TrajectorySink::push(const State& s, const Conservation* c)
+{
+	if (!file || s.size() != count)
+		return false;
+	uint64_t h = head.load(std::memory_order_relaxed);
+	if (h - tail.load(std::memory_order_acquire) >= slots.size())
+	{
+		framesDropped++;
+		return false;
+	}
+	Frame& frame = slots[h % slots.size()];
+	frame.day = s.day;
+	if (c)
+		frame.conservation = *c;
+	else
+		resetConservation(frame.conservation);
+	const std::vector<double>* columns[TRAJECTORY_COLUMNS] = { &s.px, &s.py, &s.pz, &s.vx, &s.vy, &s.vz };
+	for (uint32_t k = 0; k < TRAJECTORY_COLUMNS; k++)
+		memcpy(frame.columns[k].data(), columns[k]->data(), count * sizeof(double));
+	head.store(h + 1, std::memory_order_release);
+	wake.notify_one();
+	return true;
+}
+
+bool TrajectorySink::flushChunk()
+{
+	PROFILE_SCOPE("TrajectorySink::flushChunk");
+	uint32_t frames = (uint32_t)chunkDays.size();
+	if (frames == 0)
+		return true;
+	//Columns are encoded in parallel, velocities first: the quantized codec
+	//predicts positions from the velocities the decoder will see
+	CodecParams params[TRAJECTORY_COLUMNS];
+	for (uint32_t c = 0; c < TRAJECTORY_COLUMNS; c++)
+	{
+		blocks[c].clear();
+		params[c].errorBound = c < 3 ? positionError : velocityError;
+		if (codec == CODEC_QUANT && c < 3)
+		{
+			decodedRate[c].resize(chunk[c].size());
+			params[c].rate = decodedRate[c].data();
+			params[c].days = chunkDays.data();
+		}
+	}
+	parallelFor(3, [&](size_t begin, size_t end)
+	{
+		PROFILE_SCOPE("encode velocities");
+		for (size_t c = begin + 3; c < end + 3; c++)
+			encodeColumn(codec, chunk[c].data(), frames, count, blocks[c], params[c], codec == CODEC_QUANT ? decodedRate[c - 3].data() : nullptr);
+	});
+	parallelFor(3, [&](size_t begin, size_t end)
+	{
+		PROFILE_SCOPE("encode positions");
+		for (size_t c = begin; c < end; c++)
+			encodeColumn(codec, chunk[c].data(), frames, count, blocks[c], params[c]);
+	});
+	encoded.clear();
+	for (uint32_t c = 0; c < TRAJECTORY_COLUMNS; c++)
+	{
+		uint64_t size = blocks[c].size();
+		encoded.insert(encoded.end(), (unsigned char*)&size, (unsigned char*)&size + sizeof(size));
+		encoded.insert(encoded.end(), blocks[c].begin(), blocks[c].end());
+		chunk[c].clear();
+	}
+	TrajectoryChunk h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, TRAJECTORY_CHUNK_MAGIC, sizeof(h.magic));
+	h.codec = codec;
+	h.frames = frames;
+	h.flags = chunkHasConservation ? TRAJECTORY_DIAGNOSTICS : 0;
+	size_t conservationBytes = chunkHasConservation ? frames * sizeof(Conservation) : 0;
+	h.size = frames * sizeof(double) + conservationBytes + encoded.size();
+	h.firstDay = chunkDays.front();
+	h.lastDay = chunkDays.back();
+	PROFILE_SCOPE("write chunk");
+	bool success = fwrite(&h, sizeof(h), 1, file) == 1
+		&& fwrite(chunkDays.data(), sizeof(double), frames, file) == frames
+		&& (!chunkHasConservation || fwrite(chunkConservation.data(), sizeof(Conservation), frames, file) == frames)
+		&& fwrite(encoded.data(), 1, encoded.size(), file) == encoded.size()
+		&& fflush(file) == 0;
+	if (success)
+	{
+		TrajectoryIndexEntry entry = { h.firstDay, h.lastDay, offset, frames };
+		index.push_back(entry);
+		offset += sizeof(h) + h.size;
+		bytesWritten = offset;
+		framesWritten += frames;
+	}
+	else
+	{
+		//The file ends with a torn chunk; nothing more is written after it
+		writeFailed = true;
+		framesDropped += frames;
+	}
+	chunkDays.clear();
+	chunkConservation.clear();
+	chunkHasConservation = false;
+	return success;
+}
+
+void TrajectorySink::run()
+{
+	profileThreadName("trajectory writer");
+	ALLOC_SCOPE("trajectory");
+	while (true)
+	{
+		uint64_t t = tail.load(std::memory_order_relaxed);
+		if (t == head.load(std::memory_order_acquire))
+		{
+			if (stop)
+				break;
+			std::unique_lock<std::mutex> guard(lock);
+			//push() notifies without the lock, the timeout covers a missed wakeup
+			wake.wait_for(guard, std::chrono::milliseconds(10));
+			continue;
+		}
+		//After a failed write the frames are taken off the queue and dropped
+		if (writeFailed)
+		{
+			framesDropped++;
+			tail.store(t + 1, std::memory_order_release);
+			continue;
+		}
+		const Frame& frame = slots[t % slots.size()];
+		chunkDays.push_back(frame.day);
+		chunkConservation.push_back(frame.conservation);
+		chunkHasConservation = chunkHasConservation || frame.conservation.mass != 0.0;
+		for (uint32_t c = 0; c < TRAJECTORY_COLUMNS; c++)
+			chunk[c].insert(chunk[c].end(), frame.columns[c].begin(), frame.columns[c].end());
+		tail.store(t + 1, std::memory_order_release);
+		if (chunkDays.size() >= framesPerChunk)
+			flushChunk();
+	}
+	flushChunk();
+	//Without a footer the reader walks the chunks up to the torn one
+	if (writeFailed)
+		return;
+	TrajectoryFooter footer;
+	memset(&footer, 0, sizeof(footer));
+	footer.indexOffset = offset;
+	footer.chunks = index.size();
+	memcpy(footer.magic, TRAJECTORY_FOOTER_MAGIC, sizeof(footer.magic));
+	if (fwrite(index.data(), sizeof(TrajectoryIndexEntry), index.size(), file) != index.size()
+		|| fwrite(&footer, sizeof(footer), 1, file) != 1)
+		writeFailed = true;
+}
@@ -0,0 +1,158 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdio>
+#include "state.h"
+#include "codec.h"
+#include "diagnostics.h"
+
+//Trajectory file layout (little-endian):
+//TrajectoryHeader, then chunks. A chunk is a TrajectoryChunk header, the day of
+//every frame (double), with TRAJECTORY_DIAGNOSTICS in flags a Conservation per
+//frame (zero for frames pushed without one), and one encoded block per column
+//(px py pz vx vy vz), each preceded by its size in bytes (uint64). close() appends the chunk index
+//(one TrajectoryIndexEntry per chunk) and a TrajectoryFooter; a file without
+//a footer, e.g. after a crash, is indexed by walking the chunk headers.
+const uint32_t TRAJECTORY_VERSION = 2;
+const uint32_t TRAJECTORY_DIAGNOSTICS = 1;
+const uint32_t TRAJECTORY_COLUMNS = 6;
+extern const char TRAJECTORY_MAGIC[8];
+extern const char TRAJECTORY_CHUNK_MAGIC[4];
+extern const char TRAJECTORY_FOOTER_MAGIC[8];
+
+struct TrajectoryHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t columns;
+	uint64_t count;
+	uint32_t framesPerChunk;
+	uint32_t reserved[3];
+};
+
+struct TrajectoryChunk
+{
+	char magic[4];
+	uint32_t codec;
+	uint32_t frames;
+	//Zero in version 1 files
+	uint32_t flags;
+	//Bytes after this header up to the next chunk
+	uint64_t size;
+	double firstDay;
+	double lastDay;
+};
+
+struct TrajectoryIndexEntry
+{
+	double firstDay;
+	double lastDay;
+	uint64_t offset;
+	uint64_t frames;
+};
+
+struct TrajectoryFooter
+{
+	uint64_t indexOffset;
+	uint64_t chunks;
+	char magic[8];
+	uint64_t reserved;
+};
+
+//Records the state at output intervals. push() copies the state into a
+//preallocated slot of a single-producer single-consumer ring and returns,
+//chunking, encoding and disk writes happen on a background thread.
+class TrajectorySink
+{
+public:
+	TrajectorySink();
+	~TrajectorySink();
+	//Create the file and start the writer thread
+	bool open(const std::string& path, size_t bodies, Codec codec, uint32_t framesPerChunk = 64, size_t queueFrames = 256);
+	//Error bounds of the quantized codec, m and m/s, set before open()
+	void setErrorBounds(double position, double velocity)
+	{
+		positionError = position;
+		velocityError = velocity;
+	}
+	//Flush queued frames, write the index and close the file
+	void close();
+	bool isOpen() const
+	{
+		return file != NULL;
+	}
+	//Queue a frame and its conserved quantities, if any. Returns false and counts
+	//the frame as dropped if the queue is full.
+	bool push(const State& s, const Conservation* c = nullptr);
+	//Frames written to disk
+	uint64_t written() const
+	{
+		return framesWritten;
+	}
+	//Frames rejected because the writer fell behind, or discarded after a failed write
+	uint64_t dropped() const
+	{
+		return framesDropped;
+	}
+	//Frames waiting in the queue
+	size_t queued() const
+	{
+		return (size_t)(head.load() - tail.load());
+	}
+	size_t capacity() const
+	{
+		return slots.size();
+	}
+	//Bytes written to disk
+	uint64_t bytes() const
+	{
+		return bytesWritten;
+	}
+	//Did a disk write fail
+	bool failed() const
+	{
+		return writeFailed;
+	}
+
+private:
+	struct Frame
+	{
+		double day;
+		Conservation conservation;
+		std::vector<double> columns[TRAJECTORY_COLUMNS];
+	};
+	void run();
+	bool flushChunk();
+	FILE* file;
+	size_t count;
+	Codec codec;
+	uint32_t framesPerChunk;
+	std::vector<Frame> slots;
+	//Producer and consumer positions, slot = position % capacity
+	std::atomic<uint64_t> head;
+	std::atomic<uint64_t> tail;
+	std::atomic<uint64_t> framesWritten;
+	std::atomic<uint64_t> framesDropped;
+	std::atomic<uint64_t> bytesWritten;
+	std::atomic<bool> writeFailed;
+	std::atomic<bool> stop;
+	double positionError;
+	double velocityError;
+	std::thread worker;
+	std::mutex lock;
+	std::condition_variable wake;
+	//Writer thread only: the chunk being assembled, column-major
+	std::vector<double> chunkDays;
+	std::vector<Conservation> chunkConservation;
+	bool chunkHasConservation;
+	std::vector<double> chunk[TRAJECTORY_COLUMNS];
+	std::vector<unsigned char> blocks[TRAJECTORY_COLUMNS];
+	std::vector<double> decodedRate[3];
+	std::vector<unsigned char> encoded;
+	std::vector<TrajectoryIndexEntry> index;
+	uint64_t offset;
+};
@@ -0,0 +1,201 @@
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include "tree.h"
+#include "profiler.h"
+
+namespace
+{
+	const uint32_t LEAF_SIZE = 16;
+	const int MAX_DEPTH = 48;
+	//Traversal stack: at most 8 children pushed per level
+	const int STACK_SIZE = 8 * MAX_DEPTH + 8;
+}
+
+void Octree::build(const State& s)
+{
+	PROFILE_SCOPE("Octree::build");
+	order.clear();
+	nodes.clear();
+	double lo[3] = { HUGE_VAL, HUGE_VAL, HUGE_VAL };
+	double hi[3] = { -HUGE_VAL, -HUGE_VAL, -HUGE_VAL };
+	for (size_t j = 0; j < s.size(); j++)
+	{
+		if (s.gm[j] == 0.0)
+			continue;
+		order.push_back((uint32_t)j);
+		double p[3] = { s.px[j], s.py[j], s.pz[j] };
+		for (int k = 0; k < 3; k++)
+		{
+			lo[k] = std::min(lo[k], p[k]);
+			hi[k] = std::max(hi[k], p[k]);
+		}
+	}
+	if (order.empty())
+		return;
+	scratch.resize(order.size());
+	double half = 0.5 * std::max(hi[0] - lo[0], std::max(hi[1] - lo[1], hi[2] - lo[2])) * 1.0001 + 1.0;
+	split(s, 0, (uint32_t)order.size(), 0.5 * (lo[0] + hi[0]), 0.5 * (lo[1] + hi[1]), 0.5 * (lo[2] + hi[2]), half, 0);
+	size_t n = order.size();
+	x.resize(n);
+	y.resize(n);
+	z.resize(n);
+	gm.resize(n);
+	for (size_t k = 0; k < n; k++)
+	{
+		x[k] = s.px[order[k]];
+		y[k] = s.py[order[k]];
+		z[k] = s.pz[order[k]];
+		gm[k] = s.gm[order[k]];
+	}
+}
+
+int Octree::split(const State& s, uint32_t first, uint32_t count, double cx, double cy, double cz, double half, int depth)
+{
+	Node node;
+	node.x = node.y = node.z = node.gm = 0.0;
+	node.size = 2.0 * half;
+	node.first = first;
+	node.count = count;
+	node.leaf = true;
+	for (int k = 0; k < 8; k++)
+		node.child[k] = -1;
+	for (uint32_t k = first; k < first + count; k++)
+	{
+		uint32_t j = order[k];
+		node.gm += s.gm[j];
+		node.x += s.gm[j] * s.px[j];
+		node.y += s.gm[j] * s.py[j];
+		node.z += s.gm[j] * s.pz[j];
+	}
+	if (node.gm != 0.0)
+	{
+		node.x /= node.gm;
+		node.y /= node.gm;
+		node.z /= node.gm;
+	}
+	int index = (int)nodes.size();
+	nodes.push_back(node);
+	if (count <= LEAF_SIZE || depth >= MAX_DEPTH)
+		return index;
+	nodes[index].leaf = false;
+	//Counting sort of the range by octant
+	uint32_t counts[8] = { 0 };
+	for (uint32_t k = first; k < first + count; k++)
+	{
+		uint32_t j = order[k];
+		counts[(s.px[j] >= cx) | (s.py[j] >= cy) << 1 | (s.pz[j] >= cz) << 2]++;
+	}
+	uint32_t starts[8];
+	uint32_t next[8];
+	starts[0] = first;
+	for (int o = 1; o < 8; o++)
+		starts[o] = starts[o - 1] + counts[o - 1];
+	memcpy(next, starts, sizeof(next));
+	for (uint32_t k = first; k < first + count; k++)
+	{
+		uint32_t j = order[k];
+		scratch[next[(s.px[j] >= cx) | (s.py[j] >= cy) << 1 | (s.pz[j] >= cz) << 2]++] = j;
+	}
+	std::copy(scratch.begin() + first, scratch.begin() + first + count, order.begin() + first);
+	double quarter = 0.5 * half;
+	for (int o = 0; o < 8; o++)
+	{
+		if (counts[o] == 0)
+			continue;
+		int c = split(s, starts[o], counts[o],
+			cx + (o & 1 ? quarter : -quarter),
+			cy + (o & 2 ? quarter : -quarter),
+			cz + (o & 4 ? quarter : -quarter), quarter, depth + 1);
+		nodes[index].child[o] = c;
+	}
+	return index;
+}
+
+void Octree::accel(double px, double py, double pz, double eps2, double theta2, double& ax, double& ay, double& az) const
+{
+	ax = ay = az = 0.0;
+	if (nodes.empty())
+		return;
+	int stack[STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0)
+	{
+		const Node& node = nodes[stack[--top]];
+		double dx = node.x - px;
+		double dy = node.y - py;
+		double dz = node.z - pz;
+		double d2 = dx * dx + dy * dy + dz * dz;
+		if (node.size * node.size < theta2 * d2)
+		{
+			double rinv = 1.0 / std::sqrt(d2 + eps2);
+			double F = node.gm * rinv * rinv * rinv;
+			ax += dx * F;
+			ay += dy * F;
+			az += dz * F;
+			continue;
+		}
+		if (node.leaf)
+		{
+			for (uint32_t k = node.first; k < node.first + node.count; k++)
+			{
+				double ex = x[k] - px;
+				double ey = y[k] - py;
+				double ez = z[k] - pz;
+				double r2 = ex * ex + ey * ey + ez * ez + eps2;
+				//The body itself, only reachable without softening
+				if (r2 == 0.0)
+					continue;
+				double rinv = 1.0 / std::sqrt(r2);
+				double F = gm[k] * rinv * rinv * rinv;
+				ax += ex * F;
+				ay += ey * F;
+				az += ez * F;
+			}
+			continue;
+		}
+		for (int o = 0; o < 8; o++)
+			if (node.child[o] >= 0)
+				stack[top++] = node.child[o];
+	}
+}
+
+double Octree::potential(size_t i, double eps2, double theta2) const
+{
+	double px = x[i], py = y[i], pz = z[i];
+	double phi = 0.0;
+	int stack[STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0)
+	{
+		const Node& node = nodes[stack[--top]];
+		double dx = node.x - px;
+		double dy = node.y - py;
+		double dz = node.z - pz;
+		double d2 = dx * dx + dy * dy + dz * dz;
+		if (node.size * node.size < theta2 * d2)
+		{
+			phi -= node.gm / std::sqrt(d2 + eps2);
+			continue;
+		}
+		if (node.leaf)
+		{
+			for (uint32_t k = node.first; k < node.first + node.count; k++)
+			{
+				if (k == i)
+					continue;
+				double ex = x[k] - px;
+				double ey = y[k] - py;
+				double ez = z[k] - pz;
+				phi -= gm[k] / std::sqrt(ex * ex + ey * ey + ez * ez + eps2);
+			}
+			continue;
+		}
+		for (int o = 0; o < 8; o++)
+			if (node.child[o] >= 0)
+				stack[top++] = node.child[o];
+	}
+	return phi;
+}
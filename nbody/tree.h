@@ -0,0 +1,50 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include "state.h"
+
+//Barnes-Hut octree over the massive bodies of a state. Bodies are packed in tree order,
+//so leaves read contiguous memory. Buffers are kept between builds.
+class Octree
+{
+public:
+	//Build over the bodies of s with gm != 0; positions are copied, s may change afterwards
+	void build(const State& s);
+	//Number of bodies in the tree
+	size_t size() const
+	{
+		return order.size();
+	}
+	//Index in the state of packed body k
+	uint32_t body(size_t k) const
+	{
+		return order[k];
+	}
+	//Acceleration at a point, gravity constant included. Cells smaller than theta times
+	//their distance are taken whole; a body at exactly the point adds nothing.
+	void accel(double px, double py, double pz, double eps2, double theta2, double& ax, double& ay, double& az) const;
+	//Potential per unit mass at packed body k, itself excluded. A body inside an accepted
+	//cell would see itself: keep theta below 1/sqrt(3).
+	double potential(size_t k, double eps2, double theta2) const;
+
+private:
+	struct Node
+	{
+		//Centre of mass and total gm
+		double x, y, z, gm;
+		//Cube edge
+		double size;
+		//Bodies of a leaf, a range of the order array
+		uint32_t first, count;
+		bool leaf;
+		int32_t child[8];
+	};
+
+	int split(const State& s, uint32_t first, uint32_t count, double cx, double cy, double cz, double half, int depth);
+
+	std::vector<uint32_t> order;
+	std::vector<uint32_t> scratch;
+	std::vector<Node> nodes;
+	std::vector<double> x, y, z, gm;
+};
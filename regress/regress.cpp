@@ -0,0 +1,456 @@
+//Performance regression suite.
+//
+//  regress [--scenarios solar,plummer,particles] [--repeat 5] [--threads 0]
+//          [--baseline baseline.csv] [--out results.csv] [--report report.md]
+//          [--tolerance 0.1] [--noise 3] [--accuracy 0.25]
+//
+//Every scenario starts from the same state and runs a fixed number of steps, so its
+//timings and conservation errors are comparable between builds. Timings are the median
+//over the repeats with the median absolute deviation as the noise estimate. With --baseline
+//a scenario regressed if it got slower by more than the tolerance and by more than noise
+//times the combined deviation, or if its conservation errors grew by more than the accuracy
+//tolerance. Timings are only compared against a baseline row of the same machine and thread
+//count, conservation errors always. The exit code is then 1 on a regression, 3 if nothing
+//regressed but some timings had no baseline row to compare with.
+//
+//A baseline file may hold the rows of several machines. To add this one, run the suite with
+//--out and append its rows without the header line to the baseline:
+//
+//  regress --out machine.csv && tail -n +2 machine.csv >> regress/baseline.csv
+//
+//The scenarios step the SoA State with stepState(). The viewer steps the Solar System through
+//its own Body objects in main.cpp, which this suite doesn't time.
+//No window and no GL context are created, the suite runs on headless machines.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <algorithm>
+#include "state.h"
+#include "parallel.h"
+#include "physics.h"
+#include "diagnostics.h"
+#include "scenario.h"
+#include "solar.h"
+#include "autotune.h"
+
+unsigned int gThreads = 0;
+
+//Scale of the median absolute deviation to a standard deviation of normal noise
+const double MAD_SIGMA = 1.4826;
+//Conservation errors below this are rounding, they don't count as a regression
+const double ACCURACY_FLOOR = 1e-12;
+
+struct Scenario
+{
+	const char* name;
+	//Bodies
+	size_t n;
+	//Steps per run
+	long long steps;
+	//What is timed, for the report
+	const char* kernel;
+};
+
+//The bundled Solar System for 100 years of daily steps, a Plummer sphere of 10^4
+//self-gravitating bodies and 10^6 massless asteroids around the Sun and Jupiter
+static const Scenario SCENARIOS[] =
+{
+	{ "solar", SOLAR_BODIES, 36500, "stepState, not the viewer's Body step" },
+	{ "plummer", 10000, 10, "stepState" },
+	{ "particles", 1000000, 100, "stepState" },
+};
+
+struct Result
+{
+	std::string scenario;
+	const char* kernel;
+	size_t n;
+	long long steps;
+	unsigned int threads;
+	int repeat;
+	//Seconds per step
+	double median;
+	double mad;
+	ConservationError error;
+	std::string machine;
+};
+
+struct Options
+{
+	std::vector<std::string> scenarios;
+	int repeat;
+	unsigned int threads;
+	std::string baseline;
+	std::string out;
+	std::string report;
+	double tolerance;
+	double noise;
+	double accuracy;
+};
+
+static std::vector<std::string> split(const char* s)
+{
+	std::vector<std::string> items;
+	std::string item;
+	for (const char* c = s; ; c++)
+	{
+		if (*c == ',' || *c == 0 || *c == '\n' || *c == '\r')
+		{
+			if (!item.empty())
+				items.push_back(item);
+			item.clear();
+			if (*c == 0)
+				break;
+		}
+		else
+		{
+			item += *c;
+		}
+	}
+	return items;
+}
+
+//The initial state and integration settings of a scenario
+static void setup(const Scenario& scenario, State& s, ScenarioSettings& settings)
+{
+	if (!strcmp(scenario.name, "solar"))
+	{
+		solarSystem(s);
+		settings.softening = 0.0;
+		settings.step = 86400.0f;
+	}
+	else if (!strcmp(scenario.name, "plummer"))
+	{
+		settings = generateScenario(SCENARIO_PLUMMER, scenario.n, 1, s);
+	}
+	else
+	{
+		settings = generateScenario(SCENARIO_BELT, scenario.n, 1, s);
+	}
+}
+
+static double median(std::vector<double> values)
+{
+	std::sort(values.begin(), values.end());
+	size_t m = values.size() / 2;
+	return values.size() % 2 ? values[m] : 0.5 * (values[m - 1] + values[m]);
+}
+
+//Run the scenario opt.repeat times from its initial state; conservation errors of the first run,
+//the runs are identical apart from their timing
+static Result run(const Scenario& scenario, const Options& opt)
+{
+	typedef std::chrono::steady_clock Clock;
+	Result r;
+	r.scenario = scenario.name;
+	r.kernel = scenario.kernel;
+	r.n = scenario.n;
+	r.steps = scenario.steps;
+	r.threads = threadCount(scenario.n, opt.threads);
+	r.repeat = opt.repeat;
+	char machine[128];
+	machineId(machine, sizeof(machine));
+	r.machine = machine;
+	std::vector<double> times;
+	State s;
+	ScenarioSettings settings;
+	for (int k = 0; k < opt.repeat; k++)
+	{
+		setup(scenario, s, settings);
+		Conservation start;
+		if (k == 0)
+			measureConservation(s, settings.softening, start);
+		Clock::time_point begin = Clock::now();
+		for (long long i = 0; i < scenario.steps; i++)
+			stepState(s, settings.step, settings.softening, DEFAULT_SOLVER);
+		times.push_back(std::chrono::duration<double>(Clock::now() - begin).count() / scenario.steps);
+		if (k == 0)
+		{
+			Conservation end;
+			measureConservation(s, settings.softening, end);
+			r.error = conservationError(end, start);
+		}
+	}
+	r.median = median(times);
+	std::vector<double> deviations;
+	for (double t : times)
+		deviations.push_back(std::fabs(t - r.median));
+	r.mad = median(deviations);
+	return r;
+}
+
+static const char* HEADER = "scenario,n,steps,threads,repeat,median_seconds_per_step,mad_seconds_per_step,"
+	"energy_error,momentum_error,angular_error,drift,machine";
+
+static void printResult(FILE* f, const Result& r)
+{
+	fprintf(f, "%s,%llu,%lld,%u,%d,%.6e,%.6e,%.6e,%.6e,%.6e,%.6e,%s\n", r.scenario.c_str(), (unsigned long long)r.n, r.steps,
+		r.threads, r.repeat, r.median, r.mad, r.error.energy, r.error.momentum, r.error.angular, r.error.drift, r.machine.c_str());
+}
+
+//Rows of every scenario, one per machine and thread count
+static bool readResults(const std::string& path, std::multimap<std::string, Result>& rows)
+{
+	FILE* f = fopen(path.c_str(), "r");
+	if (!f)
+		return false;
+	char line[512];
+	while (fgets(line, sizeof(line), f))
+	{
+		std::vector<std::string> fields = split(line);
+		if (fields.size() < 12 || fields[0] == "scenario")
+			continue;
+		Result r;
+		r.scenario = fields[0];
+		r.kernel = "";
+		r.n = (size_t)atof(fields[1].c_str());
+		r.steps = atoll(fields[2].c_str());
+		r.threads = (unsigned int)atoi(fields[3].c_str());
+		r.repeat = atoi(fields[4].c_str());
+		r.median = atof(fields[5].c_str());
+		r.mad = atof(fields[6].c_str());
+		r.error.energy = atof(fields[7].c_str());
+		r.error.momentum = atof(fields[8].c_str());
+		r.error.angular = atof(fields[9].c_str());
+		r.error.drift = atof(fields[10].c_str());
+		r.machine = fields[11];
+		rows.insert(std::make_pair(r.scenario, r));
+	}
+	fclose(f);
+	return true;
+}
+
+//Outcome of one scenario against its baseline
+struct Verdict
+{
+	const Result* baseline;
+	//Timings of the same machine and thread count
+	bool timed;
+	bool slower;
+	bool lessAccurate;
+	//Relative change of the median and the threshold the noise sets
+	double change;
+	double noise;
+};
+
+//The baseline row of the same machine and thread count, else any row of the scenario for
+//the conservation errors
+static const Result* findBaseline(const std::multimap<std::string, Result>& rows, const Result& r)
+{
+	const Result* any = NULL;
+	auto range = rows.equal_range(r.scenario);
+	for (auto it = range.first; it != range.second; ++it)
+	{
+		const Result& b = it->second;
+		if (b.n != r.n || b.steps != r.steps)
+			continue;
+		if (b.machine == r.machine && b.threads == r.threads)
+			return &b;
+		any = &b;
+	}
+	return any;
+}
+
+static bool worse(double value, double reference, double tolerance)
+{
+	return value > reference * (1.0 + tolerance) + ACCURACY_FLOOR;
+}
+
+static Verdict compare(const Result& r, const Result* b, const Options& opt)
+{
+	Verdict v;
+	v.baseline = b;
+	v.timed = false;
+	v.slower = false;
+	v.lessAccurate = false;
+	v.change = 0.0;
+	v.noise = 0.0;
+	if (!b || b->n != r.n || b->steps != r.steps)
+	{
+		v.baseline = NULL;
+		return v;
+	}
+	v.timed = b->machine == r.machine && b->threads == r.threads && b->median > 0.0;
+	if (v.timed)
+	{
+		v.change = r.median / b->median - 1.0;
+		v.noise = opt.noise * MAD_SIGMA * std::sqrt(r.mad * r.mad + b->mad * b->mad) / b->median;
+		v.slower = v.change > std::max(opt.tolerance, v.noise);
+	}
+	v.lessAccurate = worse(r.error.energy, b->error.energy, opt.accuracy) ||
+		worse(r.error.momentum, b->error.momentum, opt.accuracy) ||
+		worse(r.error.angular, b->error.angular, opt.accuracy);
+	return v;
+}
+
+static bool writeReport(const std::string& path, const std::vector<Result>& results, const std::vector<Verdict>& verdicts, int untimed, const Options& opt)
+{
+	FILE* f = fopen(path.c_str(), "w");
+	if (!f)
+		return false;
+	fprintf(f, "# Regression report\n\n");
+	fprintf(f, "Machine `%s`, %d repeats, timing tolerance %.0f%% or %.3g noise deviations, accuracy tolerance %.0f%%.\n\n",
+		results.empty() ? "" : results[0].machine.c_str(), opt.repeat, opt.tolerance * 100.0, opt.noise, opt.accuracy * 100.0);
+	if (!opt.baseline.empty())
+		fprintf(f, "Baseline `%s`.\n\n", opt.baseline.c_str());
+	if (untimed > 0)
+		fprintf(f, "**Timings of %d of %d scenarios were not compared: the baseline has no row of this machine and thread count.** "
+			"Record one with `--out` and append its rows to the baseline.\n\n", untimed, (int)results.size());
+	fprintf(f, "| scenario | kernel | n | steps | threads | ms/step | MAD | baseline ms/step | change | energy error | baseline | status |\n");
+	fprintf(f, "|---|---|---|---|---|---|---|---|---|---|---|---|\n");
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const Result& r = results[i];
+		const Verdict& v = verdicts[i];
+		fprintf(f, "| %s | %s | %llu | %lld | %u | %.4g | %.2g | ", r.scenario.c_str(), r.kernel, (unsigned long long)r.n, r.steps, r.threads,
+			r.median * 1e3, r.mad * 1e3);
+		if (v.timed)
+			fprintf(f, "%.4g | %+.1f%% | ", v.baseline->median * 1e3, v.change * 100.0);
+		else
+			fprintf(f, "- | - | ");
+		fprintf(f, "%.3e | ", r.error.energy);
+		if (v.baseline)
+			fprintf(f, "%.3e | ", v.baseline->error.energy);
+		else
+			fprintf(f, "- | ");
+		if (!v.baseline)
+			fprintf(f, "no baseline |\n");
+		else if (v.slower || v.lessAccurate)
+			fprintf(f, "**REGRESSION**%s%s |\n", v.slower ? " slower" : "", v.lessAccurate ? " less accurate" : "");
+		else if (!v.timed)
+			fprintf(f, "ok, timing not compared |\n");
+		else
+			fprintf(f, "ok |\n");
+	}
+	fprintf(f, "\nTimings are compared only with a baseline of the same machine and thread count; "
+		"conservation errors are relative to the initial state after all steps of the first run.\n");
+	return fclose(f) == 0;
+}
+
+int main(int argc, char* argv[])
+{
+	Options opt;
+	opt.scenarios = { "solar", "plummer", "particles" };
+	opt.repeat = 5;
+	opt.threads = 0;
+	opt.tolerance = 0.1;
+	opt.noise = 3.0;
+	opt.accuracy = 0.25;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+		if (!value)
+		{
+			fprintf(stderr, "Missing value for %s\n", arg.c_str());
+			return 2;
+		}
+		i++;
+		if (arg == "--scenarios")
+			opt.scenarios = split(value);
+		else if (arg == "--repeat")
+			opt.repeat = std::max(1, atoi(value));
+		else if (arg == "--threads")
+			opt.threads = (unsigned int)atoi(value);
+		else if (arg == "--baseline")
+			opt.baseline = value;
+		else if (arg == "--out")
+			opt.out = value;
+		else if (arg == "--report")
+			opt.report = value;
+		else if (arg == "--tolerance")
+			opt.tolerance = atof(value);
+		else if (arg == "--noise")
+			opt.noise = atof(value);
+		else if (arg == "--accuracy")
+			opt.accuracy = atof(value);
+		else
+		{
+			fprintf(stderr, "Unknown option %s\n", arg.c_str());
+			return 2;
+		}
+	}
+
+	gThreads = opt.threads;
+	std::multimap<std::string, Result> baseline;
+	if (!opt.baseline.empty() && !readResults(opt.baseline, baseline))
+	{
+		fprintf(stderr, "Couldn't read baseline %s\n", opt.baseline.c_str());
+		return 2;
+	}
+	std::vector<Result> results;
+	std::vector<Verdict> verdicts;
+	int regressions = 0;
+	//Scenarios whose timing had no baseline row to compare with
+	int untimed = 0;
+	printf("%s\n", HEADER);
+	for (auto& name : opt.scenarios)
+	{
+		const Scenario* scenario = NULL;
+		for (auto& candidate : SCENARIOS)
+			if (name == candidate.name)
+				scenario = &candidate;
+		if (!scenario)
+		{
+			fprintf(stderr, "Unknown scenario %s\n", name.c_str());
+			return 2;
+		}
+		results.push_back(run(*scenario, opt));
+		const Result& r = results.back();
+		printResult(stdout, r);
+		fflush(stdout);
+		verdicts.push_back(compare(r, findBaseline(baseline, r), opt));
+		const Verdict& v = verdicts.back();
+		if (!opt.baseline.empty() && !v.timed)
+		{
+			fprintf(stderr, "NOT TIMED %s: no baseline row for machine %s with %u threads\n", r.scenario.c_str(), r.machine.c_str(), r.threads);
+			untimed++;
+		}
+		if (v.slower)
+			fprintf(stderr, "REGRESSION %s: %.4g -> %.4g ms/step (%+.1f%%, noise %.1f%%)\n", r.scenario.c_str(),
+				v.baseline->median * 1e3, r.median * 1e3, v.change * 100.0, v.noise * 100.0);
+		if (v.lessAccurate)
+			fprintf(stderr, "REGRESSION %s: conservation errors E %.3e -> %.3e, P %.3e -> %.3e, L %.3e -> %.3e\n", r.scenario.c_str(),
+				v.baseline->error.energy, r.error.energy, v.baseline->error.momentum, r.error.momentum,
+				v.baseline->error.angular, r.error.angular);
+		if (v.slower || v.lessAccurate)
+			regressions++;
+	}
+
+	if (!opt.out.empty())
+	{
+		FILE* f = fopen(opt.out.c_str(), "w");
+		if (!f)
+		{
+			fprintf(stderr, "Couldn't write %s\n", opt.out.c_str());
+			return 2;
+		}
+		fprintf(f, "%s\n", HEADER);
+		for (auto& r : results)
+			printResult(f, r);
+		fclose(f);
+	}
+	if (!opt.report.empty() && !writeReport(opt.report, results, verdicts, untimed, opt))
+	{
+		fprintf(stderr, "Couldn't write %s\n", opt.report.c_str());
+		return 2;
+	}
+	if (opt.baseline.empty())
+		return 0;
+	fprintf(stderr, "%d of %d scenarios regressed\n", regressions, (int)results.size());
+	if (regressions > 0)
+		return 1;
+	if (untimed > 0)
+	{
+		fprintf(stderr, "Timings of %d scenarios not compared, record a baseline of this machine with --out and append its rows to %s\n",
+			untimed, opt.baseline.c_str());
+		return 3;
+	}
+	return 0;
+}